@@ -29,13 +29,21 @@ The following commands are supported as of now:
 3. PRA0X: Read RA0 output bit status.
 4. AW00E: Enable AN0. To disable, AW00D
 5. ARC01: Read a value from AN1
-6. MWS0X: Setup PWM for CCP0
+6. MWS0X: Setup 50 Hz PWM for CCP1 (RC2). MWS1X for CCP2 (RC1)
 7. MW050: Set PWM duty cycle as 50%. Maximum is 99.
 8. UWTXE: Enable UART Transmission. To disable, UWTXD
 9. UWRXE: Enable UART Reception. To disable, UWRXD
 10.UWTtX: Write the character 't' to the UART port
 11.URRXX: Read a character from UART port.
 
+Dispatch:
+Commands are dispatched through app_table[], indexed by the first
+character, so every command costs the same to look up no matter how
+many command types there are. The same holds one level down: port
+registers and bit masks come from tables instead of switch statements.
+Firmware/bench/dispatch_bench.c builds this file on the host to track
+the cost per command.
+
 Notes:
 1. The following pins are availabe for digital i/0:
    RA0-RA5, RC0-RC2, RC6-RC7, RB2-RB7.
@@ -45,61 +53,331 @@ Notes:
 4. UART transmission rate is set at 9600bps.
 4. The user is responsible for giving the commands in right order.
    Any errors will not be identified by the microcontroller.
+5. One OUT packet may carry up to 12 commands back to back, at
+   offsets 0, 5, 10, ... 55. They are run in order and the list ends
+   at the first slot that does not hold a command (eg zero padding).
+   All results come back in a single IN packet:
+   [0]      First byte of the first command
+   [1]      Number of commands run
+   [2..]    Two bytes per command, LSB first. 0 for a write, the
+            value read for a read, 0xFFFF for a command that is not
+            supported or malformed.
 *******************************************************************/
 
-// Set the direction of the port as per the command
+#define APP_CMD_SIZE		5
+#define APP_MAX_BATCH		12
+#define APP_REPLY_HEADER	2
+
+#define APP_NUM_PORTS		3		// A, B and C
+#define APP_NUM_PWM			2		// CCP1 (RC2) and CCP2 (RC1)
+#define APP_PWM_STEPS		100		// Timer2 ticks per 20 ms PWM period
+
+// Every command handler gets the 5 characters and returns the value read,
+// 0 for a write or -1 if the command is not supported.
+typedef int (*app_handler)( unsigned char *cmd);
+
+static int adc_handler( unsigned char *cmd);
+static int dir_handler( unsigned char *cmd);
+static int pwm_handler( unsigned char *cmd);
+static int port_handler( unsigned char *cmd);
+static int uart_handler( unsigned char *cmd);
+
+// Indexed by the first character of a command minus 'A'.
+ROM app_handler app_table[26] = {
+	adc_handler,						// A
+	0, 0,								// B, C
+	dir_handler,						// D
+	0, 0, 0, 0, 0, 0, 0, 0,				// E - L
+	pwm_handler,						// M
+	0, 0,								// N, O
+	port_handler,						// P
+	0, 0, 0, 0,							// Q - T
+	uart_handler,						// U
+	0, 0, 0, 0, 0						// V - Z
+};
+
+volatile unsigned char * ROM tris_regs[APP_NUM_PORTS] = { &TRISA, &TRISB, &TRISC };
+volatile unsigned char * ROM lat_regs[APP_NUM_PORTS] = { &LATA, &LATB, &LATC };
+ROM unsigned char bit_mask[8] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
+
+// Software PWM, stepped by the Timer2 interrupt in main.c every 200 us.
+// pwm_duty[] is in percent of the 20 ms period, 0 turns the output off.
+volatile unsigned char pwm_enabled;		// Bit n set for CCPn+1 pin
+volatile unsigned char pwm_duty[APP_NUM_PWM];
+volatile unsigned char pwm_step;
+
+// Set the direction of the port as per the command. Ports other than
+// A-C and bits other than 0-7 are ignored.
 void dir_cmd( unsigned char port, int pbit, unsigned char dir)
 {
-	switch(port){
-		case 'A':
-			if(dir == 'O')
-				TRISA &= ~(1 << pbit);
-			else if(dir == 'I')
-				TRISA |= (1 << pbit);
-			break;
-		case 'B':
-			if(dir == 'O')
-				TRISB &= ~(1 << pbit);
-			else if(dir == 'I')
-				TRISB |= (1 << pbit);
-			break;
-		case 'C':
-			if(dir == 'O')
-				TRISC &= ~(1 << pbit);
-			else if(dir == 'I')
-				TRISC |= (1 << pbit);
-			break;		
-	}
+	unsigned char index = port - 'A';
+	volatile unsigned char *tris;
+
+	if(index >= APP_NUM_PORTS || pbit < 0 || pbit > 7)
+		return;
+	tris = tris_regs[index];
+	if(dir == 'O')
+		*tris &= ~bit_mask[pbit];
+	else if(dir == 'I')
+		*tris |= bit_mask[pbit];
 }
 
+// Same for the latch. Returns the bit for 'X', -1 otherwise or for a
+// bad port or bit.
 int port_cmd( unsigned char port, int pbit, unsigned char pval)
 {
+	unsigned char index = port - 'A';
+	volatile unsigned char *lat;
 	int ret_val = -1;
-	switch(port){
-		case 'A':
-			if(pval == 'H')
-				LATA |= (1 << pbit);
-			else if(pval == 'L')
-				LATA &= ~(1 << pbit);
-			else if(pval == 'X')
-				ret_val =  LATA & (1 << pbit);
-			break;
-		case 'B':
-			if(pval == 'H')
-				LATB |= (1 << pbit);
-			else if(pval == 'L')
-				LATB &= ~(1 << pbit);
-			else if(pval == 'X')
-				ret_val =  LATB & (1 << pbit);
-			break;
-		case 'C':
-			if(pval == 'H')
-				LATC |= (1 << pbit);
-			else if(pval == 'L')
-				LATC &= ~(1 << pbit);
-			else if(pval == 'X')
-				ret_val = LATC & (1 << pbit);
-			break;
-	}	
+
+	if(index >= APP_NUM_PORTS || pbit < 0 || pbit > 7)
+		return ret_val;
+	lat = lat_regs[index];
+	if(pval == 'H')
+		*lat |= bit_mask[pbit];
+	else if(pval == 'L')
+		*lat &= ~bit_mask[pbit];
+	else if(pval == 'X')
+		ret_val = *lat & bit_mask[pbit];
 	return ret_val;
-}
\ No newline at end of file
+}
+
+// Check whether cmd holds a 5 character command
+int is_app_cmd( unsigned char *cmd)
+{
+	unsigned char index = cmd[0] - 'A';
+
+	if(index >= 26 || app_table[index] == 0)
+		return 0;
+	return (cmd[1] == 'R' || cmd[1] == 'W');
+}
+
+// Run one 5 character command. Returns the value read, 0 for a write
+// or -1 if the command is not supported.
+int app_cmd( unsigned char *cmd)
+{
+	unsigned char index = cmd[0] - 'A';
+	app_handler handler;
+
+	if(index >= 26)
+		return -1;
+	handler = app_table[index];
+	if(handler == 0)
+		return -1;
+	return handler(cmd);
+}
+
+// Run up to APP_MAX_BATCH commands from cmds and put all results in
+// reply. Returns the number of commands run.
+unsigned char app_batch( unsigned char *cmds, unsigned char *reply)
+{
+	unsigned char n;
+	int ret_val;
+
+	reply[0] = cmds[0];
+	for(n = 0; n < APP_MAX_BATCH && is_app_cmd(cmds); n++)
+	{
+		ret_val = app_cmd(cmds);
+		reply[APP_REPLY_HEADER + 2*n] = (unsigned char)ret_val;
+		reply[APP_REPLY_HEADER + 2*n + 1] = (unsigned char)(ret_val >> 8);
+		cmds += APP_CMD_SIZE;
+	}
+	reply[1] = n;
+	return n;
+}
+
+// Port letter and bit number of DWA0I, PWA0H and PRA0X style commands
+static int port_args( unsigned char *cmd)
+{
+	unsigned char port = cmd[2] - 'A';
+	unsigned char pbit = cmd[3] - '0';
+
+	if(port >= APP_NUM_PORTS || pbit > 7)
+		return -1;
+	return pbit;
+}
+
+// DWA0I, DWA0O
+static int dir_handler( unsigned char *cmd)
+{
+	int pbit = port_args(cmd);
+
+	if(pbit < 0 || cmd[1] != 'W' || (cmd[4] != 'I' && cmd[4] != 'O'))
+		return -1;
+	dir_cmd(cmd[2], pbit, cmd[4]);
+	return 0;
+}
+
+// PWA0H, PWA0L, PRA0X
+static int port_handler( unsigned char *cmd)
+{
+	int pbit = port_args(cmd);
+
+	if(pbit < 0)
+		return -1;
+	if(cmd[1] == 'R' && cmd[4] == 'X')
+		return port_cmd(cmd[2], pbit, cmd[4]) != 0;
+	if(cmd[1] != 'W' || (cmd[4] != 'H' && cmd[4] != 'L'))
+		return -1;
+	port_cmd(cmd[2], pbit, cmd[4]);
+	return 0;
+}
+
+// AW00E, AW00D: make AN0 up to ANn analog, or ANn and up digital.
+// ARC01: convert ANn and return the result.
+static int adc_handler( unsigned char *cmd)
+{
+	unsigned char tens;
+	unsigned char ones;
+	unsigned char channel;
+	unsigned char pcfg = ADCON1 & 0x0F;
+
+	if(cmd[1] == 'W')
+	{
+		tens = cmd[2] - '0';
+		ones = cmd[3] - '0';
+	}
+	else if(cmd[2] == 'C')
+	{
+		tens = cmd[3] - '0';
+		ones = cmd[4] - '0';
+	}
+	else
+		return -1;
+	if(tens > 1 || ones > 9)
+		return -1;
+	channel = tens * 10 + ones;
+	if(channel > 12)
+		return -1;
+
+	// PCFG3:PCFG0 = 14 - n makes AN0 up to ANn analog, 15 none.
+	if(cmd[1] == 'W')
+	{
+		if(cmd[4] == 'E')
+		{
+			if(pcfg > 14 - channel)
+				ADCON1 = (ADCON1 & 0xF0) | (14 - channel);
+		}
+		else if(cmd[4] == 'D')
+		{
+			if(pcfg < 15 - channel)
+				ADCON1 = (ADCON1 & 0xF0) | (15 - channel);
+		}
+		else
+			return -1;
+		return 0;
+	}
+
+	// The A/D interrupt is on while a stream or an 'A' conversion owns
+	// the A/D. A read waits one conversion time, about 17 us.
+	if(PIE1bits.ADIE)
+		return -1;
+	ADCON0 = (channel << 2) | 0x01;
+	ADCON0bits.GO = 1;
+	while(ADCON0bits.GO);
+	PIR1bits.ADIF = 0;
+	return ((int)ADRESH << 8) | ADRESL;
+}
+
+// MWS0X: set up 50 Hz PWM on CCP1 (RC2), MWS1X on CCP2 (RC1).
+// MW050: set the duty cycle of CCP1 to 50%. Maximum is 99.
+static int pwm_handler( unsigned char *cmd)
+{
+	unsigned char channel;
+	unsigned char tens;
+	unsigned char ones;
+
+	if(cmd[1] != 'W')
+		return -1;
+	if(cmd[2] == 'S')
+	{
+		channel = cmd[3] - '0';
+		if(channel >= APP_NUM_PWM || cmd[4] != 'X')
+			return -1;
+		pwm_duty[channel] = 0;
+		if(channel == 0)
+		{
+			LATCbits.LATC2 = 0;
+			TRISCbits.TRISC2 = 0;
+		}
+		else
+		{
+			LATCbits.LATC1 = 0;
+			TRISCbits.TRISC1 = 0;
+		}
+		pwm_enabled |= bit_mask[channel];
+
+		// Timer2 ticks every 200 us: Fosc/4, 1:16 prescale, PR2 = 149.
+		PR2 = 149;
+		T2CON = 0x06;
+		IPR1bits.TMR2IP = 0;
+		PIE1bits.TMR2IE = 1;
+		return 0;
+	}
+
+	channel = cmd[2] - '0';
+	tens = cmd[3] - '0';
+	ones = cmd[4] - '0';
+	if(channel >= APP_NUM_PWM || tens > 9 || ones > 9)
+		return -1;
+	if(!(pwm_enabled & bit_mask[channel]))
+		return -1;
+	pwm_duty[channel] = tens * 10 + ones;
+	return 0;
+}
+
+// UWTXE, UWTXD, UWRXE, UWRXD: enable or disable the 9600 bps EUSART.
+// UWTtX: send 't'. URRXX: read a character, -1 if none arrived.
+static int uart_handler( unsigned char *cmd)
+{
+	if(cmd[1] == 'R')
+	{
+		if(cmd[2] != 'R' || !RCSTAbits.CREN)
+			return -1;
+		if(RCSTAbits.OERR)
+		{
+			// Overrun stops reception until CREN is toggled.
+			RCSTAbits.CREN = 0;
+			RCSTAbits.CREN = 1;
+		}
+		if(!PIR1bits.RCIF)
+			return -1;
+		return RCREG;
+	}
+
+	if(cmd[2] == 'T' && cmd[3] == 'X' && (cmd[4] == 'E' || cmd[4] == 'D'))
+	{
+		TXSTAbits.TXEN = (cmd[4] == 'E');
+	}
+	else if(cmd[2] == 'R' && cmd[3] == 'X' && (cmd[4] == 'E' || cmd[4] == 'D'))
+	{
+		RCSTAbits.CREN = (cmd[4] == 'E');
+	}
+	else if(cmd[2] == 'T' && cmd[4] == 'X')
+	{
+		if(!TXSTAbits.TXEN)
+			return -1;
+		// At most one character time, TXREG is free once the previous
+		// character moved to the shift register.
+		while(!PIR1bits.TXIF);
+		TXREG = cmd[3];
+		return 0;
+	}
+	else
+		return -1;
+
+	// 9600 bps at 48 MHz: BRGH = 1, BRG16 = 1, SPBRG = 48e6 / (4 * 9600) - 1
+	if(TXSTAbits.TXEN || RCSTAbits.CREN)
+	{
+		TRISCbits.TRISC6 = 0;
+		TRISCbits.TRISC7 = 1;
+		BAUDCONbits.BRG16 = 1;
+		TXSTAbits.BRGH = 1;
+		SPBRGH = (unsigned char)(1249 >> 8);
+		SPBRG = (unsigned char)1249;
+		RCSTAbits.SPEN = 1;
+	}
+	else
+		RCSTAbits.SPEN = 0;
+	return 0;
+}
@@ -0,0 +1,83 @@
+/********************************************************************
+ FileName:      dispatch_bench.c
+ Dependencies:  sfr_stub.h, ../application.c
+ Processor:     Host PC
+ Complier:      gcc
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+ Times app_cmd() for every type of 5 character command on the host,
+ with the registers replaced by the variables in sfr_stub.h. The
+ numbers are host cycles, not PIC cycles, but they show whether adding
+ a command type changes the cost of the ones already there.
+
+ Build and run from this folder:
+   gcc -O2 -o dispatch_bench dispatch_bench.c && ./dispatch_bench
+
+ ARC is left out, it waits for a conversion the stub never finishes.
+********************************************************************/
+
+#include <stdio.h>
+#include <time.h>
+#include "sfr_stub.h"
+#include "../application.c"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define read_cycles()	__rdtsc()
+#else
+#define read_cycles()	0ULL
+#endif
+
+#define BENCH_ITERATIONS	1000000L
+
+static const char *commands[] = {
+	"DWA0O",		// Direction
+	"PWA0H",		// Port write
+	"PRB2X",		// Port read
+	"AW04E",		// Analog enable
+	"MWS0X",		// PWM setup
+	"MW050",		// PWM duty
+	"UWTXE",		// UART enable
+	"UWTaX",		// UART write
+	"URRXX",		// UART read
+	"XW000",		// Not a command
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+	unsigned int i;
+	long n;
+	volatile int sink = 0;
+	double start_ns;
+	unsigned long long start_cycles;
+	double ns;
+	double cycles;
+
+	// The UART is always ready to take a character.
+	PIR1bits.TXIF = 1;
+
+	printf("%-8s %10s %10s\n", "command", "ns", "cycles");
+	for(i = 0; i < sizeof(commands)/sizeof(commands[0]); i++)
+	{
+		unsigned char *cmd = (unsigned char *)commands[i];
+
+		start_ns = now_ns();
+		start_cycles = read_cycles();
+		for(n = 0; n < BENCH_ITERATIONS; n++)
+			sink += app_cmd(cmd);
+		cycles = (double)(read_cycles() - start_cycles) / BENCH_ITERATIONS;
+		ns = (now_ns() - start_ns) / BENCH_ITERATIONS;
+		printf("%-8s %10.2f %10.2f\n", commands[i], ns, cycles);
+	}
+	return sink == 0x7FFFFFFF;
+}
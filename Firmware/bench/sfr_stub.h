@@ -0,0 +1,137 @@
+/********************************************************************
+ FileName:      sfr_stub.h
+ Dependencies:  None
+ Processor:     Host PC
+ Complier:      gcc
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+ Stand-ins for the PIC18F2550 registers and C18 keywords used by
+ application.c, so that it can be compiled and timed on the host.
+ Registers are plain variables: writes stick, nothing changes on its
+ own.
+********************************************************************/
+
+#ifndef SFR_STUB_H
+#define SFR_STUB_H
+
+#define ROM const
+
+typedef struct
+{
+	unsigned char ADON:1;
+	unsigned char GO:1;
+	unsigned char CHS:4;
+	unsigned char :2;
+} ADCON0bits_t;
+
+typedef struct
+{
+	unsigned char TMR1IF:1;
+	unsigned char TMR2IF:1;
+	unsigned char CCP1IF:1;
+	unsigned char SSPIF:1;
+	unsigned char TXIF:1;
+	unsigned char RCIF:1;
+	unsigned char ADIF:1;
+	unsigned char :1;
+} PIR1bits_t;
+
+typedef struct
+{
+	unsigned char TMR1IE:1;
+	unsigned char TMR2IE:1;
+	unsigned char CCP1IE:1;
+	unsigned char SSPIE:1;
+	unsigned char TXIE:1;
+	unsigned char RCIE:1;
+	unsigned char ADIE:1;
+	unsigned char :1;
+} PIE1bits_t;
+
+typedef struct
+{
+	unsigned char TMR1IP:1;
+	unsigned char TMR2IP:1;
+	unsigned char CCP1IP:1;
+	unsigned char SSPIP:1;
+	unsigned char TXIP:1;
+	unsigned char RCIP:1;
+	unsigned char ADIP:1;
+	unsigned char :1;
+} IPR1bits_t;
+
+typedef struct
+{
+	unsigned char RX9D:1;
+	unsigned char OERR:1;
+	unsigned char FERR:1;
+	unsigned char ADDEN:1;
+	unsigned char CREN:1;
+	unsigned char SREN:1;
+	unsigned char RX9:1;
+	unsigned char SPEN:1;
+} RCSTAbits_t;
+
+typedef struct
+{
+	unsigned char TX9D:1;
+	unsigned char TRMT:1;
+	unsigned char BRGH:1;
+	unsigned char SENDB:1;
+	unsigned char SYNC:1;
+	unsigned char TXEN:1;
+	unsigned char TX9:1;
+	unsigned char CSRC:1;
+} TXSTAbits_t;
+
+typedef struct
+{
+	unsigned char ABDEN:1;
+	unsigned char WUE:1;
+	unsigned char :1;
+	unsigned char BRG16:1;
+	unsigned char TXCKP:1;
+	unsigned char RXDTP:1;
+	unsigned char RCIDL:1;
+	unsigned char ABDOVF:1;
+} BAUDCONbits_t;
+
+typedef struct
+{
+	unsigned char LATC0:1;
+	unsigned char LATC1:1;
+	unsigned char LATC2:1;
+	unsigned char :3;
+	unsigned char LATC6:1;
+	unsigned char LATC7:1;
+} LATCbits_t;
+
+typedef struct
+{
+	unsigned char TRISC0:1;
+	unsigned char TRISC1:1;
+	unsigned char TRISC2:1;
+	unsigned char :3;
+	unsigned char TRISC6:1;
+	unsigned char TRISC7:1;
+} TRISCbits_t;
+
+volatile unsigned char TRISA, TRISB, TRISC;
+volatile unsigned char PORTA, PORTB, PORTC;
+volatile unsigned char LATA, LATB, LATC;
+volatile unsigned char ADCON0, ADCON1, ADCON2, ADRESH, ADRESL;
+volatile unsigned char PR2, T2CON;
+volatile unsigned char SPBRG, SPBRGH, RCREG, TXREG;
+volatile ADCON0bits_t ADCON0bits;
+volatile PIR1bits_t PIR1bits;
+volatile PIE1bits_t PIE1bits;
+volatile IPR1bits_t IPR1bits;
+volatile RCSTAbits_t RCSTAbits;
+volatile TXSTAbits_t TXSTAbits;
+volatile BAUDCONbits_t BAUDCONbits;
+volatile LATCbits_t LATCbits;
+volatile TRISCbits_t TRISCbits;
+
+#endif //SFR_STUB_H
@@ -16,7 +16,7 @@
 #include "USB/usb.h"
 #include "HardwareProfile - PICDEM FSUSB.h"
 #include "USB/usb_function_generic.h"
-//#include "application.c"
+#include "application.c"
 
 /** CONFIGURATION **************************************************/
 #if defined(PICDEM_FS_USB)      // Configuration bits for PICDEM FS USB Demo Board (based on PIC18F4550)
@@ -63,11 +63,255 @@
 //      #pragma config EBTR3    = OFF
         #pragma config EBTRB    = OFF
 #endif
+/** DEFINITIONS ****************************************************/
+// Commands sent by the PC application in OUTPacket[0].
+#define CMD_STREAM_START		0x82	// Start timer triggered A/D streaming
+#define CMD_STREAM_STOP			0x83	// Stop A/D streaming
+#define CMD_SCAN_LIST			0x84	// Set the channels scanned by a stream
+#define CMD_ADC_STATS			0x85	// Read A/D interrupt statistics
+#define CMD_PORT_SNAPSHOT		0x86	// Read PORTA/B/C at once
+#define CMD_PORT_WRITE			0x87	// Masked write of LATA/B/C, then snapshot
+#define CMD_LA_START			0x88	// Start a PORTB logic analyzer capture
+#define CMD_LA_STOP				0x89	// Abort a capture
+#define CMD_TIME				0x8A	// Read the device time and the last SOF
+#define CMD_TAGGED				0x8B	// Tag byte and a command, see ProcessIO()
+#define CMD_EVENT_CONFIG		0x8C	// Set the pins and the threshold that raise events
+#define CMD_TASK_STATS			0x8D	// Read the cycles each scheduler task used
+
+// Vendor requests on EP0, see USBCBCheckOtherReq(). Control transfers get
+// their own share of every frame, so these get through while EP1 is
+// saturated with commands and replies. The GET requests are answered from
+// the ISR at once; the others change the configuration from VendorTask()
+// and their status stage waits until they have been applied.
+#define VENDOR_GET_STATUS		0x01	// IN, VENDOR_STATUS_SIZE bytes
+#define VENDOR_GET_TIME			0x02	// IN, the CMD_TIME reply without the echo
+#define VENDOR_STREAM_START		0x03	// wValue period, wIndex channel, format << 8
+#define VENDOR_STREAM_STOP		0x04
+#define VENDOR_SCAN_MASK		0x05	// wValue bit n scans ANn
+#define VENDOR_PORT_WRITE		0x06	// wIndex port 0-2, wValue mask, value << 8
+#define VENDOR_EVENT_CONFIG		0x07	// OUT, OUTPacket[1..6] of CMD_EVENT_CONFIG
+
+#define VENDOR_STATUS_SIZE		16
+#define VENDOR_TIME_SIZE		10
+#define VENDOR_DATA_SIZE		6
+
+// Flags in byte 0 of the VENDOR_GET_STATUS reply.
+#define VENDOR_STATUS_STREAMING	0x01
+#define VENDOR_STATUS_ISO		0x02
+#define VENDOR_STATUS_ONE_SHOT	0x04
+
+// Cooperative scheduler of the main loop, see SchedulerRun(). Periods are
+// in Timer3 cycles, 0 runs a task on every pass. TASK_ID_xxx name the
+// tasks in the CMD_TASK_STATS reply.
+#define TASK_MAX				10
+#define TASK_PRIORITY_HIGH		0
+#define TASK_PRIORITY_NORMAL	1
+#define TASK_PRIORITY_LOW		2		// Waits once a pass is over TASK_PASS_BUDGET
+#define TASK_PASS_BUDGET		6000U	// 0.5 ms
+#define TASK_USB				0x01	// Only while configured and not suspended
+
+#define TASK_ID_USB				0		// USBDeviceTasks(), USB_POLLING only
+#define TASK_ID_STREAM_ALT		1
+#define TASK_ID_VENDOR			2
+#define TASK_ID_COMMANDS		3		// ProcessIO()
+#define TASK_ID_ADC_ONE_SHOT	4
+#define TASK_ID_STREAM			5
+#define TASK_ID_LA				6
+#define TASK_ID_EVENT			7
+#define TASK_ID_BUTTON			8
+#define TASK_ID_BLINK			9
+
+#define TASK_BUTTON_PERIOD		6000U	// 0.5 ms, ButtonTask() samples once per SOF
+#define TASK_BLINK_PERIOD		600U	// A BlinkUSBStatus() step of 10000 runs is 0.5 s
+
+// CMD_TASK_STATS reply, a header and a record per task.
+#define TASK_STATS_HEADER		8
+#define TASK_STATS_RECORD		10
+#define TASK_STATS_RECORDS		((USBGEN_EP_SIZE - TASK_STATS_HEADER) / TASK_STATS_RECORD)
+#define TASK_STATS_RESET		0x01	// OUTPacket[2], start over after the reply
+
+// A tagged command is OUTPacket[0] CMD_TAGGED, OUTPacket[1] a tag chosen
+// by the host and the command itself from OUTPacket[2]. Its reply is
+// INPacket[0] CMD_TAGGED, INPacket[1] the tag and the usual reply from
+// INPacket[2], or just the command byte for commands without a reply.
+#define TAG_HEADER_SIZE			2
+
+// Port snapshot reply, see PortSnapshotSend().
+#define PORT_SNAPSHOT_PORT		1		// PORTA..PORTC
+#define PORT_SNAPSHOT_LAT		4		// LATA..LATC
+#define PORT_SNAPSHOT_TRIS		7		// TRISA..TRISC
+
+// ProcessIO() looks commands up in two tables instead of a switch: one for
+// the ASCII commands 'A'..'Z' and one for the binary commands from 0x80.
+#define CMD_ASCII_FIRST			'A'
+#define CMD_ASCII_COUNT			26
+#define CMD_BINARY_FIRST		0x80
+#define CMD_BINARY_COUNT		16
+
+// A/D streaming. Timer1 runs at Fosc/4 = 12 MHz and CCP2 in special
+// event trigger mode resets it and starts a conversion every period.
+#define STREAM_RING_SIZE			64		// Samples, must be a power of 2
+#define STREAM_RING_MASK			(STREAM_RING_SIZE - 1)
+#define STREAM_HEADER_SIZE			8		// Command echo, format/count, channel mask, time
+#define STREAM_STAMP_COUNT			4		// Packets that can start in streamRing[]
+#define STREAM_STAMP_MASK			(STREAM_STAMP_COUNT - 1)
+#define STREAM_PAYLOAD_SIZE			(USBGEN_EP_SIZE - STREAM_HEADER_SIZE)
+#define STREAM_DEFAULT_PERIOD		1200U	// 10 kS/s
+#define STREAM_MIN_PERIOD			240U	// 50 kS/s, a conversion takes ~17 us
+#define STREAM_CHANNEL_SCAN_LIST	0xFF	// Start channel: use the scan list
+
+// Alternate settings of interface 0, see usb_descriptors.c. In
+// STREAM_ALT_ISO USBSTREAM_EP_NUM is isochronous: the host reserves one
+// USBGEN_EP_SIZE packet for it in every 1 ms frame, so the stream keeps
+// its rate however busy the bus is, but it can send no more than one
+// packet per frame. STREAM_ALT_BULK reserves no bandwidth, so it has no
+// event endpoint either. STREAM_ALT_BULK_EVENTS is STREAM_ALT_BULK with
+// the event endpoint USBEVENT_EP_NUM, which STREAM_ALT_ISO has too.
+#define STREAM_ALT_BULK				0
+#define STREAM_ALT_ISO				1
+#define STREAM_ALT_BULK_EVENTS		2
+#define STREAM_FRAME_TICKS			12000UL	// Timer1 ticks per USB frame
+
+// A/D timing as set up in UserInit(). TAD is Fosc/64 = 16 instruction
+// cycles, a conversion is 2 TAD of acquisition plus 11 TAD. This is what
+// the CPU used to spin for per sample before completion moved to the
+// A/D interrupt.
+#define ADC_TAD_CYCLES				16
+#define ADC_CONVERSION_CYCLES		((2 + 11) * ADC_TAD_CYCLES)
+
+// Sample of the 'A' reply when a stream has the A/D, 0xFFFF as for the
+// failed commands of a batch in application.c.
+#define ADC_ONE_SHOT_FAILED			0xFFFFU
+
+// Channels usable for scanning, see application.c: AN0-AN4, AN8-AN11.
+#define SCAN_MAX_CHANNELS			9
+#define SCAN_VALID_MASK				0x0F1FU
+
+// Device time. Timer3 runs free at Fosc/4 = 12 MHz and the high priority
+// ISR counts its overflows in timer3High, which makes a 32 bit count of
+// instruction cycles that wraps after about 6 minutes. A Timer3 overflow
+// that has not been counted yet shows as TMR3IF set with a small count.
+// The high priority ISR must not run in between, so use this with GIEH
+// clear or from the high priority ISR itself.
+#define mTimeRead(t)	{													\
+							(t) = TMR3L;									\
+							(t) |= (WORD)TMR3H << 8;						\
+							if(PIR2bits.TMR3IF && !((t) & 0x8000))			\
+								(t) |= (DWORD)(timer3High + 1) << 16;		\
+							else											\
+								(t) |= (DWORD)timer3High << 16;				\
+						}
+
+// IN buffers. With USB_PING_PONG__FULL_PING_PONG the SIE has an even and
+// an odd buffer descriptor per endpoint and the stack alternates between
+// them, so two packets can be armed at once. The firmware fills one while
+// the SIE sends the other. Command replies and logic analyzer uploads go
+// out on USBGEN_EP_NUM from INBuffers[].
+#define IN_BUFFER_COUNT				2
+
+// Stream packets go out on their own bulk IN endpoint, USBSTREAM_EP_NUM,
+// from their own even and odd buffer. A stream at full rate then never
+// holds a command reply up behind its packets, and the host can keep
+// many transfers queued on the stream without them taking the replies.
+#define STREAM_BUFFER_COUNT			2
+
+// Sample formats, sent in the top two bits of the stream header byte.
+#define STREAM_FORMAT_RAW16			0		// 16 bit samples, LSB first
+#define STREAM_FORMAT_PACKED10		1		// 4 x 10 bit samples in 5 bytes
+#define STREAM_FORMAT_SHIFT			6
+#define STREAM_COUNT_MASK			0x3F
+#define STREAM_RAW16_SAMPLES		(STREAM_PAYLOAD_SIZE / 2)
+// A partial group of n samples still takes n low bytes plus the high byte.
+#define STREAM_PACKED10_SAMPLES		((STREAM_PAYLOAD_SIZE / 5) * 4 + \
+									(((STREAM_PAYLOAD_SIZE % 5) > 1) ? (STREAM_PAYLOAD_SIZE % 5) - 1 : 0))
+
+// Logic analyzer capture of PORTB. Timer0 interrupts every period and
+// the high priority ISR stores PORTB in laBuffer[], which fills the
+// 512 bytes at 0x600 that the USB module does not use, see the linker
+// script. RB2-RB7 are the inputs, RB0 and RB1 are the LEDs.
+#define LA_BUFFER_SIZE				512		// Samples, must be a power of 2
+#define LA_BUFFER_MASK				(LA_BUFFER_SIZE - 1)
+#define LA_HEADER_SIZE				4		// Command echo, count, offset
+#define LA_PACKET_SAMPLES			(USBGEN_EP_SIZE - LA_HEADER_SIZE)
+#define LA_DEFAULT_PERIOD			240U	// 50 kS/s
+#define LA_MIN_PERIOD				120U	// 100 kS/s, about the ISR length
+// Timer0 cycles missed while the ISR reads, adds to and writes back TMR0,
+// including the 2 cycle inhibit after the write. Check with the MPLAB
+// simulator stopwatch when the Timer0 part of the ISR changes.
+#define LA_RELOAD_FIXUP				12
+// Timer0 count that overflows right after the ISR has cleared TMR0IF, for
+// a sample that is already overdue.
+#define LA_OVERDUE_COUNT			(0xFFFFU - LA_RELOAD_FIXUP)
+// The last upload packet has LA_BUFFER_SIZE % LA_PACKET_SAMPLES samples,
+// followed by the number of samples taken late, see LaTask().
+#define LA_LATE_SIZE				2
+#if (LA_BUFFER_SIZE % LA_PACKET_SAMPLES) == 0 || \
+	(LA_BUFFER_SIZE % LA_PACKET_SAMPLES) > LA_PACKET_SAMPLES - LA_LATE_SIZE
+	#error "No room for the late count in the last logic analyzer packet"
+#endif
+
+#define LA_TRIGGER_LEVEL			0		// (PORTB & mask) == value
+#define LA_TRIGGER_EDGE				1		// Same, and a masked bit just changed
+
+#define LA_IDLE						0
+#define LA_ARMED					1		// Filling the pre-trigger samples
+#define LA_TRIGGERED				2		// Filling the post-trigger samples
+#define LA_DONE						3		// Uploading laBuffer[]
+
+// Events. The low priority ISR and ButtonTask() queue event records in
+// eventQueue[] and EventTask() sends them on the interrupt endpoint
+// USBEVENT_EP_NUM, several per packet, in the alternate settings that
+// have it. The host polls it every frame, so
+// an event reaches it within about 1 ms without any command traffic.
+// A record is EVENT_RECORD_SIZE bytes, see EventTask().
+#define EVENT_RECORD_SIZE			8
+#define EVENT_PACKET_RECORDS		(USBEVENT_EP_SIZE / EVENT_RECORD_SIZE)
+#define EVENT_QUEUE_SIZE			8		// Records, must be a power of 2
+#define EVENT_QUEUE_MASK			(EVENT_QUEUE_SIZE - 1)
+#define EVENT_BUFFER_COUNT			2
+
+#define EVENT_PINS					0x01	// RB4-RB7 changed
+#define EVENT_BUTTON				0x02	// sw2 or sw3 pressed or released, debounced
+#define EVENT_THRESHOLD				0x03	// A/D sample crossed the threshold
+#define EVENT_LOST					0x04	// Records dropped, the queue was full
+
+#define EVENT_PIN_MASK				0xF0	// PORTB pins with interrupt on change
+#define EVENT_THRESHOLD_OFF			0xFF	// eventThresholdChannel with no threshold
+#define EVENT_THRESHOLD_RISING		0x80	// Or'ed to the channel of an EVENT_THRESHOLD
+#define EVENT_DEBOUNCE_FRAMES		8		// A button must be steady this many SOFs
+
+// Queues an event record with the device time in the free slot of
+// eventQueue[], or counts it in eventLost if the queue is full. Use it
+// from the low priority ISR, or with GIEL clear. t is a DWORD for the
+// time.
+#define mEventQueue(type, a, b, c, t)	{												\
+							if(((eventHead + 1) & EVENT_QUEUE_MASK) == eventTail)	\
+							{														\
+								if(++eventLost == 0)								\
+									eventLost--;									\
+							}														\
+							else													\
+							{														\
+								INTCONbits.GIEH = 0;								\
+								mTimeRead(t);										\
+								INTCONbits.GIEH = 1;								\
+								eventQueue[eventHead][0] = (type);					\
+								eventQueue[eventHead][1] = (a);						\
+								eventQueue[eventHead][2] = (b);						\
+								eventQueue[eventHead][3] = (c);						\
+								eventQueue[eventHead][4] = (BYTE)(t);				\
+								eventQueue[eventHead][5] = (BYTE)((t) >> 8);		\
+								eventQueue[eventHead][6] = (BYTE)((t) >> 16);		\
+								eventQueue[eventHead][7] = (BYTE)((t) >> 24);		\
+								eventHead = (eventHead + 1) & EVENT_QUEUE_MASK;		\
+							}														\
+						}
+
 /** VARIABLES ******************************************************/
 #if defined(__18CXX)
-    //The OUTPacket[] and INPacket[] arrays are used as
-    //USB packet buffers in this firmware.  Therefore, they must be located in
-    //a USB module accessible portion of microcontroller RAM.
+    //The OUTPacket[], INBuffers[], StreamBuffers[] and EventBuffers[] arrays
+    //are used as USB packet buffers in this firmware.  Therefore, they must
+    //be located in a USB module accessible portion of microcontroller RAM.
     #if defined(__18F14K50) || defined(__18F13K50) || defined(__18LF14K50) || defined(__18LF13K50) 
         #pragma udata usbram2
     #elif defined(__18F2455) || defined(__18F2550) || defined(__18F4455) || defined(__18F4550)\
@@ -85,7 +329,22 @@
 #define IN_DATA_BUFFER_ADDRESS_TAG
 #define OUT_DATA_BUFFER_ADDRESS_TAG
 
-unsigned char INPacket[USBGEN_EP_SIZE] IN_DATA_BUFFER_ADDRESS_TAG;		//User application buffer for sending IN packets to the host
+unsigned char INBuffers[IN_BUFFER_COUNT][USBGEN_EP_SIZE] IN_DATA_BUFFER_ADDRESS_TAG;	//User application buffers for sending IN packets to the host
+unsigned char StreamBuffers[STREAM_BUFFER_COUNT][USBGEN_EP_SIZE] IN_DATA_BUFFER_ADDRESS_TAG;	//Buffers for the stream packets on USBSTREAM_EP_NUM
+
+#if defined(__18CXX)
+    //INBuffers[] and StreamBuffers[] fill the 256 bytes at 0x500, so on
+    //these parts EventBuffers[] and OUTPacket[] go to the top of usb4,
+    //above the buffer descriptor table and the EP0 buffers the stack
+    //keeps there.
+    #if defined(__18F2455) || defined(__18F2550) || defined(__18F4455) || defined(__18F4550)\
+        || defined(__18F2458) || defined(__18F2453) || defined(__18F4558) || defined(__18F4553)\
+        || defined(__18LF24K50) || defined(__18F24K50) || defined(__18LF25K50)\
+        || defined(__18F25K50) || defined(__18LF45K50) || defined(__18F45K50)
+        #pragma udata USB_OUT_VARIABLES=0x480
+    #endif
+#endif
+unsigned char EventBuffers[EVENT_BUFFER_COUNT][USBEVENT_EP_SIZE] IN_DATA_BUFFER_ADDRESS_TAG;	//Buffers for the event packets on USBEVENT_EP_NUM
 unsigned char OUTPacket[USBGEN_EP_SIZE] OUT_DATA_BUFFER_ADDRESS_TAG;	//User application buffer for receiving and holding OUT packets sent from the host
 
 #if defined(__18CXX)
@@ -93,7 +352,138 @@ unsigned char OUTPacket[USBGEN_EP_SIZE] OUT_DATA_BUFFER_ADDRESS_TAG;	//User appl
 #endif
 BOOL blinkStatusValid;
 USB_HANDLE USBGenericOutHandle;  //USB handle.  Must be initialized to 0 at startup.
-USB_HANDLE USBGenericInHandle;   //USB handle.  Must be initialized to 0 at startup.
+USB_HANDLE USBGenericInHandle[IN_BUFFER_COUNT];   //USB handles.  Must be initialized to 0 at startup.
+BYTE inBufferNext;				// Index of the IN buffer to fill next
+BYTE *INPacket;					// INBuffers[inBufferNext]
+#define mInBufferBusy()		USBHandleBusy(USBGenericInHandle[inBufferNext])
+USB_HANDLE USBStreamInHandle[STREAM_BUFFER_COUNT];	// Same for StreamBuffers[]
+BYTE streamBufferNext;			// Index of the stream buffer to fill next
+#define mStreamBufferBusy()	USBHandleBusy(USBStreamInHandle[streamBufferNext])
+BOOL streamIso;					// USBSTREAM_EP_NUM is isochronous, see StreamAltTask()
+
+USB_HANDLE USBEventInHandle[EVENT_BUFFER_COUNT];	// Same for EventBuffers[]
+BYTE eventBufferNext;			// Index of the event buffer to fill next
+BOOL eventEndpoint;				// USBEVENT_EP_NUM is enabled, see StreamAltTask()
+#define mEventBufferBusy()	USBHandleBusy(USBEventInHandle[eventBufferNext])
+
+// Kept by the stack when the host sends SET_INTERFACE.
+extern USB_VOLATILE BYTE USBAlternateInterface[USB_MAX_NUM_INT];
+
+// Tagged commands. While a tagged command is being handled INPacket points
+// past the tag header of the free IN buffer, so handlers fill in their
+// reply the same way either way.
+BOOL outTagged;					// The command in OUTPacket came tagged
+BYTE outTag;					// Its tag
+BOOL replyTagged;				// INPacket is past a tag header not sent yet
+
+// Samples are written by the A/D interrupt and drained by StreamTask().
+// Both indices are single bytes so they are read and written atomically.
+WORD streamRing[STREAM_RING_SIZE];
+volatile BYTE streamHead;		// Next free slot, only written by the ISR
+volatile BYTE streamTail;		// Oldest unsent sample, only written by the main loop
+volatile WORD streamOverruns;	// Samples dropped because the ring was full
+BOOL streamEnabled;
+BYTE streamFormat;				// STREAM_FORMAT_xxx
+BYTE streamPacketSamples;		// Samples sent per packet in streamFormat
+
+// Time of the trigger of the first frame of every packet in streamRing[],
+// queued by the A/D interrupt and sent in the packet header.
+DWORD streamStamps[STREAM_STAMP_COUNT];
+volatile BYTE streamStampHead;	// Only written by the ISR
+BYTE streamStampTail;			// Only written by the main loop
+BYTE streamPacketFill;			// Samples queued for the next packet, only used by the ISR
+
+// Channels converted on every trigger, in ascending order so that the
+// channel mask in the stream header fully describes a frame.
+BYTE scanChannels[SCAN_MAX_CHANNELS];
+BYTE scanCount;
+WORD scanMask;
+volatile BYTE scanIndex;		// Channel being converted, only used by the ISR
+volatile BOOL scanDropFrame;	// No room for the current frame, only used by the ISR
+
+// One shot 'A' conversions complete in the A/D interrupt as well. The
+// result goes through streamRing[] and AdcOneShotTask() sends the reply.
+volatile BOOL adcOneShotPending;
+BOOL adcOneShotFailed;			// A stream took the A/D before the reply went out
+BOOL adcOneShotTagged;			// The reply is owed to a tagged 'A'
+BYTE adcOneShotTag;
+volatile DWORD adcConversions;	// Conversions completed since reset
+volatile WORD adcIsrCycles;		// Timer3 cycles spent in the last A/D interrupt
+volatile WORD adcIsrMaxCycles;	// Worst case of adcIsrCycles
+DWORD adcOneShotStamp;			// Time the one shot conversion completed
+
+// Device time, see mTimeRead(). USBCB_SOF_Handler() latches the frame
+// number and time of every SOF so the host can relate the device time
+// to the USB frame clock.
+volatile WORD timer3High;		// Timer3 overflows, counted in the high priority ISR
+WORD sofFrame;					// Frame number of the last SOF
+DWORD sofTime;					// Device time of the last SOF
+
+// Logic analyzer. laBuffer[] is a ring until the trigger, the capture
+// ends when it holds laPreTrigger samples before the trigger sample and
+// the rest after it.
+volatile BYTE laState;			// LA_xxx
+BYTE laTriggerMode;				// LA_TRIGGER_xxx
+BYTE laTriggerMask;
+BYTE laTriggerValue;
+WORD laPreTrigger;				// Samples kept from before the trigger
+WORD laReload;					// Added to Timer0 every sample
+WORD laLate;					// Samples taken late, only written by the ISR
+WORD laHead;					// Next sample slot, only used by the ISR
+WORD laFilled;					// Pre-trigger samples taken, only used by the ISR
+WORD laRemaining;				// Post-trigger samples still to take
+BYTE laPrevious;				// Last sample, for the edge trigger
+WORD laStart;					// Slot of the first sample of the capture
+WORD laSent;					// Samples uploaded so far
+
+// Event records queued by mEventQueue(). The producers all run with the
+// low priority interrupt masked, EventTask() only moves eventTail.
+BYTE eventQueue[EVENT_QUEUE_SIZE][EVENT_RECORD_SIZE];
+volatile BYTE eventHead;		// Next free record
+volatile BYTE eventTail;		// Oldest unsent record, only written by EventTask()
+volatile WORD eventLost;		// Records dropped since the last EVENT_LOST
+BYTE eventPinMask;				// Pins of EVENT_PIN_MASK that raise EVENT_PINS
+BYTE eventPortB;				// PORTB as of the last change, only used by the ISR
+BYTE eventThresholdChannel;		// A/D channel watched, or EVENT_THRESHOLD_OFF
+WORD eventThresholdLow;			// Falling crossing at or below this
+WORD eventThresholdHigh;		// Rising crossing at or above this
+BOOL eventThresholdAbove;		// Last crossing was rising, only used by the ISR
+BYTE buttonState;				// Debounced buttons down, bit 0 sw2, bit 1 sw3
+BYTE buttonSteady;				// SOFs the buttons have differed from buttonState
+BYTE buttonFrame;				// Low byte of sofFrame when last sampled
+
+// A vendor request that waits for VendorTask(). The host cannot start the
+// next control transfer before its status stage, so there is never more
+// than one.
+volatile BOOL vendorPending;
+BYTE vendorRequest;
+WORD vendorValue;
+WORD vendorIndex;
+BYTE vendorData[VENDOR_DATA_SIZE];		// OUT data stage
+BYTE vendorReply[VENDOR_STATUS_SIZE];	// IN data stage, the stack sends it from here
+
+// Scheduler tasks in priority order, see TaskRegister().
+typedef void (*TASK_FUNCTION)(void);
+typedef struct
+{
+	TASK_FUNCTION run;
+	BYTE id;					// TASK_ID_xxx
+	BYTE priority;				// TASK_PRIORITY_xxx
+	BYTE flags;					// TASK_USB
+	WORD period;
+	WORD last;					// Low word of the device time of the last run
+	WORD runs;					// Since the statistics were reset, saturates
+	DWORD cycles;				// Same, spent in run
+	WORD maxCycles;				// Longest run
+} TASK;
+
+TASK tasks[TASK_MAX];
+BYTE taskCount;
+DWORD taskStatsStart;			// Device time the statistics were reset
+#if defined(__18CXX)
+    #pragma udata CAPTURE
+#endif
+BYTE laBuffer[LA_BUFFER_SIZE];
 #if defined(__18CXX)
     #pragma udata
 #endif
@@ -107,6 +497,85 @@ void USBCBSendResume(void);
 void UserInit(void);
 void ProcessIO(void);
 void BlinkUSBStatus(void);
+void StreamStart(BYTE channel, WORD period, BYTE format);
+void StreamStop(void);
+static void StreamTask(void);
+static void StreamAltTask(void);
+void ScanSetList(BYTE count, BYTE *channels);
+static BOOL AdcOneShotStart(BYTE channel);
+static void AdcOneShotTask(void);
+static BOOL AppBatchRun(void);
+static void ScanSetMask(WORD mask);
+static void InBufferReset(void);
+static void InBufferSend(void);
+static void StreamBufferReset(void);
+static void StreamBufferSend(void);
+static void TagReply(BYTE tag);
+static BOOL TagDefer(BYTE *tag);
+static BOOL CmdAdcOneShot(void);
+static BOOL CmdToggleLed(void);
+static BOOL CmdPushbutton(void);
+static BOOL CmdScanList(void);
+static BOOL CmdStreamStart(void);
+static BOOL CmdStreamStop(void);
+static BOOL CmdAdcStats(void);
+static BOOL CmdPortSnapshot(void);
+static BOOL CmdPortWrite(void);
+static void PortSnapshotSend(void);
+static BOOL CmdLaStart(void);
+static BOOL CmdLaStop(void);
+void LaStart(BYTE mode, BYTE mask, BYTE value, WORD preTrigger, WORD period);
+void LaStop(void);
+static void LaTask(void);
+static BOOL CmdTime(void);
+static BOOL CmdEventConfig(void);
+void EventConfig(BYTE pins, BYTE channel, WORD low, WORD high);
+static void EventTask(void);
+static void EventBufferReset(void);
+static void ButtonTask(void);
+static void VendorTask(void);
+static void VendorDataReceived(void);
+static void SchedulerInit(void);
+static void SchedulerRun(void);
+static void TaskRegister(BYTE id, TASK_FUNCTION run, BYTE priority, WORD period, BYTE flags);
+static void TaskStatsReset(void);
+static void BlinkTask(void);
+static BOOL CmdTaskStats(void);
+
+// A command handler returns TRUE when it is done with OUTPacket, FALSE to
+// have the same packet handed to it again on the next ProcessIO() call.
+typedef BOOL (*CMD_HANDLER)(void);
+
+ROM CMD_HANDLER asciiCommands[CMD_ASCII_COUNT] = {
+	CmdAdcOneShot,						// 'A'
+	0, 0,								// 'B', 'C'
+	AppBatchRun,						// 'D'
+	0, 0, 0, 0, 0, 0, 0, 0,				// 'E' - 'L'
+	AppBatchRun,						// 'M'
+	0, 0,								// 'N', 'O'
+	AppBatchRun,						// 'P'
+	0, 0, 0, 0,							// 'Q' - 'T'
+	AppBatchRun,						// 'U'
+	0, 0, 0, 0, 0						// 'V' - 'Z'
+};
+
+ROM CMD_HANDLER binaryCommands[CMD_BINARY_COUNT] = {
+	CmdToggleLed,						// 0x80
+	CmdPushbutton,						// 0x81
+	CmdStreamStart,						// 0x82 CMD_STREAM_START
+	CmdStreamStop,						// 0x83 CMD_STREAM_STOP
+	CmdScanList,						// 0x84 CMD_SCAN_LIST
+	CmdAdcStats,						// 0x85 CMD_ADC_STATS
+	CmdPortSnapshot,					// 0x86 CMD_PORT_SNAPSHOT
+	CmdPortWrite,						// 0x87 CMD_PORT_WRITE
+	CmdLaStart,							// 0x88 CMD_LA_START
+	CmdLaStop,							// 0x89 CMD_LA_STOP
+	CmdTime,							// 0x8A CMD_TIME
+	0,									// 0x8B CMD_TAGGED, see ProcessIO()
+	CmdEventConfig,						// 0x8C CMD_EVENT_CONFIG
+	CmdTaskStats,						// 0x8D CMD_TASK_STATS
+	0, 0								// 0x8E - 0x8F
+};
 
 /** VECTOR REMAPPING ***********************************************/
 #if defined(__18CXX)
@@ -165,6 +634,69 @@ void BlinkUSBStatus(void);
 	#pragma interrupt YourHighPriorityISRCode
 	void YourHighPriorityISRCode()
 	{
+		BYTE sample;
+		BYTE lo;
+		WORD count;
+
+		//Timer3 overflow, the top half of the device time.
+		if(PIE2bits.TMR3IE && PIR2bits.TMR3IF)
+		{
+			PIR2bits.TMR3IF = 0;
+			timer3High++;
+		}
+
+		//Logic analyzer sample. This is the only high priority source
+		//besides USB so the sample instants only wait for USB traffic.
+		if(INTCONbits.TMR0IE && INTCONbits.TMR0IF)
+		{
+			sample = PORTB;
+
+			// Reload relative to the current count, so that the latency
+			// of this interrupt does not add up over the capture. If the
+			// sum carries, USBDeviceTasks() held this interrupt up for a
+			// whole period and the next sample is overdue already: it is
+			// taken at once and counted in laLate, rather than after
+			// Timer0 has run all the way round.
+			lo = TMR0L;
+			count = (((WORD)TMR0H << 8) | lo) + laReload;
+			if(count < laReload)
+			{
+				count = LA_OVERDUE_COUNT;
+				if(++laLate == 0)
+					laLate--;
+			}
+			TMR0H = (BYTE)(count >> 8);
+			TMR0L = (BYTE)count;
+			INTCONbits.TMR0IF = 0;
+
+			laBuffer[laHead] = sample;
+			if(laState == LA_ARMED)
+			{
+				if(laFilled < laPreTrigger)
+				{
+					laFilled++;
+				}
+				else if(((sample & laTriggerMask) == laTriggerValue) &&
+						((laTriggerMode != LA_TRIGGER_EDGE) || ((sample ^ laPrevious) & laTriggerMask)))
+				{
+					laStart = (laHead - laPreTrigger) & LA_BUFFER_MASK;
+					laState = LA_TRIGGERED;
+				}
+			}
+			if(laState == LA_TRIGGERED && --laRemaining == 0)
+			{
+				T0CONbits.TMR0ON = 0;
+				INTCONbits.TMR0IE = 0;
+				laState = LA_DONE;
+			}
+			laHead = (laHead + 1) & LA_BUFFER_MASK;
+			laPrevious = sample;
+
+			// Keep the sample period short when there is nothing for
+			// the USB stack to do.
+			if(!PIR2bits.USBIF)
+				return;
+		}
 		//Check which interrupt flag caused the interrupt.
 		//Service the interrupt
 		//Clear the interrupt flag
@@ -177,11 +709,132 @@ void BlinkUSBStatus(void);
 	#pragma interruptlow YourLowPriorityISRCode
 	void YourLowPriorityISRCode()
 	{
-		//Check which interrupt flag caused the interrupt.
-		//Service the interrupt
-		//Clear the interrupt flag
-		//Etc.
-	
+		BYTE lo;
+		BYTE changed;
+		WORD start;
+		WORD ticks;
+		WORD sample;
+		DWORD stamp;
+
+		//A/D conversion of a one shot 'A' command, or of one channel of
+		//the scan list, is done. The CCP2 special event trigger starts
+		//the first channel of a frame, the rest are started back to back
+		//from here.
+		if(PIE1bits.ADIE && PIR1bits.ADIF)
+		{
+			// Reading TMR3L latches TMR3H, and the high priority ISR
+			// reads Timer3 as well, so it must not run in between.
+			INTCONbits.GIEH = 0;
+			lo = TMR3L;
+			start = ((WORD)TMR3H << 8) | lo;
+			INTCONbits.GIEH = 1;
+
+			PIR1bits.ADIF = 0;
+			adcConversions++;
+			if(scanIndex == 0)
+			{
+				// Timer1 has counted from the trigger of this frame.
+				INTCONbits.GIEH = 0;
+				mTimeRead(stamp);
+				lo = TMR1L;
+				ticks = ((WORD)TMR1H << 8) | lo;
+				INTCONbits.GIEH = 1;
+
+				// Frames are kept whole, so a frame that does not fit is
+				// dropped entirely. The host is not draining fast enough.
+				scanDropFrame = (((streamTail - streamHead - 1) & STREAM_RING_MASK) < scanCount);
+				if(scanDropFrame)
+					streamOverruns++;
+
+				if(!streamEnabled)
+				{
+					adcOneShotStamp = stamp;
+				}
+				else if(!scanDropFrame)
+				{
+					if(streamPacketFill == 0)
+					{
+						streamStamps[streamStampHead] = stamp - ticks;
+						streamStampHead = (streamStampHead + 1) & STREAM_STAMP_MASK;
+					}
+					streamPacketFill += scanCount;
+					if(streamPacketFill >= streamPacketSamples)
+						streamPacketFill = 0;
+				}
+			}
+			sample = ((WORD)ADRESH << 8) | ADRESL;
+			if(!scanDropFrame)
+			{
+				streamRing[streamHead] = sample;
+				streamHead = (streamHead + 1) & STREAM_RING_MASK;
+			}
+
+			// Threshold crossings of the channel just converted, which
+			// CHS3:CHS0 still select. The hysteresis between the two
+			// levels keeps a noisy signal from raising a burst of them.
+			if(((ADCON0 >> 2) & 0x0F) == eventThresholdChannel)
+			{
+				if(!eventThresholdAbove && sample >= eventThresholdHigh)
+				{
+					eventThresholdAbove = TRUE;
+					mEventQueue(EVENT_THRESHOLD, eventThresholdChannel | EVENT_THRESHOLD_RISING,
+								(BYTE)sample, (BYTE)(sample >> 8), stamp);
+				}
+				else if(eventThresholdAbove && sample <= eventThresholdLow)
+				{
+					eventThresholdAbove = FALSE;
+					mEventQueue(EVENT_THRESHOLD, eventThresholdChannel,
+								(BYTE)sample, (BYTE)(sample >> 8), stamp);
+				}
+			}
+
+			if(!streamEnabled)
+			{
+				// One shot 'A' conversion, nothing else to start.
+				PIE1bits.ADIE = 0;
+			}
+			else if(++scanIndex < scanCount)
+			{
+				ADCON0 = (scanChannels[scanIndex] << 2) | 0x03;	// Channel, GO, ADON
+			}
+			else
+			{
+				scanIndex = 0;
+				ADCON0 = (scanChannels[0] << 2) | 0x01;			// Wait for the trigger
+			}
+
+			INTCONbits.GIEH = 0;
+			lo = TMR3L;
+			adcIsrCycles = (((WORD)TMR3H << 8) | lo) - start;
+			INTCONbits.GIEH = 1;
+			if(adcIsrCycles > adcIsrMaxCycles)
+				adcIsrMaxCycles = adcIsrCycles;
+		}
+
+		//PORTB interrupt on change of RB4-RB7. Reading PORTB ends the
+		//mismatch, so the flag can be cleared after it.
+		if(INTCONbits.RBIE && INTCONbits.RBIF)
+		{
+			lo = PORTB;
+			INTCONbits.RBIF = 0;
+			changed = (lo ^ eventPortB) & eventPinMask;
+			eventPortB = lo;
+			if(changed)
+				mEventQueue(EVENT_PINS, lo, changed, 0, stamp);
+		}
+
+		//Timer2 steps the software PWM of the MW commands in
+		//application.c, APP_PWM_STEPS ticks of 200 us per 20 ms period.
+		if(PIE1bits.TMR2IE && PIR1bits.TMR2IF)
+		{
+			PIR1bits.TMR2IF = 0;
+			if(++pwm_step >= APP_PWM_STEPS)
+				pwm_step = 0;
+			if(pwm_enabled & 0x01)
+				LATCbits.LATC2 = (pwm_step < pwm_duty[0]);
+			if(pwm_enabled & 0x02)
+				LATCbits.LATC1 = (pwm_step < pwm_duty[1]);
+		}
 	}	//This return will be a "retfie", since this is in a #pragma interruptlow section 
 
 #endif
@@ -221,16 +874,203 @@ int main(void)
 
     while(1)
     {
-        #if defined(USB_POLLING)
-		// Check bus status and service USB interrupts.
-        USBDeviceTasks(); 
-        #endif
-		// Application specific code is added in ProcessIO()
-        ProcessIO();        
+		// USBDeviceTasks() in polling builds and the application tasks,
+		// ProcessIO() among them, are registered in SchedulerInit().
+        SchedulerRun();
     }//end while
 }//end main
 
 
+/******************************************************************************
+ * Function:        static void SchedulerInit(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Resets the task statistics.
+ *
+ * Overview:        Registers the tasks of the main loop. Within a
+ *                  priority they run in the order registered here, which
+ *                  is the order ProcessIO() used to call them in: the
+ *                  alternate setting and vendor requests before the
+ *                  command of OUTPacket, the IN endpoints after it.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void SchedulerInit(void)
+{
+	taskCount = 0;
+	#if defined(USB_POLLING)
+	// Check bus status and service USB interrupts.
+	TaskRegister(TASK_ID_USB, USBDeviceTasks, TASK_PRIORITY_HIGH, 0, 0);
+	#endif
+	TaskRegister(TASK_ID_STREAM_ALT, StreamAltTask, TASK_PRIORITY_HIGH, 0, TASK_USB);
+	TaskRegister(TASK_ID_VENDOR, VendorTask, TASK_PRIORITY_HIGH, 0, TASK_USB);
+	TaskRegister(TASK_ID_COMMANDS, ProcessIO, TASK_PRIORITY_NORMAL, 0, TASK_USB);
+	TaskRegister(TASK_ID_ADC_ONE_SHOT, AdcOneShotTask, TASK_PRIORITY_NORMAL, 0, TASK_USB);
+	TaskRegister(TASK_ID_STREAM, StreamTask, TASK_PRIORITY_NORMAL, 0, TASK_USB);
+	TaskRegister(TASK_ID_LA, LaTask, TASK_PRIORITY_NORMAL, 0, TASK_USB);
+	TaskRegister(TASK_ID_EVENT, EventTask, TASK_PRIORITY_NORMAL, 0, TASK_USB);
+	TaskRegister(TASK_ID_BUTTON, ButtonTask, TASK_PRIORITY_LOW, TASK_BUTTON_PERIOD, TASK_USB);
+	TaskRegister(TASK_ID_BLINK, BlinkTask, TASK_PRIORITY_LOW, TASK_BLINK_PERIOD, 0);
+
+	// UserInit() has just started Timer3 from 0, and interrupts must not
+	// be enabled here to read it.
+	taskStatsStart = 0;
+}//end SchedulerInit
+
+
+/******************************************************************************
+ * Function:        static void TaskRegister(BYTE id, TASK_FUNCTION run,
+ *                                           BYTE priority, WORD period,
+ *                                           BYTE flags)
+ *
+ * PreCondition:    None
+ *
+ * Input:           id - TASK_ID_xxx, reported by CMD_TASK_STATS
+ *                  run - The task, it must return within 5 ms
+ *                  priority - TASK_PRIORITY_xxx
+ *                  period - Timer3 cycles from the start of one run to
+ *                           the next, below 65536. 0 runs the task on
+ *                           every pass.
+ *                  flags - TASK_USB to run only while the device is
+ *                          configured and not suspended
+ *
+ * Output:          None
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Adds the task to tasks[] behind every task of the same
+ *                  or a higher priority, so the table stays in the order
+ *                  SchedulerRun() walks it. Tasks past TASK_MAX are
+ *                  dropped.
+ *
+ * Note:            A task with a period first runs within a period.
+ *****************************************************************************/
+static void TaskRegister(BYTE id, TASK_FUNCTION run, BYTE priority, WORD period, BYTE flags)
+{
+	BYTE i;
+
+	if(taskCount == TASK_MAX)
+		return;
+
+	for(i = taskCount; i > 0 && tasks[i - 1].priority > priority; i--)
+		tasks[i] = tasks[i - 1];
+
+	tasks[i].run = run;
+	tasks[i].id = id;
+	tasks[i].priority = priority;
+	tasks[i].flags = flags;
+	tasks[i].period = period;
+	tasks[i].last = 0;
+	tasks[i].runs = 0;
+	tasks[i].cycles = 0;
+	tasks[i].maxCycles = 0;
+	taskCount++;
+}//end TaskRegister
+
+
+/******************************************************************************
+ * Function:        static void SchedulerRun(void)
+ *
+ * PreCondition:    SchedulerInit() has registered the tasks.
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Runs the tasks that are due.
+ *
+ * Overview:        One pass of the cooperative scheduler. Every task that
+ *                  is due runs once, highest priority first: a task with
+ *                  period 0 on every pass, any other once its period has
+ *                  passed since its last run started. A TASK_PRIORITY_LOW
+ *                  task that is due after the pass has already taken
+ *                  TASK_PASS_BUDGET cycles waits for a later pass, so
+ *                  under load the stream and the commands go first.
+ *
+ *                  Each run is timed with the low word of Timer3, as the
+ *                  A/D interrupt times itself, and added to the
+ *                  statistics of the task for CMD_TASK_STATS. Timer3 is
+ *                  read with GIEH clear: reading TMR3L latches TMR3H, and
+ *                  the high priority ISR reads Timer3 too. Interrupts
+ *                  that hit a task count as its cycles.
+ *
+ * Note:            Only the low word of the device time is compared, so
+ *                  periods and runs must stay below 65536 cycles, 5.4 ms.
+ *****************************************************************************/
+static void SchedulerRun(void)
+{
+	TASK *task;
+	BOOL usbReady;
+	BYTE i;
+	BYTE lo;
+	WORD passStart;
+	WORD start;
+	WORD cycles;
+
+	usbReady = (USBDeviceState >= CONFIGURED_STATE) && (USBSuspendControl == 0);
+	INTCONbits.GIEH = 0;
+	lo = TMR3L;
+	passStart = ((WORD)TMR3H << 8) | lo;
+	INTCONbits.GIEH = 1;
+
+	for(i = 0; i < taskCount; i++)
+	{
+		task = &tasks[i];
+		if((task->flags & TASK_USB) && !usbReady)
+			continue;
+
+		INTCONbits.GIEH = 0;
+		lo = TMR3L;
+		start = ((WORD)TMR3H << 8) | lo;
+		INTCONbits.GIEH = 1;
+		if(task->period != 0 && (WORD)(start - task->last) < task->period)
+			continue;
+		if(task->priority == TASK_PRIORITY_LOW && (WORD)(start - passStart) >= TASK_PASS_BUDGET)
+			continue;
+
+		task->last = start;
+		task->run();
+
+		INTCONbits.GIEH = 0;
+		lo = TMR3L;
+		cycles = (((WORD)TMR3H << 8) | lo) - start;
+		INTCONbits.GIEH = 1;
+		task->cycles += cycles;
+		if(cycles > task->maxCycles)
+			task->maxCycles = cycles;
+		if(task->runs != 0xFFFF)
+			task->runs++;
+	}
+}//end SchedulerRun
+
+static void TaskStatsReset(void)
+{
+	BYTE i;
+
+	for(i = 0; i < taskCount; i++)
+	{
+		tasks[i].runs = 0;
+		tasks[i].cycles = 0;
+		tasks[i].maxCycles = 0;
+	}
+	INTCONbits.GIEH = 0;
+	mTimeRead(taskStatsStart);
+	INTCONbits.GIEH = 1;
+}
+
+// Blinks the USB state on the LEDs unless the host drives them.
+static void BlinkTask(void)
+{
+	if(blinkStatusValid)
+		BlinkUSBStatus();
+}
+
+
 /********************************************************************
  * Function:        static void InitializeSystem(void)
  *
@@ -286,9 +1126,44 @@ static void InitializeSystem(void)
     #endif
     
 	USBGenericOutHandle = 0;	
-	USBGenericInHandle = 0;		
+	InBufferReset();
+	StreamBufferReset();
+	streamIso = FALSE;
+	eventEndpoint = FALSE;
+
+	streamHead = 0;
+	streamTail = 0;
+	streamOverruns = 0;
+	streamEnabled = FALSE;
+	streamFormat = STREAM_FORMAT_RAW16;
+	streamPacketSamples = STREAM_RAW16_SAMPLES;
+	scanChannels[0] = 0;
+	scanCount = 1;
+	scanMask = 0x0001;
+	adcOneShotPending = FALSE;
+	adcOneShotFailed = FALSE;
+	adcOneShotTagged = FALSE;
+	adcConversions = 0;
+	adcIsrCycles = 0;
+	adcIsrMaxCycles = 0;
+	pwm_enabled = 0;
+	pwm_step = 0;
+	laState = LA_IDLE;
+	timer3High = 0;
+	sofFrame = 0;
+	sofTime = 0;
+	adcOneShotStamp = 0;
+	EventBufferReset();
+	eventHead = 0;
+	eventTail = 0;
+	eventLost = 0;
+	buttonState = 0;
+	buttonSteady = 0;
+	buttonFrame = 0;
+	vendorPending = FALSE;
 
     UserInit();			//Application related initialization. 
+    SchedulerInit();
     USBDeviceInit();	//usb_device.c.  Initializes USB module SFRs and firmware
     					//variables to known states.
 }//end InitializeSystem
@@ -328,7 +1203,23 @@ void UserInit(void)
 	// Make RA0 and RA1 as input.
 	TRISAbits.TRISA0 = 1;
 	TRISAbits.TRISA1 = 1;
-	
+
+	// Both CCP modules use Timer1. CCP2 drives the A/D special event
+	// trigger while streaming. The A/D interrupt is low priority so the
+	// USB interrupt can always preempt it.
+	// Timer3 runs free at Fosc/4 for cycle accounting.
+	T3CON = 0x81;				// 16 bit reads, T3CCP2:T3CCP1 = 00, 1:1, Fosc/4, on
+	IPR2bits.TMR3IP = 1;
+	PIR2bits.TMR3IF = 0;
+	PIE2bits.TMR3IE = 1;
+	IPR1bits.ADIP = 0;
+	PIE1bits.ADIE = 0;
+	// The PORTB change interrupt is low priority as well, and raises
+	// events for all of RB4-RB7 until CMD_EVENT_CONFIG says otherwise.
+	INTCON2bits.RBIP = 0;
+	INTCONbits.GIEL = 1;
+	EventConfig(EVENT_PIN_MASK, EVENT_THRESHOLD_OFF, 0, 0);
+
 }//end UserInit
 
 
@@ -343,198 +1234,1630 @@ void UserInit(void)
  *
  * Side Effects:    None
  *
- * Overview:        This function is a place holder for other user
- *                  routines. It is a mixture of both USB and
- *                  non-USB tasks.
+ * Overview:        The command task of the scheduler, see
+ *                  SchedulerInit(). Commands are run by the handler that
+ *                  asciiCommands[] or binaryCommands[] holds for
+ *                  OUTPacket[0], so the lookup takes the same time for
+ *                  every command.
+ *
+ *                  A CMD_TAGGED packet is moved down over its tag header
+ *                  once, so the handler finds its command where it always
+ *                  does, and the freed tail is zeroed, so a handler that
+ *                  reads the whole packet sees no leftover bytes. The tag
+ *                  is kept in outTag until the command is done. Every
+ *                  tagged command gets exactly one tagged reply, so it
+ *                  only runs when an IN buffer is free: its handler fills
+ *                  in the reply behind the tag header, or, if it sends
+ *                  nothing, the command byte goes back as the ack. The
+ *                  host can then have many commands in flight and match
+ *                  the replies by tag.
  *
  * Note:            None
  *****************************************************************************/
 void ProcessIO(void)
 {   
-    //Blink the LEDs according to the USB device status, but only do so if the PC application isn't connected and controlling the LEDs.
-    if(blinkStatusValid)
-    {
-        BlinkUSBStatus();
-    }
-
-    // Check if the device is enumerated and is ready to accept commands.
-    if((USBDeviceState < CONFIGURED_STATE)||(USBSuspendControl==1)) return;
+    BOOL outPacketDone;
+    BYTE index;
+    BYTE i;
+    CMD_HANDLER handler;
 
     if(!USBHandleBusy(USBGenericOutHandle))		//Check if the endpoint has received any data from the host.
     {   
-        switch(OUTPacket[0])					//Data arrived, check what kind of command might be in the packet of data.
+        if(OUTPacket[0] == CMD_TAGGED)
         {
-			case 'A':
-			if(!USBHandleBusy(USBGenericInHandle))		
-	            {
-					if(OUTPacket[1] == '0')
-					{
-						ADCON0bits.ADON = 0;	// Switch off ADC.
-						ADCON0 &= 0xF0;			// Select channel 0
-						ADCON0bits.ADON = 1;
-						ADCON0bits.GO = 1;
-						// Wait if conversion is happening
-						while(ADCON0bits.DONE);
-						INPacket[0] = ADRESL;
-						INPacket[1] = ADRESH;
-					}
-					else if(OUTPacket[1] == '1')
-					{
-						ADCON0bits.ADON = 0;	// Switch off ADC.
-						ADCON0 &= 0xF0;			// Select channel 
-						ADCON0bits.CHS0 = 1;
-						ADCON0bits.ADON = 1;
-						ADCON0bits.GO = 1;
-						// Wait if conversion is happening
-						while(ADCON0bits.DONE);
-						INPacket[0] = ADRESL;
-						INPacket[1] = ADRESH;
-					}
-					USBGenericInHandle = USBGenWrite(USBGEN_EP_NUM,(BYTE*)&INPacket,USBGEN_EP_SIZE);	
-                }	
-				break;
-            case 0x80:  //Toggle LED(s) command from PC application.
-		        blinkStatusValid = FALSE;		//Disable the regular LED blink pattern indicating USB state, PC application is controlling the LEDs.
-                if(mGetLED_1() == mGetLED_2())
-                {
-                    mLED_1_Toggle();
-                    mLED_2_Toggle();
-                }
-                else
-                {
-                    mLED_1_On();
-                    mLED_2_On();
-                }
-                break;
-            case 0x81:  //Get push button state command from PC application.
-                if(!USBHandleBusy(USBGenericInHandle))		
-	            {	
-		            //The endpoint was not "busy", therefore it is safe to write to the buffer and arm the endpoint.					
-                    INPacket[0] = 0x81;				//Echo back to the host PC the command we are fulfilling in the first byte.  In this case, the Get Pushbutton State command.
-    				if(sw2 == 1)					//pushbutton not pressed, pull up resistor on circuit board is pulling the PORT pin high
-    				{
-    					INPacket[1] = 0x01;			
-    				}
-    				else							//sw2 must be == 0, pushbutton is pressed and overpowering the pull up resistor
-    				{
-    					INPacket[1] = 0x00;
-    				}				
-	                // Arm back the handle.
-					USBGenericInHandle = USBGenWrite(USBGEN_EP_NUM,(BYTE*)&INPacket,USBGEN_EP_SIZE);	
-                }
-                break;
+            outTag = OUTPacket[1];
+            for(i = 0; i < USBGEN_EP_SIZE - TAG_HEADER_SIZE; i++)
+            {
+                OUTPacket[i] = OUTPacket[i + TAG_HEADER_SIZE];
+            }
+            for(; i < USBGEN_EP_SIZE; i++)
+            {
+                OUTPacket[i] = 0;				// Not stale bytes of the old tail
+            }
+            outTagged = TRUE;
         }
-        
-        USBGenericOutHandle = USBGenRead(USBGEN_EP_NUM,(BYTE*)&OUTPacket,USBGEN_EP_SIZE);
-    }
-}//end ProcessIO
-
-
-/********************************************************************
- * Function:        void BlinkUSBStatus(void)
- *
- * PreCondition:    None
- *
- * Input:           None
- *
- * Output:          None
- *
- * Side Effects:    None
- *
- * Overview:        BlinkUSBStatus turns on and off LEDs 
- *                  corresponding to the USB device state.
- *
- * Note:            mLED macros can be found in HardwareProfile.h
- *                  USBDeviceState is declared and updated in
- *                  usb_device.c.
- *******************************************************************/
-void BlinkUSBStatus(void)
-{
-    static WORD led_count=0;
-    
-    if(led_count == 0)led_count = 10000U;
-    led_count--;
-
-    #define mLED_Both_Off()         {mLED_1_Off();mLED_2_Off();}
-    #define mLED_Both_On()          {mLED_1_On();mLED_2_On();}
-    #define mLED_Only_1_On()        {mLED_1_On();mLED_2_Off();}
-    #define mLED_Only_2_On()        {mLED_1_Off();mLED_2_On();}
 
-    if(USBSuspendControl == 1)
-    {
-        if(led_count==0)
+        outPacketDone = FALSE;
+        if(!outTagged || !mInBufferBusy())
         {
-            mLED_1_Toggle();
-            if(mGetLED_1())
+            if(outTagged)
+                TagReply(outTag);
+
+            //Data arrived, look up the handler for the command in OUTPacket[0].
+            //Unknown commands are dropped.
+            handler = 0;
+            index = OUTPacket[0] - CMD_ASCII_FIRST;
+            if(index < CMD_ASCII_COUNT)
             {
-                mLED_2_On();
+                handler = asciiCommands[index];
             }
             else
             {
-                mLED_2_Off();
+                index = OUTPacket[0] - CMD_BINARY_FIRST;
+                if(index < CMD_BINARY_COUNT)
+                    handler = binaryCommands[index];
             }
-        }//end if
-    }
-    else
-    {
-        if(USBDeviceState == DETACHED_STATE)
-        {
-            mLED_Both_Off();
-        }
-        else if(USBDeviceState == ATTACHED_STATE)
-        {
-            mLED_Both_On();
-        }
-        else if(USBDeviceState == POWERED_STATE)
-        {
-            mLED_Only_1_On();
-        }
-        else if(USBDeviceState == DEFAULT_STATE)
-        {
-            mLED_Only_2_On();
-        }
-        else if(USBDeviceState == ADDRESS_STATE)
-        {
-            if(led_count == 0)
+
+            outPacketDone = TRUE;
+            if(handler != 0)
             {
-                mLED_1_Toggle();
-                mLED_2_Off();
-            }//end if
-        }
-        else if(USBDeviceState == CONFIGURED_STATE)
-        {
-            if(led_count==0)
+                outPacketDone = handler();
+            }
+
+            if(replyTagged)
             {
-                mLED_1_Toggle();
-                if(mGetLED_1())
+                //The handler sent nothing. Ack a command that is done,
+                //drop the header of one that is retried.
+                if(outPacketDone)
                 {
-                    mLED_2_Off();
+                    INPacket[0] = OUTPacket[0];
+                    InBufferSend();
                 }
                 else
                 {
-                    mLED_2_On();
+                    replyTagged = FALSE;
+                    INPacket = INBuffers[inBufferNext];
                 }
-            }//end if
-        }//end if(...)
-    }//end if(UCONbits.SUSPND...)
-
-}//end BlinkUSBStatus
-
-
+            }
+        }
 
+        if(outPacketDone)
+        {
+            outTagged = FALSE;
+            USBGenericOutHandle = USBGenRead(USBGEN_EP_NUM,(BYTE*)&OUTPacket,USBGEN_EP_SIZE);
+        }
+    }
+}//end ProcessIO
 
-// ******************************************************************************************************
-// ************** USB Callback Functions ****************************************************************
-// ******************************************************************************************************
 
 /******************************************************************************
- * Function:        void USBCBSuspend(void)
+ * Function:        static BOOL CmdXxx(void)
  *
- * PreCondition:    None
+ * PreCondition:    OUTPacket holds the command.
  *
  * Input:           None
  *
- * Output:          None
+ * Output:          TRUE if OUTPacket can be re-armed, FALSE to retry the
+ *                  same command on the next ProcessIO() call.
+ *
+ * Side Effects:    May arm the IN endpoint with a reply.
+ *
+ * Overview:        The handlers of asciiCommands[] and binaryCommands[].
+ *
+ * Note:            None
+ *****************************************************************************/
+static BOOL CmdAdcOneShot(void)
+{
+	if(is_app_cmd(OUTPacket))
+		return AppBatchRun();
+
+	// One shot conversion of AN0 ('0') or AN1 ('1'). The A/D interrupt
+	// completes it and AdcOneShotTask() replies, so nothing spins here.
+	// While the previous one is still pending the packet is kept and
+	// retried. The tag of a tagged 'A' goes with the deferred reply.
+	// While a stream has the A/D the reply is ADC_ONE_SHOT_FAILED at
+	// once, the stream keeps running.
+	if(streamEnabled)
+	{
+		if(mInBufferBusy())
+			return FALSE;
+		INPacket[0] = (BYTE)ADC_ONE_SHOT_FAILED;
+		INPacket[1] = (BYTE)(ADC_ONE_SHOT_FAILED >> 8);
+		INPacket[2] = 0;
+		INPacket[3] = 0;
+		INPacket[4] = 0;
+		INPacket[5] = 0;
+		InBufferSend();
+		return TRUE;
+	}
+	if(!AdcOneShotStart((OUTPacket[1] == '1') ? 1 : 0))
+		return FALSE;
+	adcOneShotTagged = TagDefer(&adcOneShotTag);
+	return TRUE;
+}
+
+//Toggle LED(s) command from PC application.
+static BOOL CmdToggleLed(void)
+{
+	blinkStatusValid = FALSE;		//Disable the regular LED blink pattern indicating USB state, PC application is controlling the LEDs.
+	if(mGetLED_1() == mGetLED_2())
+	{
+		mLED_1_Toggle();
+		mLED_2_Toggle();
+	}
+	else
+	{
+		mLED_1_On();
+		mLED_2_On();
+	}
+	return TRUE;
+}
+
+//Get push button state command from PC application.
+static BOOL CmdPushbutton(void)
+{
+	if(!mInBufferBusy())
+	{
+		//The endpoint was not "busy", therefore it is safe to write to the buffer and arm the endpoint.
+		INPacket[0] = 0x81;				//Echo back to the host PC the command we are fulfilling in the first byte.  In this case, the Get Pushbutton State command.
+		if(sw2 == 1)					//pushbutton not pressed, pull up resistor on circuit board is pulling the PORT pin high
+		{
+			INPacket[1] = 0x01;
+		}
+		else							//sw2 must be == 0, pushbutton is pressed and overpowering the pull up resistor
+		{
+			INPacket[1] = 0x00;
+		}
+		// Arm back the handle.
+		InBufferSend();
+	}
+	return TRUE;
+}
+
+// OUTPacket[1] is the number of channels, followed by them.
+static BOOL CmdScanList(void)
+{
+	if(OUTPacket[1] <= USBGEN_EP_SIZE - 2)
+	{
+		StreamStop();
+		ScanSetList(OUTPacket[1], &OUTPacket[2]);
+	}
+	return TRUE;
+}
+
+// OUTPacket[1] is the channel or STREAM_CHANNEL_SCAN_LIST, OUTPacket[2..3]
+// the frame period in Timer1 ticks (LSB first, 0 selects the default) and
+// OUTPacket[4] the STREAM_FORMAT_xxx sample format.
+static BOOL CmdStreamStart(void)
+{
+	StreamStart(OUTPacket[1], ((WORD)OUTPacket[3] << 8) | OUTPacket[2], OUTPacket[4]);
+	return TRUE;
+}
+
+static BOOL CmdStreamStop(void)
+{
+	StreamStop();
+	return TRUE;
+}
+
+static BOOL CmdAdcStats(void)
+{
+	BOOL adie;
+
+	if(!mInBufferBusy())
+	{
+		INPacket[0] = CMD_ADC_STATS;
+		INPacket[1] = (BYTE)ADC_CONVERSION_CYCLES;
+		INPacket[2] = (BYTE)(ADC_CONVERSION_CYCLES >> 8);
+		// Consistent multi byte reads. ADIE goes back to what it was: a
+		// one shot may have completed and cleared it already.
+		adie = PIE1bits.ADIE;
+		PIE1bits.ADIE = 0;
+		INPacket[3] = (BYTE)adcIsrCycles;
+		INPacket[4] = (BYTE)(adcIsrCycles >> 8);
+		INPacket[5] = (BYTE)adcIsrMaxCycles;
+		INPacket[6] = (BYTE)(adcIsrMaxCycles >> 8);
+		INPacket[7] = (BYTE)streamOverruns;
+		INPacket[8] = (BYTE)(streamOverruns >> 8);
+		INPacket[9] = (BYTE)adcConversions;
+		INPacket[10] = (BYTE)(adcConversions >> 8);
+		INPacket[11] = (BYTE)(adcConversions >> 16);
+		INPacket[12] = (BYTE)(adcConversions >> 24);
+		PIE1bits.ADIE = adie;
+		InBufferSend();
+	}
+	return TRUE;
+}//end CmdAdcStats
+
+static BOOL CmdPortSnapshot(void)
+{
+	if(mInBufferBusy())
+		return FALSE;
+
+	PortSnapshotSend();
+	return TRUE;
+}
+
+// OUTPacket[1..3] are the masks and OUTPacket[4..6] the values for LATA,
+// LATB and LATC. Only the bits set in a mask change. The packet is kept
+// until the reply can be sent, so the write is never applied twice.
+static BOOL CmdPortWrite(void)
+{
+	if(mInBufferBusy())
+		return FALSE;
+
+	// The Timer2 interrupt writes LATC bits for the software PWM, keep it
+	// from landing between the read and the write back.
+	INTCONbits.GIEL = 0;
+	LATA = (LATA & ~OUTPacket[1]) | (OUTPacket[4] & OUTPacket[1]);
+	LATB = (LATB & ~OUTPacket[2]) | (OUTPacket[5] & OUTPacket[2]);
+	LATC = (LATC & ~OUTPacket[3]) | (OUTPacket[6] & OUTPacket[3]);
+	INTCONbits.GIEL = 1;
+
+	PortSnapshotSend();
+	return TRUE;
+}//end CmdPortWrite
+
+
+/******************************************************************************
+ * Function:        static void PortSnapshotSend(void)
+ *
+ * PreCondition:    An IN buffer is free.
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Arms the IN endpoint with the reply.
+ *
+ * Overview:        Reads PORTA, PORTB and PORTC back to back with
+ *                  interrupts off, so all pins are sampled within three
+ *                  instruction cycles (250 ns) of each other, and sends
+ *                  them with the output latches and directions:
+ *                  INPacket[0]    OUTPacket[0], the command
+ *                  INPacket[1..3] PORTA, PORTB, PORTC (pin levels)
+ *                  INPacket[4..6] LATA, LATB, LATC
+ *                  INPacket[7..9] TRISA, TRISB, TRISC
+ *
+ * Note:            Unlike the PRA0X style command, which reads LATx, this
+ *                  returns what is on the pins.
+ *****************************************************************************/
+static void PortSnapshotSend(void)
+{
+	INTCONbits.GIEH = 0;
+	INPacket[PORT_SNAPSHOT_PORT] = PORTA;
+	INPacket[PORT_SNAPSHOT_PORT + 1] = PORTB;
+	INPacket[PORT_SNAPSHOT_PORT + 2] = PORTC;
+	INTCONbits.GIEH = 1;
+
+	INPacket[0] = OUTPacket[0];
+	INPacket[PORT_SNAPSHOT_LAT] = LATA;
+	INPacket[PORT_SNAPSHOT_LAT + 1] = LATB;
+	INPacket[PORT_SNAPSHOT_LAT + 2] = LATC;
+	INPacket[PORT_SNAPSHOT_TRIS] = TRISA;
+	INPacket[PORT_SNAPSHOT_TRIS + 1] = TRISB;
+	INPacket[PORT_SNAPSHOT_TRIS + 2] = TRISC;
+	InBufferSend();
+}//end PortSnapshotSend
+
+// OUTPacket[1] is the LA_TRIGGER_xxx mode, OUTPacket[2] the mask and
+// OUTPacket[3] the value of the trigger pattern, OUTPacket[4..5] the
+// number of pre-trigger samples and OUTPacket[6..7] the sample period in
+// instruction cycles (0 selects the default), both LSB first.
+static BOOL CmdLaStart(void)
+{
+	LaStart(OUTPacket[1], OUTPacket[2], OUTPacket[3],
+			((WORD)OUTPacket[5] << 8) | OUTPacket[4],
+			((WORD)OUTPacket[7] << 8) | OUTPacket[6]);
+	return TRUE;
+}
+
+static BOOL CmdLaStop(void)
+{
+	LaStop();
+	return TRUE;
+}
+
+
+/******************************************************************************
+ * Function:        void LaStart(BYTE mode, BYTE mask, BYTE value,
+ *                               WORD preTrigger, WORD period)
+ *
+ * PreCondition:    None
+ *
+ * Input:           mode - LA_TRIGGER_LEVEL or LA_TRIGGER_EDGE
+ *                  mask - PORTB bits the trigger looks at
+ *                  value - Level of those bits that triggers
+ *                  preTrigger - Samples to keep from before the trigger
+ *                  period - Instruction cycles between samples, 0 for
+ *                           LA_DEFAULT_PERIOD
+ *
+ * Output:          None
+ *
+ * Side Effects:    Aborts a capture in progress.
+ *
+ * Overview:        Starts sampling PORTB every period cycles into
+ *                  laBuffer[]. The trigger is looked for once preTrigger
+ *                  samples have been taken, a mask of 0 triggers at once.
+ *                  LA_TRIGGER_EDGE also needs one of the masked bits to
+ *                  differ from the previous sample, so with a single bit
+ *                  a value of 1 is a rising and 0 a falling edge.
+ *                  LaTask() uploads the capture when it is full.
+ *
+ * Note:            Periods below LA_MIN_PERIOD are raised to it.
+ *                  preTrigger is clipped to LA_BUFFER_SIZE - 1.
+ *****************************************************************************/
+void LaStart(BYTE mode, BYTE mask, BYTE value, WORD preTrigger, WORD period)
+{
+	LaStop();
+
+	if(period == 0)
+		period = LA_DEFAULT_PERIOD;
+	else if(period < LA_MIN_PERIOD)
+		period = LA_MIN_PERIOD;
+	if(preTrigger > LA_BUFFER_SIZE - 1)
+		preTrigger = LA_BUFFER_SIZE - 1;
+
+	laTriggerMode = mode;
+	laTriggerMask = mask;
+	laTriggerValue = value & mask;
+	laPreTrigger = preTrigger;
+	laRemaining = LA_BUFFER_SIZE - preTrigger;
+	laReload = LA_RELOAD_FIXUP - period;
+	laLate = 0;
+	laHead = 0;
+	laFilled = 0;
+	laSent = 0;
+	laPrevious = PORTB;
+	laState = LA_ARMED;
+
+	// 16 bit, Fosc/4, no prescaler. TMR0H is written through its buffer
+	// when TMR0L is written.
+	T0CON = 0x08;
+	TMR0H = (BYTE)(laReload >> 8);
+	TMR0L = (BYTE)laReload;
+	INTCON2bits.TMR0IP = 1;
+	INTCONbits.TMR0IF = 0;
+	INTCONbits.TMR0IE = 1;
+	T0CONbits.TMR0ON = 1;
+}//end LaStart
+
+
+/******************************************************************************
+ * Function:        void LaStop(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Samples not uploaded yet are discarded.
+ *
+ * Overview:        Stops Timer0 and ends the capture.
+ *
+ * Note:            None
+ *****************************************************************************/
+void LaStop(void)
+{
+	T0CONbits.TMR0ON = 0;
+	INTCONbits.TMR0IE = 0;
+	INTCONbits.TMR0IF = 0;
+	laState = LA_IDLE;
+}//end LaStop
+
+
+/******************************************************************************
+ * Function:        static void LaTask(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Arms the IN endpoint when a packet is sent.
+ *
+ * Overview:        Once a capture is complete, sends laBuffer[] oldest
+ *                  sample first as a burst of packets, one per free IN
+ *                  buffer:
+ *                  INPacket[0]    CMD_LA_START
+ *                  INPacket[1]    Number of samples in this packet
+ *                  INPacket[2..3] Index of its first sample in the
+ *                                 capture, LSB first
+ *                  INPacket[4..]  PORTB samples
+ *
+ *                  The capture is LA_BUFFER_SIZE samples and the trigger
+ *                  sample is at index preTrigger. The last packet has
+ *                  LA_LATE_SIZE more bytes after its samples, the number
+ *                  of samples taken late, LSB first: each came more than
+ *                  a period after the one before it, and the samples
+ *                  after it are that much later than the period says.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void LaTask(void)
+{
+	BYTE i;
+	BYTE count;
+	WORD slot;
+
+	if(laState != LA_DONE)
+		return;
+	if(mInBufferBusy())
+		return;
+
+	count = LA_PACKET_SAMPLES;
+	if(LA_BUFFER_SIZE - laSent < count)
+		count = LA_BUFFER_SIZE - laSent;
+	INPacket[0] = CMD_LA_START;
+	INPacket[1] = count;
+	INPacket[2] = (BYTE)laSent;
+	INPacket[3] = (BYTE)(laSent >> 8);
+	slot = (laStart + laSent) & LA_BUFFER_MASK;
+	for(i = 0; i < count; i++)
+	{
+		INPacket[LA_HEADER_SIZE + i] = laBuffer[slot];
+		slot = (slot + 1) & LA_BUFFER_MASK;
+	}
+	laSent += count;
+	if(laSent == LA_BUFFER_SIZE)
+	{
+		INPacket[LA_HEADER_SIZE + i] = (BYTE)laLate;
+		INPacket[LA_HEADER_SIZE + i + 1] = (BYTE)(laLate >> 8);
+		laState = LA_IDLE;
+	}
+	InBufferSend();
+}//end LaTask
+
+// Replies with the frame number and device time of the last SOF and the
+// device time now:
+// INPacket[0]     CMD_TIME
+// INPacket[1..2]  Frame number of the last SOF (11 bits)
+// INPacket[3..6]  Device time of that SOF
+// INPacket[7..10] Device time now
+// all LSB first. The device time counts instruction cycles at 12 MHz.
+static BOOL CmdTime(void)
+{
+	WORD frame;
+	DWORD sof;
+	DWORD now;
+
+	if(mInBufferBusy())
+		return FALSE;
+
+	INTCONbits.GIEH = 0;
+	frame = sofFrame;
+	sof = sofTime;
+	mTimeRead(now);
+	INTCONbits.GIEH = 1;
+
+	INPacket[0] = CMD_TIME;
+	INPacket[1] = (BYTE)frame;
+	INPacket[2] = (BYTE)(frame >> 8);
+	INPacket[3] = (BYTE)sof;
+	INPacket[4] = (BYTE)(sof >> 8);
+	INPacket[5] = (BYTE)(sof >> 16);
+	INPacket[6] = (BYTE)(sof >> 24);
+	INPacket[7] = (BYTE)now;
+	INPacket[8] = (BYTE)(now >> 8);
+	INPacket[9] = (BYTE)(now >> 16);
+	INPacket[10] = (BYTE)(now >> 24);
+	InBufferSend();
+	return TRUE;
+}//end CmdTime
+
+// OUTPacket[1] is the mask of the RB4-RB7 pins that raise EVENT_PINS,
+// OUTPacket[2] the A/D channel to watch for threshold crossings or
+// EVENT_THRESHOLD_OFF, OUTPacket[3..4] the low and OUTPacket[5..6] the
+// high threshold, LSB first.
+static BOOL CmdEventConfig(void)
+{
+	EventConfig(OUTPacket[1], OUTPacket[2],
+				((WORD)OUTPacket[4] << 8) | OUTPacket[3],
+				((WORD)OUTPacket[6] << 8) | OUTPacket[5]);
+	return TRUE;
+}
+
+// OUTPacket[1] is the first task to report, since a reply has room for
+// TASK_STATS_RECORDS, and OUTPacket[2] TASK_STATS_RESET to start the
+// statistics over after this reply. The reply is [1] the number of tasks,
+// [2] the first task and [3] the records in it, [4..7] the cycles since
+// the statistics were reset, then per task in priority order its id,
+// priority, runs, cycles and longest run, all LSB first. The cycles no
+// task accounts for are the scheduler's own.
+static BOOL CmdTaskStats(void)
+{
+	BYTE *p;
+	BYTE first;
+	BYTE n;
+	DWORD now;
+
+	if(mInBufferBusy())
+		return FALSE;
+
+	first = OUTPacket[1];
+	if(first > taskCount)
+		first = taskCount;
+	n = 0;
+	p = &INPacket[TASK_STATS_HEADER];
+	while(first + n < taskCount && n < TASK_STATS_RECORDS)
+	{
+		p[0] = tasks[first + n].id;
+		p[1] = tasks[first + n].priority;
+		p[2] = (BYTE)tasks[first + n].runs;
+		p[3] = (BYTE)(tasks[first + n].runs >> 8);
+		p[4] = (BYTE)tasks[first + n].cycles;
+		p[5] = (BYTE)(tasks[first + n].cycles >> 8);
+		p[6] = (BYTE)(tasks[first + n].cycles >> 16);
+		p[7] = (BYTE)(tasks[first + n].cycles >> 24);
+		p[8] = (BYTE)tasks[first + n].maxCycles;
+		p[9] = (BYTE)(tasks[first + n].maxCycles >> 8);
+		p += TASK_STATS_RECORD;
+		n++;
+	}
+
+	INTCONbits.GIEH = 0;
+	mTimeRead(now);
+	INTCONbits.GIEH = 1;
+	now -= taskStatsStart;
+
+	INPacket[0] = CMD_TASK_STATS;
+	INPacket[1] = taskCount;
+	INPacket[2] = first;
+	INPacket[3] = n;
+	INPacket[4] = (BYTE)now;
+	INPacket[5] = (BYTE)(now >> 8);
+	INPacket[6] = (BYTE)(now >> 16);
+	INPacket[7] = (BYTE)(now >> 24);
+	InBufferSend();
+
+	if(OUTPacket[2] & TASK_STATS_RESET)
+		TaskStatsReset();
+	return TRUE;
+}
+
+
+/******************************************************************************
+ * Function:        void EventConfig(BYTE pins, BYTE channel, WORD low,
+ *                                   WORD high)
+ *
+ * PreCondition:    None
+ *
+ * Input:           pins - PORTB bits that raise EVENT_PINS when they
+ *                         change, only those of EVENT_PIN_MASK count
+ *                  channel - A/D channel watched for crossings, or
+ *                            EVENT_THRESHOLD_OFF
+ *                  low - A falling crossing is a sample at or below it
+ *                  high - A rising crossing is a sample at or above it
+ *
+ * Output:          None
+ *
+ * Side Effects:    Enables the PORTB change interrupt if any pin is set.
+ *
+ * Overview:        Sets what raises events besides the buttons, which
+ *                  always do. The channel starts out below the threshold,
+ *                  so a signal already above high raises a rising
+ *                  crossing on its first sample.
+ *
+ * Note:            Thresholds are checked on the conversions that run
+ *                  anyway, streamed or one shot; none are started for
+ *                  them. A PORTB read elsewhere, eg by a logic analyzer
+ *                  capture, at the instant a pin changes can end the
+ *                  mismatch before RBIF is set, so a change may be missed
+ *                  while one runs.
+ *****************************************************************************/
+void EventConfig(BYTE pins, BYTE channel, WORD low, WORD high)
+{
+	INTCONbits.GIEL = 0;
+	eventPinMask = pins & EVENT_PIN_MASK;
+	eventThresholdChannel = (channel < 16) ? channel : EVENT_THRESHOLD_OFF;
+	eventThresholdLow = low;
+	eventThresholdHigh = high;
+	eventThresholdAbove = FALSE;
+	eventPortB = PORTB;
+	INTCONbits.RBIF = 0;
+	INTCONbits.RBIE = (eventPinMask != 0);
+	INTCONbits.GIEL = 1;
+}//end EventConfig
+
+
+/******************************************************************************
+ * Function:        static void ButtonTask(void)
+ *
+ * PreCondition:    The device is configured, so SOFs come every 1 ms.
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Queues an EVENT_BUTTON record when a button changes.
+ *
+ * Overview:        Samples sw2 and sw3 once per SOF and takes a new state
+ *                  only after it has held for EVENT_DEBOUNCE_FRAMES
+ *                  samples in a row, so contact bounce, which EVENT_PINS
+ *                  reports as it is, raises one press and one release.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void ButtonTask(void)
+{
+	BYTE buttons;
+	DWORD stamp;
+
+	if((BYTE)sofFrame == buttonFrame)
+		return;
+	buttonFrame = (BYTE)sofFrame;
+
+	// The switches pull their pins low when pressed.
+	buttons = 0;
+	if(sw2 == 0)
+		buttons |= 0x01;
+	if(sw3 == 0)
+		buttons |= 0x02;
+
+	if(buttons == buttonState)
+	{
+		buttonSteady = 0;
+		return;
+	}
+	if(++buttonSteady < EVENT_DEBOUNCE_FRAMES)
+		return;
+
+	buttonSteady = 0;
+	INTCONbits.GIEL = 0;
+	mEventQueue(EVENT_BUTTON, buttons, buttons ^ buttonState, 0, stamp);
+	INTCONbits.GIEL = 1;
+	buttonState = buttons;
+}//end ButtonTask
+
+
+/******************************************************************************
+ * Function:        void StreamStart(BYTE channel, WORD period, BYTE format)
+ *
+ * PreCondition:    UserInit() has configured the A/D module.
+ *
+ * Input:           channel - A/D channel to sample, or
+ *                  STREAM_CHANNEL_SCAN_LIST for every channel set by
+ *                  ScanSetList().
+ *                  period - Frame period in Timer1 ticks (12 MHz). 0
+ *                  selects STREAM_DEFAULT_PERIOD.
+ *                  format - STREAM_FORMAT_xxx used for the packets.
+ *                  Unknown formats fall back to STREAM_FORMAT_RAW16.
+ *
+ * Output:          None
+ *
+ * Side Effects:    Takes over Timer1, CCP2 and the A/D module. A one shot
+ *                  'A' whose reply has not been sent yet fails.
+ *
+ * Overview:        Starts hardware timed sampling. CCP2 in special event
+ *                  trigger mode resets Timer1 and starts a conversion every
+ *                  period, without any CPU involvement. The A/D interrupt
+ *                  pushes each result into streamRing[], starts the next
+ *                  channel of the frame and StreamTask() sends the samples
+ *                  to the host in full packets on USBSTREAM_EP_NUM.
+ *
+ * Note:            Periods below STREAM_MIN_PERIOD per channel are
+ *                  clamped, since the A/D cannot convert any faster. On
+ *                  the isochronous endpoint periods that would fill more
+ *                  than one packet per frame are clamped as well.
+ *****************************************************************************/
+void StreamStart(BYTE channel, WORD period, BYTE format)
+{
+	StreamStop();
+
+	// The stream reuses streamRing[], so the 'A' reply must not wait for
+	// a sample there. AdcOneShotTask() sends it as ADC_ONE_SHOT_FAILED.
+	if(adcOneShotPending)
+		adcOneShotFailed = TRUE;
+
+	if(channel != STREAM_CHANNEL_SCAN_LIST)
+	{
+		ScanSetList(1, &channel);
+	}
+
+	// Only whole frames go into a packet.
+	if(format == STREAM_FORMAT_PACKED10)
+	{
+		streamFormat = STREAM_FORMAT_PACKED10;
+		streamPacketSamples = STREAM_PACKED10_SAMPLES;
+	}
+	else
+	{
+		streamFormat = STREAM_FORMAT_RAW16;
+		streamPacketSamples = STREAM_RAW16_SAMPLES;
+	}
+	streamPacketSamples -= streamPacketSamples % scanCount;
+
+	if(period == 0)
+		period = STREAM_DEFAULT_PERIOD;
+	if(period < STREAM_MIN_PERIOD * scanCount)
+		period = STREAM_MIN_PERIOD * scanCount;
+	// A packet holds streamPacketSamples / scanCount frames of one period.
+	if(streamIso && (DWORD)period * streamPacketSamples < STREAM_FRAME_TICKS * scanCount)
+		period = (WORD)((STREAM_FRAME_TICKS * scanCount + streamPacketSamples - 1) / streamPacketSamples);
+
+	streamHead = 0;
+	streamTail = 0;
+	streamOverruns = 0;
+	scanIndex = 0;
+	scanDropFrame = FALSE;
+	streamStampHead = 0;
+	streamStampTail = 0;
+	streamPacketFill = 0;
+
+	// Select the first channel and leave the A/D on, the trigger sets GO.
+	ADCON0 = (scanChannels[0] << 2) | 0x01;
+
+	TMR1H = 0;
+	TMR1L = 0;
+	CCPR2H = (BYTE)(period >> 8);
+	CCPR2L = (BYTE)period;
+	CCP2CON = 0x0B;				// Compare mode, special event trigger
+
+	PIR1bits.ADIF = 0;
+	PIE1bits.ADIE = 1;
+	streamEnabled = TRUE;
+	T1CON = 0x81;				// 16 bit reads, 1:1 prescale, Fosc/4, on
+}//end StreamStart
+
+
+/******************************************************************************
+ * Function:        void StreamStop(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Samples still in streamRing[] are discarded.
+ *
+ * Overview:        Stops the Timer1/CCP2 trigger and the A/D interrupt.
+ *
+ * Note:            None
+ *****************************************************************************/
+void StreamStop(void)
+{
+	T1CONbits.TMR1ON = 0;
+	CCP2CON = 0x00;
+	PIE1bits.ADIE = 0;
+	PIR1bits.ADIF = 0;
+	streamEnabled = FALSE;
+}//end StreamStop
+
+
+/******************************************************************************
+ * Function:        static void StreamTask(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Arms the stream endpoint when a packet is sent.
+ *
+ * Overview:        Sends streamPacketSamples samples from streamRing[]
+ *                  on USBSTREAM_EP_NUM whenever that many are waiting and
+ *                  a stream buffer is free. While one buffer is on the bus
+ *                  the next one is filled here, so a slow IN token from
+ *                  the host only costs ring space. Packet layout:
+ *                  packet[0]      CMD_STREAM_START
+ *                  packet[1]      Format in bits 7..6, sample count in 5..0
+ *                  packet[2..3]   Mask of the scanned channels, LSB first
+ *                  packet[4..7]   Device time of the trigger of the
+ *                                 first frame, LSB first
+ *                  packet[8..]    Samples in that format
+ *
+ *                  Samples are whole frames of one sample per channel in
+ *                  the mask, lowest channel first. Frames of a packet are
+ *                  one period apart unless frames were dropped, which
+ *                  shows as a gap between the times of two packets.
+ *
+ *                  STREAM_FORMAT_RAW16 sends each sample as 2 bytes, LSB
+ *                  first. STREAM_FORMAT_PACKED10 sends groups of 4 samples
+ *                  as their 4 low bytes followed by one byte holding the
+ *                  top 2 bits of each, first sample in bits 1..0. A last
+ *                  partial group of n samples takes n + 1 bytes.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void StreamTask(void)
+{
+	BYTE i;
+	BYTE j;
+	BYTE high;
+	BYTE *p;
+	BYTE *packet;
+	WORD sample;
+	DWORD stamp;
+
+	if(!streamEnabled)
+		return;
+	if(mStreamBufferBusy())
+		return;
+	if(((streamHead - streamTail) & STREAM_RING_MASK) < streamPacketSamples)
+		return;
+
+	packet = StreamBuffers[streamBufferNext];
+	packet[0] = CMD_STREAM_START;
+	packet[1] = (streamFormat << STREAM_FORMAT_SHIFT) | streamPacketSamples;
+	packet[2] = (BYTE)scanMask;
+	packet[3] = (BYTE)(scanMask >> 8);
+	stamp = streamStamps[streamStampTail];
+	streamStampTail = (streamStampTail + 1) & STREAM_STAMP_MASK;
+	packet[4] = (BYTE)stamp;
+	packet[5] = (BYTE)(stamp >> 8);
+	packet[6] = (BYTE)(stamp >> 16);
+	packet[7] = (BYTE)(stamp >> 24);
+	p = &packet[STREAM_HEADER_SIZE];
+	if(streamFormat == STREAM_FORMAT_PACKED10)
+	{
+		for(i = 0; i < streamPacketSamples; i += j)
+		{
+			high = 0;
+			for(j = 0; (j < 4) && (i + j < streamPacketSamples); j++)
+			{
+				sample = streamRing[streamTail];
+				*p++ = (BYTE)sample;
+				high |= ((BYTE)(sample >> 8) & 0x03) << (j << 1);
+				streamTail = (streamTail + 1) & STREAM_RING_MASK;
+			}
+			*p++ = high;
+		}
+	}
+	else
+	{
+		for(i = 0; i < streamPacketSamples; i++)
+		{
+			sample = streamRing[streamTail];
+			*p++ = (BYTE)sample;
+			*p++ = (BYTE)(sample >> 8);
+			streamTail = (streamTail + 1) & STREAM_RING_MASK;
+		}
+	}
+	StreamBufferSend();
+}//end StreamTask
+
+
+/******************************************************************************
+ * Function:        static void StreamAltTask(void)
+ *
+ * PreCondition:    The device is configured.
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Stops the stream when the stream endpoint changes.
+ *
+ * Overview:        The stack answers SET_INTERFACE itself and only keeps
+ *                  the new alternate setting in USBAlternateInterface[],
+ *                  so this follows it: USBSTREAM_EP_NUM is re-enabled as
+ *                  a bulk endpoint with handshakes for STREAM_ALT_BULK
+ *                  and STREAM_ALT_BULK_EVENTS or as an isochronous one
+ *                  without for STREAM_ALT_ISO. Re-enabling it drops
+ *                  whatever was armed, so the stream buffers start over
+ *                  as well. USBEVENT_EP_NUM is enabled in the settings
+ *                  that have it and disabled in STREAM_ALT_BULK; records
+ *                  queued meanwhile wait in eventQueue[], and those that
+ *                  do not fit are reported as EVENT_LOST once it is back.
+ *
+ * Note:            The host selects the alternate setting before it
+ *                  starts a stream.
+ *****************************************************************************/
+static void StreamAltTask(void)
+{
+	BOOL iso;
+	BOOL events;
+
+	events = (USBAlternateInterface[0] != STREAM_ALT_BULK);
+	if(events != eventEndpoint)
+	{
+		eventEndpoint = events;
+		if(events)
+			USBEnableEndpoint(USBEVENT_EP_NUM,USB_IN_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
+		else
+			USBEnableEndpoint(USBEVENT_EP_NUM,0);	// Disabled
+		EventBufferReset();
+	}
+
+	iso = (USBAlternateInterface[0] == STREAM_ALT_ISO);
+	if(iso == streamIso)
+		return;
+
+	StreamStop();
+	streamIso = iso;
+	if(iso)
+		USBEnableEndpoint(USBSTREAM_EP_NUM,USB_IN_ENABLED|USB_DISALLOW_SETUP);
+	else
+		USBEnableEndpoint(USBSTREAM_EP_NUM,USB_IN_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
+	StreamBufferReset();
+}//end StreamAltTask
+
+
+/******************************************************************************
+ * Function:        static void EventTask(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Arms the event endpoint when a packet is sent.
+ *
+ * Overview:        Sends the queued event records, oldest first, up to
+ *                  EVENT_PACKET_RECORDS per packet on USBEVENT_EP_NUM. The
+ *                  packet is as long as its records, so the host learns
+ *                  their number from its length. A record is:
+ *                  record[0]      EVENT_xxx
+ *                  record[1..3]   EVENT_PINS: PORTB, then the pins of
+ *                                 RB4-RB7 that changed, 0
+ *                                 EVENT_BUTTON: buttons down, then the
+ *                                 buttons that changed, bit 0 sw2 and
+ *                                 bit 1 sw3, 0
+ *                                 EVENT_THRESHOLD: channel, or'ed with
+ *                                 EVENT_THRESHOLD_RISING for a rising
+ *                                 crossing, then the sample LSB first
+ *                                 EVENT_LOST: records dropped, LSB
+ *                                 first, 0
+ *                  record[4..7]   Device time, LSB first
+ *
+ *                  Records dropped because eventQueue[] was full are
+ *                  reported with an EVENT_LOST record after the ones
+ *                  queued before them. Nothing is sent while the
+ *                  alternate setting has no USBEVENT_EP_NUM.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void EventTask(void)
+{
+	BYTE i;
+	BYTE n;
+	BYTE *p;
+	WORD lost;
+	DWORD now;
+
+	if(!eventEndpoint || mEventBufferBusy())
+		return;
+	if(eventHead == eventTail && eventLost == 0)
+		return;
+
+	p = EventBuffers[eventBufferNext];
+	for(n = 0; n < EVENT_PACKET_RECORDS && eventTail != eventHead; n++)
+	{
+		for(i = 0; i < EVENT_RECORD_SIZE; i++)
+			*p++ = eventQueue[eventTail][i];
+		eventTail = (eventTail + 1) & EVENT_QUEUE_MASK;
+	}
+	if(n < EVENT_PACKET_RECORDS && eventTail == eventHead)
+	{
+		INTCONbits.GIEL = 0;
+		lost = eventLost;
+		eventLost = 0;
+		INTCONbits.GIEL = 1;
+		if(lost != 0)
+		{
+			INTCONbits.GIEH = 0;
+			mTimeRead(now);
+			INTCONbits.GIEH = 1;
+			p[0] = EVENT_LOST;
+			p[1] = (BYTE)lost;
+			p[2] = (BYTE)(lost >> 8);
+			p[3] = 0;
+			p[4] = (BYTE)now;
+			p[5] = (BYTE)(now >> 8);
+			p[6] = (BYTE)(now >> 16);
+			p[7] = (BYTE)(now >> 24);
+			n++;
+		}
+	}
+	if(n == 0)
+		return;
+
+	USBEventInHandle[eventBufferNext] = USBGenWrite(USBEVENT_EP_NUM,EventBuffers[eventBufferNext],n * EVENT_RECORD_SIZE);
+	if(++eventBufferNext == EVENT_BUFFER_COUNT)
+		eventBufferNext = 0;
+}//end EventTask
+
+
+/******************************************************************************
+ * Function:        static void VendorTask(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Completes the control transfer of the request.
+ *
+ * Overview:        Applies the vendor request USBCBCheckOtherReq() left in
+ *                  vendorRequest, the same way the matching EP1 command
+ *                  would, then lets the stack run the status stage, so
+ *                  the host's control transfer returns once the change
+ *                  is in effect.
+ *
+ * Note:            Runs before the EP1 OUT packet is looked at, so a
+ *                  request is never held up by a command that is waiting
+ *                  for an IN buffer.
+ *****************************************************************************/
+static void VendorTask(void)
+{
+	BYTE mask;
+	BYTE value;
+
+	if(!vendorPending)
+		return;
+
+	switch(vendorRequest)
+	{
+		case VENDOR_STREAM_START:
+			StreamStart((BYTE)vendorIndex, vendorValue, (BYTE)(vendorIndex >> 8));
+			break;
+		case VENDOR_STREAM_STOP:
+			StreamStop();
+			break;
+		case VENDOR_SCAN_MASK:
+			if(vendorValue & SCAN_VALID_MASK)
+			{
+				StreamStop();
+				ScanSetMask(vendorValue & SCAN_VALID_MASK);
+			}
+			break;
+		case VENDOR_PORT_WRITE:
+			// As CmdPortWrite(), clear of the software PWM.
+			mask = (BYTE)vendorValue;
+			value = (BYTE)(vendorValue >> 8) & mask;
+			INTCONbits.GIEL = 0;
+			if(vendorIndex == 0)
+				LATA = (LATA & ~mask) | value;
+			else if(vendorIndex == 1)
+				LATB = (LATB & ~mask) | value;
+			else if(vendorIndex == 2)
+				LATC = (LATC & ~mask) | value;
+			INTCONbits.GIEL = 1;
+			break;
+		case VENDOR_EVENT_CONFIG:
+			EventConfig(vendorData[0], vendorData[1],
+						((WORD)vendorData[3] << 8) | vendorData[2],
+						((WORD)vendorData[5] << 8) | vendorData[4]);
+			break;
+	}
+
+	vendorPending = FALSE;
+	USBMaskInterrupts();
+	USBCtrlEPAllowStatusStage();
+	USBUnmaskInterrupts();
+}//end VendorTask
+
+// Called by the stack when the data stage of VENDOR_EVENT_CONFIG is in
+// vendorData[].
+static void VendorDataReceived(void)
+{
+	vendorPending = TRUE;
+}
+
+
+/******************************************************************************
+ * Function:        static BOOL AdcOneShotStart(BYTE channel)
+ *
+ * PreCondition:    None
+ *
+ * Input:           channel - A/D channel to convert
+ *
+ * Output:          TRUE if the conversion was started, FALSE if the
+ *                  previous one shot conversion has not been sent yet or
+ *                  a stream has the A/D.
+ *
+ * Side Effects:    None
+ *
+ * Overview:        Starts a single conversion and returns at once. The A/D
+ *                  interrupt puts the result in streamRing[].
+ *
+ * Note:            None
+ *****************************************************************************/
+static BOOL AdcOneShotStart(BYTE channel)
+{
+	if(adcOneShotPending || streamEnabled)
+		return FALSE;
+
+	// Samples a stopped stream left behind.
+	streamHead = 0;
+	streamTail = 0;
+	scanIndex = 0;
+	scanDropFrame = FALSE;
+
+	adcOneShotPending = TRUE;
+	adcOneShotFailed = FALSE;
+	ADCON0 = (channel << 2) | 0x01;		// Channel, ADON
+	PIR1bits.ADIF = 0;
+	PIE1bits.ADIE = 1;
+	ADCON0bits.GO = 1;
+	return TRUE;
+}//end AdcOneShotStart
+
+
+/******************************************************************************
+ * Function:        static void AdcOneShotTask(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Arms the IN endpoint when the reply is sent.
+ *
+ * Overview:        Sends the result of a one shot 'A' conversion once the
+ *                  A/D interrupt has queued it and an IN buffer is free.
+ *                  The reply keeps the original layout, the sample LSB
+ *                  first in INPacket[0..1], and adds the device time the
+ *                  conversion completed in INPacket[2..5]. If a stream
+ *                  was started before the reply went out, the reply is
+ *                  ADC_ONE_SHOT_FAILED with time 0 and streamRing[] is
+ *                  left to the stream.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void AdcOneShotTask(void)
+{
+	WORD sample;
+	DWORD stamp;
+
+	if(!adcOneShotPending)
+		return;
+	if(!adcOneShotFailed && streamHead == streamTail)
+		return;
+	if(mInBufferBusy())
+		return;
+
+	if(adcOneShotFailed)
+	{
+		sample = ADC_ONE_SHOT_FAILED;
+		stamp = 0;
+	}
+	else
+	{
+		sample = streamRing[streamTail];
+		streamTail = (streamTail + 1) & STREAM_RING_MASK;
+		stamp = adcOneShotStamp;
+	}
+	if(adcOneShotTagged)
+		TagReply(adcOneShotTag);
+	INPacket[0] = (BYTE)sample;
+	INPacket[1] = (BYTE)(sample >> 8);
+	INPacket[2] = (BYTE)stamp;
+	INPacket[3] = (BYTE)(stamp >> 8);
+	INPacket[4] = (BYTE)(stamp >> 16);
+	INPacket[5] = (BYTE)(stamp >> 24);
+	adcOneShotPending = FALSE;
+	adcOneShotFailed = FALSE;
+	InBufferSend();
+}//end AdcOneShotTask
+
+
+/******************************************************************************
+ * Function:        static BOOL AppBatchRun(void)
+ *
+ * PreCondition:    OUTPacket holds 5 character commands.
+ *
+ * Input:           None
+ *
+ * Output:          TRUE if the commands were run, FALSE if no IN buffer
+ *                  was free for the reply and the packet must be retried.
+ *
+ * Side Effects:    Arms the IN endpoint with the reply.
+ *
+ * Overview:        Runs every command in OUTPacket in order and sends all
+ *                  of their results in one INPacket, see app_batch() in
+ *                  application.c. A board set up this way takes one OUT
+ *                  and one IN transfer instead of one pair per command.
+ *
+ * Note:            None
+ *****************************************************************************/
+static BOOL AppBatchRun(void)
+{
+	if(mInBufferBusy())
+		return FALSE;
+
+	app_batch(OUTPacket, INPacket);
+	InBufferSend();
+	return TRUE;
+}//end AppBatchRun
+
+
+/******************************************************************************
+ * Function:        void ScanSetList(BYTE count, BYTE *channels)
+ *
+ * PreCondition:    No stream is running.
+ *
+ * Input:           count - Number of entries in channels
+ *                  channels - A/D channel numbers
+ *
+ * Output:          None
+ *
+ * Side Effects:    Makes the scanned pins analog inputs.
+ *
+ * Overview:        Sets the channels converted on every stream trigger.
+ *                  Duplicates and channels that are not in
+ *                  SCAN_VALID_MASK are ignored. An empty list is ignored.
+ *
+ * Note:            The channels are always scanned in ascending order.
+ *****************************************************************************/
+void ScanSetList(BYTE count, BYTE *channels)
+{
+	WORD mask = 0;
+
+	while(count--)
+	{
+		if(*channels < 16)
+		{
+			mask |= (WORD)1 << *channels;
+		}
+		channels++;
+	}
+	mask &= SCAN_VALID_MASK;
+	if(mask != 0)
+	{
+		ScanSetMask(mask);
+	}
+}//end ScanSetList
+
+
+/******************************************************************************
+ * Function:        static void ScanSetMask(WORD mask)
+ *
+ * PreCondition:    mask is a non empty subset of SCAN_VALID_MASK.
+ *
+ * Input:           mask - Bit n set to scan ANn
+ *
+ * Output:          None
+ *
+ * Side Effects:    Changes ADCON1 and the TRIS bits of the scanned pins.
+ *
+ * Overview:        Fills scanChannels[] in ascending order and makes every
+ *                  pin up to the highest channel analog. AN0 and AN1 stay
+ *                  analog for the one shot 'A' command.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void ScanSetMask(WORD mask)
+{
+	BYTE channel;
+	BYTE highest = 1;
+
+	scanMask = mask;
+	scanCount = 0;
+	for(channel = 0; channel < 16; channel++)
+	{
+		if(mask & ((WORD)1 << channel))
+		{
+			scanChannels[scanCount++] = channel;
+			if(channel > highest)
+				highest = channel;
+		}
+	}
+
+	// PCFG3:PCFG0 = 14 - n makes AN0 up to ANn analog.
+	ADCON1 = (ADCON1 & 0xF0) | (14 - highest);
+
+	// Pins behind AN0-AN4 are RA0-RA3 and RA5, behind AN8-AN11 they are
+	// RB2, RB3, RB1 and RB4.
+	TRISA |= (BYTE)(mask & 0x0F);
+	if(mask & 0x0010)	TRISAbits.TRISA5 = 1;
+	if(mask & 0x0100)	TRISBbits.TRISB2 = 1;
+	if(mask & 0x0200)	TRISBbits.TRISB3 = 1;
+	if(mask & 0x0400)	TRISBbits.TRISB1 = 1;
+	if(mask & 0x0800)	TRISBbits.TRISB4 = 1;
+}//end ScanSetMask
+
+
+/******************************************************************************
+ * Function:        static void InBufferReset(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Any armed IN buffers are forgotten.
+ *
+ * Overview:        Starts filling from the even buffer again. Must be
+ *                  called whenever the stack resets its ping pong state,
+ *                  that is at start up and when the device is configured.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void InBufferReset(void)
+{
+	BYTE i;
+
+	for(i = 0; i < IN_BUFFER_COUNT; i++)
+	{
+		USBGenericInHandle[i] = 0;
+	}
+	inBufferNext = 0;
+	INPacket = INBuffers[0];
+	replyTagged = FALSE;
+	outTagged = FALSE;
+}//end InBufferReset
+
+
+/******************************************************************************
+ * Function:        static void InBufferSend(void)
+ *
+ * PreCondition:    mInBufferBusy() is FALSE and INPacket holds the packet.
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    INPacket moves on to the next buffer.
+ *
+ * Overview:        Arms the IN endpoint with the buffer INPacket is in,
+ *                  from its start so that a tag header goes too, and
+ *                  moves on to the other one. USBGenWrite() alternates
+ *                  between the even and odd buffer descriptors in the same
+ *                  order, so buffer n always goes out on descriptor n.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void InBufferSend(void)
+{
+	USBGenericInHandle[inBufferNext] = USBGenWrite(USBGEN_EP_NUM,INBuffers[inBufferNext],USBGEN_EP_SIZE);
+	if(++inBufferNext == IN_BUFFER_COUNT)
+		inBufferNext = 0;
+	INPacket = INBuffers[inBufferNext];
+	replyTagged = FALSE;
+}//end InBufferSend
+
+
+/******************************************************************************
+ * Function:        static void StreamBufferReset(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Any armed stream buffers are forgotten.
+ *
+ * Overview:        InBufferReset() for the stream endpoint, called at the
+ *                  same times.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void StreamBufferReset(void)
+{
+	BYTE i;
+
+	for(i = 0; i < STREAM_BUFFER_COUNT; i++)
+	{
+		USBStreamInHandle[i] = 0;
+	}
+	streamBufferNext = 0;
+}//end StreamBufferReset
+
+
+/******************************************************************************
+ * Function:        static void StreamBufferSend(void)
+ *
+ * PreCondition:    mStreamBufferBusy() is FALSE and
+ *                  StreamBuffers[streamBufferNext] holds the packet.
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    streamBufferNext moves on to the other buffer.
+ *
+ * Overview:        Arms USBSTREAM_EP_NUM with the stream buffer, in the
+ *                  same even/odd order as InBufferSend() does for
+ *                  USBGEN_EP_NUM.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void StreamBufferSend(void)
+{
+	USBStreamInHandle[streamBufferNext] = USBGenWrite(USBSTREAM_EP_NUM,StreamBuffers[streamBufferNext],USBGEN_EP_SIZE);
+	if(++streamBufferNext == STREAM_BUFFER_COUNT)
+		streamBufferNext = 0;
+}//end StreamBufferSend
+
+
+/******************************************************************************
+ * Function:        static void EventBufferReset(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    Any armed event buffers are forgotten.
+ *
+ * Overview:        InBufferReset() for the event endpoint, called at the
+ *                  same times. EventTask() arms the buffers in turn.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void EventBufferReset(void)
+{
+	BYTE i;
+
+	for(i = 0; i < EVENT_BUFFER_COUNT; i++)
+	{
+		USBEventInHandle[i] = 0;
+	}
+	eventBufferNext = 0;
+}//end EventBufferReset
+
+
+/******************************************************************************
+ * Function:        static void TagReply(BYTE tag)
+ *
+ * PreCondition:    mInBufferBusy() is FALSE.
+ *
+ * Input:           tag - Tag of the command the reply is for
+ *
+ * Output:          None
+ *
+ * Side Effects:    INPacket moves TAG_HEADER_SIZE bytes into its buffer.
+ *
+ * Overview:        Writes the tag header to the start of the free IN
+ *                  buffer and points INPacket past it, so the next
+ *                  InBufferSend() sends a tagged reply. A reply can then
+ *                  be USBGEN_EP_SIZE - TAG_HEADER_SIZE bytes at most.
+ *
+ * Note:            None
+ *****************************************************************************/
+static void TagReply(BYTE tag)
+{
+	INBuffers[inBufferNext][0] = CMD_TAGGED;
+	INBuffers[inBufferNext][1] = tag;
+	INPacket = INBuffers[inBufferNext] + TAG_HEADER_SIZE;
+	replyTagged = TRUE;
+}//end TagReply
+
+
+/******************************************************************************
+ * Function:        static BOOL TagDefer(BYTE *tag)
+ *
+ * PreCondition:    Called from a command handler.
+ *
+ * Input:           tag - Where to keep the tag
+ *
+ * Output:          TRUE if the command is tagged and *tag was set.
+ *
+ * Side Effects:    ProcessIO() sends no ack for the command.
+ *
+ * Overview:        For handlers whose reply is sent later by a task: takes
+ *                  the tag over so that the task can pass it to
+ *                  TagReply() when it sends the reply.
+ *
+ * Note:            None
+ *****************************************************************************/
+static BOOL TagDefer(BYTE *tag)
+{
+	if(!replyTagged)
+		return FALSE;
+	*tag = outTag;
+	replyTagged = FALSE;
+	INPacket = INBuffers[inBufferNext];
+	return TRUE;
+}//end TagDefer
+
+
+/********************************************************************
+ * Function:        void BlinkUSBStatus(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
+ *
+ * Side Effects:    None
+ *
+ * Overview:        BlinkUSBStatus turns on and off LEDs 
+ *                  corresponding to the USB device state.
+ *
+ * Note:            mLED macros can be found in HardwareProfile.h
+ *                  USBDeviceState is declared and updated in
+ *                  usb_device.c.
+ *******************************************************************/
+void BlinkUSBStatus(void)
+{
+    static WORD led_count=0;
+    
+    if(led_count == 0)led_count = 10000U;
+    led_count--;
+
+    #define mLED_Both_Off()         {mLED_1_Off();mLED_2_Off();}
+    #define mLED_Both_On()          {mLED_1_On();mLED_2_On();}
+    #define mLED_Only_1_On()        {mLED_1_On();mLED_2_Off();}
+    #define mLED_Only_2_On()        {mLED_1_Off();mLED_2_On();}
+
+    if(USBSuspendControl == 1)
+    {
+        if(led_count==0)
+        {
+            mLED_1_Toggle();
+            if(mGetLED_1())
+            {
+                mLED_2_On();
+            }
+            else
+            {
+                mLED_2_Off();
+            }
+        }//end if
+    }
+    else
+    {
+        if(USBDeviceState == DETACHED_STATE)
+        {
+            mLED_Both_Off();
+        }
+        else if(USBDeviceState == ATTACHED_STATE)
+        {
+            mLED_Both_On();
+        }
+        else if(USBDeviceState == POWERED_STATE)
+        {
+            mLED_Only_1_On();
+        }
+        else if(USBDeviceState == DEFAULT_STATE)
+        {
+            mLED_Only_2_On();
+        }
+        else if(USBDeviceState == ADDRESS_STATE)
+        {
+            if(led_count == 0)
+            {
+                mLED_1_Toggle();
+                mLED_2_Off();
+            }//end if
+        }
+        else if(USBDeviceState == CONFIGURED_STATE)
+        {
+            if(led_count==0)
+            {
+                mLED_1_Toggle();
+                if(mGetLED_1())
+                {
+                    mLED_2_Off();
+                }
+                else
+                {
+                    mLED_2_On();
+                }
+            }//end if
+        }//end if(...)
+    }//end if(UCONbits.SUSPND...)
+
+}//end BlinkUSBStatus
+
+
+
+
+// ******************************************************************************************************
+// ************** USB Callback Functions ****************************************************************
+// ******************************************************************************************************
+
+/******************************************************************************
+ * Function:        void USBCBSuspend(void)
+ *
+ * PreCondition:    None
+ *
+ * Input:           None
+ *
+ * Output:          None
  *
  * Side Effects:    None
  *
@@ -587,10 +2910,20 @@ void USBCBWakeFromSuspend(void)
  *                  for isochronous pipes. End designers should
  *                  implement callback routine as necessary.
  *
- * Note:            None
+ *                  Latches the frame number and the device time, read
+ *                  back with CMD_TIME. The host sees the same frame
+ *                  numbers, so pairs of them map the device time onto
+ *                  the host clock.
+ *
+ * Note:            Runs from the high priority ISR.
  *******************************************************************/
 void USBCB_SOF_Handler(void)
 {
+	BYTE lo;
+
+	mTimeRead(sofTime);
+	lo = UFRML;
+	sofFrame = ((WORD)UFRMH << 8) | lo;
 }
 
 /*******************************************************************
@@ -641,11 +2974,108 @@ void USBCBErrorHandler(void)
  *					this request should be handled by class specific 
  *					firmware, such as that contained in usb_function_hid.c.
  *
- * Note:            None
+ *                  Handles the VENDOR_xxx requests to the device. The
+ *                  GET requests are answered from vendorReply[] at once.
+ *                  The others are claimed with their status stage
+ *                  deferred and left for VendorTask(), after the data
+ *                  stage for VENDOR_EVENT_CONFIG:
+ *                  VENDOR_GET_STATUS reply:
+ *                  [0]      VENDOR_STATUS_xxx flags
+ *                  [1]      STREAM_FORMAT_xxx
+ *                  [2..3]   Scan mask
+ *                  [4..5]   Stream period in Timer1 ticks
+ *                  [6..7]   Stream overruns
+ *                  [8]      LA_xxx state of the logic analyzer
+ *                  [9]      Event pin mask
+ *                  [10]     Event threshold channel
+ *                  [11]     Alternate setting of interface 0
+ *                  [12..15] Device time
+ *                  all LSB first.
+ *
+ * Note:            Runs from the high priority ISR.
  *****************************************************************************/
 void USBCBCheckOtherReq(void)
 {
-}//end
+	DWORD now;
+
+	if(SetupPkt.RequestType != USB_SETUP_TYPE_VENDOR_BITFIELD)
+		return;
+	if(SetupPkt.Recipient != USB_SETUP_RECIPIENT_DEVICE_BITFIELD)
+		return;
+
+	//Requests that are not claimed here are stalled by the stack.
+	switch(SetupPkt.bRequest)
+	{
+		case VENDOR_GET_STATUS:
+			if(SetupPkt.DataDir != USB_SETUP_DEVICE_TO_HOST_BITFIELD)
+				return;
+			mTimeRead(now);
+			vendorReply[0] = 0;
+			if(streamEnabled)
+				vendorReply[0] |= VENDOR_STATUS_STREAMING;
+			if(streamIso)
+				vendorReply[0] |= VENDOR_STATUS_ISO;
+			if(adcOneShotPending)
+				vendorReply[0] |= VENDOR_STATUS_ONE_SHOT;
+			vendorReply[1] = streamFormat;
+			vendorReply[2] = (BYTE)scanMask;
+			vendorReply[3] = (BYTE)(scanMask >> 8);
+			vendorReply[4] = CCPR2L;				// Stream period
+			vendorReply[5] = CCPR2H;
+			vendorReply[6] = (BYTE)streamOverruns;
+			vendorReply[7] = (BYTE)(streamOverruns >> 8);
+			vendorReply[8] = laState;
+			vendorReply[9] = eventPinMask;
+			vendorReply[10] = eventThresholdChannel;
+			vendorReply[11] = USBAlternateInterface[0];
+			vendorReply[12] = (BYTE)now;
+			vendorReply[13] = (BYTE)(now >> 8);
+			vendorReply[14] = (BYTE)(now >> 16);
+			vendorReply[15] = (BYTE)(now >> 24);
+			USBEP0SendRAMPtr(vendorReply, VENDOR_STATUS_SIZE, USB_EP0_INCLUDE_ZERO);
+			break;
+
+		case VENDOR_GET_TIME:
+			if(SetupPkt.DataDir != USB_SETUP_DEVICE_TO_HOST_BITFIELD)
+				return;
+			mTimeRead(now);
+			vendorReply[0] = (BYTE)sofFrame;
+			vendorReply[1] = (BYTE)(sofFrame >> 8);
+			vendorReply[2] = (BYTE)sofTime;
+			vendorReply[3] = (BYTE)(sofTime >> 8);
+			vendorReply[4] = (BYTE)(sofTime >> 16);
+			vendorReply[5] = (BYTE)(sofTime >> 24);
+			vendorReply[6] = (BYTE)now;
+			vendorReply[7] = (BYTE)(now >> 8);
+			vendorReply[8] = (BYTE)(now >> 16);
+			vendorReply[9] = (BYTE)(now >> 24);
+			USBEP0SendRAMPtr(vendorReply, VENDOR_TIME_SIZE, USB_EP0_INCLUDE_ZERO);
+			break;
+
+		case VENDOR_STREAM_START:
+		case VENDOR_STREAM_STOP:
+		case VENDOR_SCAN_MASK:
+		case VENDOR_PORT_WRITE:
+			if(SetupPkt.wLength != 0)
+				return;
+			vendorRequest = SetupPkt.bRequest;
+			vendorValue = SetupPkt.wValue;
+			vendorIndex = SetupPkt.wIndex;
+			vendorPending = TRUE;
+			USBDeferStatusStage();
+			USBEP0Transmit(USB_EP0_NO_DATA);
+			break;
+
+		case VENDOR_EVENT_CONFIG:
+			if(SetupPkt.DataDir != USB_SETUP_HOST_TO_DEVICE_BITFIELD ||
+				SetupPkt.wLength != VENDOR_DATA_SIZE)
+				return;
+			vendorRequest = SetupPkt.bRequest;
+			USBDeferStatusStage();
+			USBEP0Receive((BYTE*)vendorData, VENDOR_DATA_SIZE, VendorDataReceived);
+			break;
+	}
+}//end USBCBCheckOtherReq
 
 
 /*******************************************************************
@@ -699,6 +3129,18 @@ void USBCBInitEP(void)
     USBEnableEndpoint(USBGEN_EP_NUM,USB_OUT_ENABLED|USB_IN_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
     //Arm the application OUT endpoint, so it can receive a packet from the host
     USBGenericOutHandle = USBGenRead(USBGEN_EP_NUM,(BYTE*)&OUTPacket,USBGEN_EP_SIZE);
+    //The stack starts the IN endpoint on its even buffer descriptor again.
+    InBufferReset();
+    //The stream endpoint is IN only, and bulk in alternate setting 0,
+    //which SET_CONFIGURATION selects.
+    USBEnableEndpoint(USBSTREAM_EP_NUM,USB_IN_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
+    StreamBufferReset();
+    streamIso = FALSE;
+    //The event endpoint is not in alternate setting 0. StreamAltTask()
+    //enables it when the host selects a setting that has it.
+    USBEnableEndpoint(USBEVENT_EP_NUM,0);
+    EventBufferReset();
+    eventEndpoint = FALSE;
 }
 
 /********************************************************************
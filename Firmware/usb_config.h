@@ -50,15 +50,19 @@
 #define USBCFG_H
 
 /** DEFINITIONS ****************************************************/
-#define USB_EP0_BUFF_SIZE		8	// Valid Options: 8, 16, 32, or 64 bytes.
+#define USB_EP0_BUFF_SIZE		32	// Valid Options: 8, 16, 32, or 64 bytes.
 								// Using larger options take more SRAM, but
 								// does not provide much advantage in most types
 								// of applications.  Exceptions to this, are applications
 								// that use EP0 IN or OUT for sending large amounts of
 								// application related data.
+								// The vendor requests of main.c send their data
+								// stages in one packet with 32. 64 does not fit:
+								// CtrlTrfData[] shares usb4 with the BDT below
+								// 0x440 and the buffers of main.c from 0x480.
 									
 #define USB_MAX_NUM_INT     	1   // For tracking Alternate Setting
-#define USB_MAX_EP_NUMBER	    1
+#define USB_MAX_EP_NUMBER	    3
 
 //Device descriptor - if these two definitions are not defined then
 //  a ROM USB_DEVICE_DESCRIPTOR variable by the exact name of device_dsc
@@ -140,7 +144,12 @@
 
 #define USB_SUPPORT_DEVICE
 
-#define USB_NUM_STRING_DESCRIPTORS 3
+#define USB_NUM_STRING_DESCRIPTORS 4
+
+// Serial number string descriptor, see usb_descriptors.c. The address
+// must match the serial CODEPAGE of the linker script.
+#define SERIAL_NUMBER_ADDRESS   0x7FC0
+#define SERIAL_NUMBER_LENGTH    8
 
 //#define USB_INTERRUPT_LEGACY_CALLBACKS
 #define USB_ENABLE_ALL_HANDLERS
@@ -162,6 +171,9 @@
 /* Generic */
 #define USBGEN_EP_SIZE          64
 #define USBGEN_EP_NUM            1
+#define USBSTREAM_EP_NUM         2		// Bulk IN, stream packets only
+#define USBEVENT_EP_NUM          3		// Interrupt IN, event records
+#define USBEVENT_EP_SIZE         32
 
 /** DEFINITIONS ****************************************************/
 
@@ -176,7 +176,7 @@ ROM USB_DEVICE_DESCRIPTOR device_dsc=
     0x0000,                 // Device release number in BCD format
     0x01,                   // Manufacturer string index
     0x02,                   // Product string index
-    0x00,                   // Device serial number string index
+    0x03,                   // Device serial number string index
     0x01                    // Number of possible configurations
 };
 
@@ -185,7 +185,7 @@ ROM BYTE configDescriptor1[]={
     /* Configuration Descriptor */
     0x09,//sizeof(USB_CFG_DSC),    // Size of this descriptor in bytes
     USB_DESCRIPTOR_CONFIGURATION,                // CONFIGURATION descriptor type
-    0x20,0x00,            // Total length of data for this cfg
+    0x71,0x00,            // Total length of data for this cfg
     1,                      // Number of interfaces in this cfg
     1,                      // Index value of this configuration
     0,                      // Configuration string index
@@ -197,7 +197,7 @@ ROM BYTE configDescriptor1[]={
     USB_DESCRIPTOR_INTERFACE,               // INTERFACE descriptor type
     0,                      // Interface Number
     0,                      // Alternate Setting Number
-    2,                      // Number of endpoints in this intf
+    3,                      // Number of endpoints in this intf
     0xFF,                   // Class code
     0xFF,                   // Subclass code
     0xFF,                   // Protocol code
@@ -216,7 +216,104 @@ ROM BYTE configDescriptor1[]={
     _EP01_IN,                   //EndpointAddress
     _BULK,                       //Attributes
     USBGEN_EP_SIZE,0x00,        //size
-    1                          //Interval
+    1,                         //Interval
+
+    // Stream packets only, so replies on EP1 IN never queue behind them.
+    // Alternate setting 0 has no periodic endpoint, so selecting it
+    // reserves no bandwidth.
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP02_IN,                   //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval
+
+    /* Interface Descriptor */
+    // Alternate setting 1: the stream endpoint is isochronous, with one
+    // packet reserved every frame, and the event endpoint is added
+    0x09,//sizeof(USB_INTF_DSC),   // Size of this descriptor in bytes
+    USB_DESCRIPTOR_INTERFACE,               // INTERFACE descriptor type
+    0,                      // Interface Number
+    1,                      // Alternate Setting Number
+    4,                      // Number of endpoints in this intf
+    0xFF,                   // Class code
+    0xFF,                   // Subclass code
+    0xFF,                   // Protocol code
+    0,                      // Interface string index
+
+    /* Endpoint Descriptor */
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP01_OUT,                  //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval
+
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP01_IN,                   //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval
+
+    // The sample clock is the board's crystal, hence asynchronous
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP02_IN,                   //EndpointAddress
+    _ISO|_AS|_DE,               //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval, every frame
+
+    // Event records, polled every frame
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP03_IN,                   //EndpointAddress
+    _INTERRUPT,                 //Attributes
+    USBEVENT_EP_SIZE,0x00,      //size
+    1,                         //Interval, 1 ms
+
+    /* Interface Descriptor */
+    // Alternate setting 2: alternate setting 0 with the event endpoint,
+    // for events with a bulk stream
+    0x09,//sizeof(USB_INTF_DSC),   // Size of this descriptor in bytes
+    USB_DESCRIPTOR_INTERFACE,               // INTERFACE descriptor type
+    0,                      // Interface Number
+    2,                      // Alternate Setting Number
+    4,                      // Number of endpoints in this intf
+    0xFF,                   // Class code
+    0xFF,                   // Subclass code
+    0xFF,                   // Protocol code
+    0,                      // Interface string index
+
+    /* Endpoint Descriptor */
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP01_OUT,                  //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval
+
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP01_IN,                   //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval
+
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP02_IN,                   //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE,0x00,        //size
+    1,                         //Interval
+
+    // Event records, polled every frame
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP03_IN,                   //EndpointAddress
+    _INTERRUPT,                 //Attributes
+    USBEVENT_EP_SIZE,0x00,      //size
+    1                          //Interval, 1 ms
 };
 
 
@@ -237,6 +334,21 @@ sizeof(sd002),USB_DESCRIPTOR_STRING,
 {'M','i','c','r','o','c','h','i','p',' ','L','i','b','u','s','b',
 ' ','E','x','a','m','p','l','e',' ','D','e','v','i','c','e'}};
 
+//Serial number string descriptor. It is linked at a fixed address,
+//SERIAL_NUMBER_ADDRESS, so that every board can be given its own
+//number by patching the hex file before it is programmed, see
+//host/serial_number.py. The length is fixed, the host pads the number
+//to SERIAL_NUMBER_LENGTH characters.
+#if defined(__18CXX)
+#pragma romdata SERIAL_NUMBER
+#endif
+ROM struct{BYTE bLength;BYTE bDscType;WORD string[SERIAL_NUMBER_LENGTH];}sd003={
+sizeof(sd003),USB_DESCRIPTOR_STRING,
+{'0','0','0','0','0','0','0','0'}};
+#if defined(__18CXX)
+#pragma romdata
+#endif
+
 //Array of configuration descriptors
 ROM BYTE *ROM USB_CD_Ptr[]=
 {
@@ -247,7 +359,8 @@ ROM BYTE *ROM USB_SD_Ptr[]=
 {
     (ROM BYTE *ROM)&sd000,
     (ROM BYTE *ROM)&sd001,
-    (ROM BYTE *ROM)&sd002
+    (ROM BYTE *ROM)&sd002,
+    (ROM BYTE *ROM)&sd003
 };
 
 /** EOF usb_descriptors.c ***************************************************/
@@ -2,7 +2,10 @@
 
 from scipy import *
 from matplotlib.pyplot import *
+import errno
 import usb.core
+from adc_packet import STREAM_EP, decode_frames
+from adc_stream import set_scan_list, start_stream, stop_stream
 
 dev = usb.core.find(idVendor=0x04d8)
 dev.set_configuration()
@@ -10,21 +13,30 @@ dev.set_configuration()
 # wait till the user gives a signal for starting measurement.
 while(raw_input("Start") not in 'yy'):
       pass
-# start measurement.
+# start measurement. Both channels are converted back to back on every
+# trigger, so the pairs are taken within a conversion time of each other.
 axis1 = []
 axis2 = []
+timeouts = 0
+set_scan_list(dev, [0, 1])
+start_stream(dev)
 
 while(1):
     try:
-        dev.write(1, 'A0')
-        digit1, digit2 = dev.read(0x81, 64)[:2]
-        axis1.append( digit1 + 256*digit2 )
-        dev.write(1, 'A1')
-        digit1, digit2 = dev.read(0x81, 64)[:2]
-        axis2.append( digit1 + 256*digit2 )
+        frames = decode_frames(dev.read(STREAM_EP, 64, timeout=1000))
+        axis1.extend( frames.get(0, []) )
+        axis2.extend( frames.get(1, []) )
+    except usb.core.USBError as e:
+        # A packet that did not come in time is counted, not fatal.
+        if e.errno != errno.ETIMEDOUT:
+            raise
+        timeouts += 1
     except KeyboardInterrupt:
         print "Done sampling."
         break
+if timeouts:
+    print "%d stream reads timed out." % timeouts
+stop_stream(dev)
 clf()
 lenmin = min(len(axis1), len(axis2))
 axis1 = axis1[:lenmin]
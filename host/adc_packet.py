@@ -0,0 +1,112 @@
+#!/bin/python
+
+"""
+Decoders for the ADC payloads sent by the PIC18F2550 libUSB device.
+
+Legacy 'A' replies carry one sample, LSB first, in the first two bytes
+and the device time the conversion completed in the next four. While a
+stream has the A/D the sample is ONE_SHOT_FAILED and the time 0.
+Stream packets (command 0x82) start with an eight byte header:
+    [0]     0x82 (stream command echo)
+    [1]     format in bits 7..6, sample count in bits 5..0
+    [2..3]  mask of the scanned channels, LSB first
+    [4..7]  device time of the trigger of the first frame, LSB first
+followed by the samples in one of these formats:
+    FORMAT_RAW16    2 bytes per sample, LSB first. 28 samples per packet.
+    FORMAT_PACKED10 groups of 4 samples as their 4 low bytes and one byte
+                    holding the top 2 bits of each, first sample in bits
+                    1..0. A last partial group of n samples takes n + 1
+                    bytes. 44 samples per packet.
+The samples are whole frames of one sample per channel in the mask, lowest
+channel first, one stream period apart. Stream packets come on their own
+bulk IN endpoint, STREAM_EP; 'A' and all other replies on 0x81.
+
+The device time counts instruction cycles (12 MHz) in 32 bits and wraps
+after about 6 minutes, DeviceClock unwraps it.
+"""
+
+STREAM_START = 0x82
+ONE_SHOT_FAILED = 0xFFFF
+STREAM_EP = 0x82
+
+FORMAT_RAW16 = 0
+FORMAT_PACKED10 = 1
+
+STREAM_HEADER_SIZE = 8
+
+TICKS_PER_SECOND = 12e6
+
+class DeviceClock(object):
+    """ Turns the wrapping 32 bit device times into seconds since the
+    first one seen. Times must be fed in order, at least once every
+    few minutes."""
+    def __init__(self):
+        self.first = None
+        self.last = 0
+        self.wraps = 0
+
+    def seconds(self, ticks):
+        if self.first is None:
+            self.first = ticks
+        elif ticks < self.last:
+            self.wraps += 1
+        self.last = ticks
+        return (ticks + (self.wraps << 32) - self.first)/TICKS_PER_SECOND
+
+def _dword(packet, i):
+    return packet[i] | (packet[i+1] << 8) | (packet[i+2] << 16) | \
+        (packet[i+3] << 24)
+
+def decode_single(packet):
+    """ Return the sample in a legacy 'A' reply"""
+    return packet[0] + 256*packet[1]
+
+def single_time(packet):
+    """ Return the device time of the sample in a legacy 'A' reply"""
+    return _dword(packet, 2)
+
+def unpack_raw16(payload, count):
+    """ Return count 16 bit samples from payload"""
+    return [payload[2*i] + 256*payload[2*i+1] for i in range(count)]
+
+def unpack_packed10(payload, count):
+    """ Return count 10 bit samples packed 4 to 5 bytes in payload"""
+    samples = []
+    pos = 0
+    while len(samples) < count:
+        group = min(4, count - len(samples))
+        high = payload[pos + group]
+        for j in range(group):
+            samples.append(payload[pos + j] | (((high >> (2*j)) & 0x03) << 8))
+        pos += group + 1
+    return samples
+
+def decode_stream(packet):
+    """ Return the list of samples in one stream packet, or [] if the
+    packet is not a stream packet."""
+    if len(packet) < STREAM_HEADER_SIZE or packet[0] != STREAM_START:
+        return []
+    fmt = packet[1] >> 6
+    count = packet[1] & 0x3F
+    payload = packet[STREAM_HEADER_SIZE:]
+    if fmt == FORMAT_PACKED10:
+        return unpack_packed10(payload, count)
+    return unpack_raw16(payload, count)
+
+def stream_channels(packet):
+    """ Return the channels in the frames of a stream packet, in order"""
+    mask = packet[2] + 256*packet[3]
+    return [ch for ch in range(16) if mask & (1 << ch)]
+
+def stream_time(packet):
+    """ Return the device time of the first frame of a stream packet"""
+    return _dword(packet, 4)
+
+def decode_frames(packet):
+    """ Return a dict of channel -> samples for one stream packet"""
+    samples = decode_stream(packet)
+    if not samples:
+        return {}
+    channels = stream_channels(packet)
+    return dict((ch, samples[i::len(channels)])
+                for i, ch in enumerate(channels))
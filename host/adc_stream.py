@@ -0,0 +1,117 @@
+#!/bin/python
+
+"""
+Stream samples from ADC channels of the PIC18F2550 libUSB device.
+
+The firmware samples on a Timer1/CCP2 trigger and sends full 64 byte
+packets on its own on endpoint 0x82, so the host only has to keep
+reading there. Replies to commands still come on 0x81. With more than
+one channel every trigger converts the whole scan list back to back. See
+adc_packet.py for the packet layout. Given a file name ending in .cap
+the packets are also written to that capture file, see capture.py.
+
+Usage: python adc_stream.py [channels, eg 0,1,8] [period in 12 MHz ticks]
+                            [raw16] [file.cap]
+"""
+
+import sys
+import time
+import usb.core
+from adc_packet import STREAM_START, STREAM_EP, FORMAT_RAW16, \
+    FORMAT_PACKED10, decode_frames, stream_time, TICKS_PER_SECOND
+from capture import CaptureWriter
+
+STREAM_STOP = 0x83
+SCAN_LIST = 0x84
+ADC_STATS = 0x85
+TIME = 0x8A
+CHANNEL_SCAN_LIST = 0xFF
+
+def set_scan_list(dev, channels):
+    """ Set the channels converted on every trigger"""
+    dev.write(1, [SCAN_LIST, len(channels)] + list(channels))
+
+def start_stream(dev, channel=CHANNEL_SCAN_LIST, period=0,
+                 fmt=FORMAT_PACKED10):
+    """ Start sampling every period Timer1 ticks. 0 is 10 kS/s. channel
+    is a single channel or CHANNEL_SCAN_LIST."""
+    dev.write(1, [STREAM_START, channel, period & 0xFF, period >> 8, fmt])
+
+def stop_stream(dev):
+    """ Stop sampling and drop whatever the device has not sent yet"""
+    dev.write(1, [STREAM_STOP])
+
+def read_adc_stats(dev):
+    """ Return a dict of the A/D interrupt statistics. The CPU cycles freed
+    per sample are the conversion cycles it no longer spins for, less the
+    cycles spent in the interrupt."""
+    dev.write(1, [ADC_STATS])
+    reply = dev.read(0x81, 64, timeout=1000)
+    word = lambda i: reply[i] + 256*reply[i+1]
+    stats = {
+        'conversion_cycles': word(1),
+        'isr_cycles': word(3),
+        'isr_max_cycles': word(5),
+        'overruns': word(7),
+        'conversions': word(9) + 65536*word(11),
+        }
+    stats['freed_cycles'] = stats['conversion_cycles'] - stats['isr_cycles']
+    return stats
+
+def read_time(dev):
+    """ Return the USB frame number and device time of the last SOF, and
+    the device time now. Two calls a while apart give the rate of the
+    device clock against the USB frame clock of the host."""
+    dev.write(1, [TIME])
+    reply = dev.read(0x81, 64, timeout=1000)
+    dword = lambda i: reply[i] | (reply[i+1] << 8) | (reply[i+2] << 16) | \
+        (reply[i+3] << 24)
+    return reply[1] + 256*reply[2], dword(3), dword(7)
+
+if __name__ == '__main__':
+    channels = [0]
+    if len(sys.argv) > 1:
+        channels = [int(ch) for ch in sys.argv[1].split(',')]
+    period = int(sys.argv[2]) if len(sys.argv) > 2 else 0
+    fmt = FORMAT_RAW16 if 'raw16' in sys.argv[3:] else FORMAT_PACKED10
+    capture = None
+    for arg in sys.argv[1:]:
+        if arg.endswith('.cap'):
+            capture = CaptureWriter(arg)
+
+    dev = usb.core.find(idVendor=0x04d8, idProduct=0x0204)
+    dev.set_configuration()
+
+    data = dict((ch, []) for ch in channels)
+    set_scan_list(dev, channels)
+    start_stream(dev, CHANNEL_SCAN_LIST, period, fmt)
+    start = time.time()
+    first_time = last_time = None
+    while(1):
+        try:
+            packet = dev.read(STREAM_EP, 64, timeout=1000)
+            if capture is not None:
+                capture.append(packet)
+            for ch, samples in decode_frames(packet).items():
+                data.setdefault(ch, []).extend(samples)
+            if packet[0] == STREAM_START:
+                last_time = stream_time(packet)
+                if first_time is None:
+                    first_time = last_time
+        except KeyboardInterrupt:
+            break
+    elapsed = time.time() - start
+    stop_stream(dev)
+    stats = read_adc_stats(dev)
+    if capture is not None:
+        capture.close()
+
+    for ch in sorted(data):
+        print "AN%d: %d samples in %.2f s (%.0f samples/s)" % (ch,
+            len(data[ch]), elapsed, len(data[ch])/elapsed)
+    if first_time is not None:
+        print "Device time from first to last packet: %.4f s" % \
+            (((last_time - first_time) & 0xFFFFFFFF)/TICKS_PER_SECOND)
+    print "%(conversions)d conversions, %(overruns)d frames dropped" % stats
+    print "%(isr_cycles)d cycles per A/D interrupt (max %(isr_max_cycles)d)," \
+        " %(freed_cycles)d of %(conversion_cycles)d freed per sample" % stats
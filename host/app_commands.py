@@ -0,0 +1,41 @@
+#!/bin/python
+
+"""
+Send the 5 character commands of Firmware/application.c in batches.
+
+One OUT packet carries up to 12 commands and the device answers all of
+them in one IN packet, so setting up a board takes one round trip per 12
+commands instead of one per command. The reply is
+    [0]     first byte of the first command
+    [1]     number of commands run
+    [2..]   two bytes per command, LSB first. 0 for a write, the value
+            read for a read, 0xFFFF for an unsupported command.
+
+Example:
+    run(dev, ['DWA0O', 'DWB2I', 'PWA0H', 'PRB2X'])
+"""
+
+CMD_SIZE = 5
+MAX_BATCH = 12
+ERROR = 0xFFFF
+
+def run_batch(dev, cmds):
+    """ Run at most MAX_BATCH commands in one round trip. Returns their
+    results, None for the ones the device rejected."""
+    assert len(cmds) <= MAX_BATCH
+    packet = ''.join(cmds)
+    assert len(packet) == CMD_SIZE*len(cmds)
+    dev.write(1, packet + '\0'*(64 - len(packet)))
+    reply = dev.read(0x81, 64, timeout=1000)
+    results = []
+    for i in range(reply[1]):
+        value = reply[2+2*i] + 256*reply[3+2*i]
+        results.append(None if value == ERROR else value)
+    return results
+
+def run(dev, cmds):
+    """ Run any number of commands, MAX_BATCH per round trip"""
+    results = []
+    for i in range(0, len(cmds), MAX_BATCH):
+        results.extend(run_batch(dev, cmds[i:i+MAX_BATCH]))
+    return results
@@ -0,0 +1,235 @@
+#!/bin/python
+
+"""
+Capture files of the IN packets of a stream, the same files as
+picusb/capture.h writes and reads; see there for the layout. In short,
+all little endian:
+
+    header, 64 bytes    'PICUSBCP', version, header size, slot size,
+                        packets per chunk, chunk count, start time (ns),
+                        index offset, serial number
+    chunks              a 64 byte chunk header ('CHNK', packets, number of
+                        the first packet, host time of the first and last
+                        packet, device time of the first and last stream
+                        packet, stream packets), then one 64 byte slot per
+                        packet
+    index               'INDX', chunk count, then per chunk its offset,
+                        first packet, first host time, first device time
+                        and packet count. Written on close().
+
+CaptureReader maps the file, so opening one of any size is quick and
+only the packets used are read from disk.
+
+Usage: python capture.py file.cap
+"""
+
+import mmap
+import struct
+import sys
+import time
+from adc_packet import STREAM_START, decode_frames
+
+MAGIC = 'PICUSBCP'
+CHUNK_MAGIC = 'CHNK'
+INDEX_MAGIC = 'INDX'
+VERSION = 1
+HEADER_SIZE = 64
+SLOT_SIZE = 64
+CHUNK_PACKETS = 1024
+
+HEADER = struct.Struct('<8sHHHHIIQQ8s16x')
+CHUNK = struct.Struct('<4sIQQQIII20x')
+INDEX = struct.Struct('<4sI8x')
+INDEX_ENTRY = struct.Struct('<QQQII')
+
+class Chunk(object):
+    """ The header fields of one chunk"""
+    def __init__(self, offset, fields):
+        self.offset = offset
+        (self.packets, self.first_packet, self.first_ns, self.last_ns,
+         self.first_stamp, self.last_stamp, self.stream_packets) = fields
+
+class CaptureWriter(object):
+    """ Appends packets to a new capture file. Call close() at the end to
+    write the index; without it readers still find every chunk that was
+    finished or flush()ed."""
+    def __init__(self, path, serial='', chunk_packets=CHUNK_PACKETS):
+        self.file = open(path, 'w+b')
+        self.serial = serial[:8]
+        self.chunk_packets = max(chunk_packets, 1)
+        self.start_ns = int(time.time()*1e9)
+        self.packets = 0
+        self.index = []
+        self.chunk = None
+        self._write_at(0, self._header(0, 0))
+
+    def _header(self, chunk_count, index_offset):
+        return HEADER.pack(MAGIC, VERSION, HEADER_SIZE, SLOT_SIZE, 0,
+                           self.chunk_packets, chunk_count, self.start_ns,
+                           index_offset, self.serial)
+
+    def _write_at(self, offset, data):
+        self.file.seek(offset)
+        self.file.write(data)
+        self.file.seek(0, 2)
+
+    def _write_chunk_header(self):
+        c = self.chunk
+        self._write_at(c.offset, CHUNK.pack(CHUNK_MAGIC, c.packets,
+            c.first_packet, c.first_ns, c.last_ns, c.first_stamp,
+            c.last_stamp, c.stream_packets))
+        entry = (c.offset, c.first_packet, c.first_ns, c.first_stamp,
+                 c.packets)
+        if self.index and self.index[-1][0] == c.offset:
+            self.index[-1] = entry
+        else:
+            self.index.append(entry)
+
+    def append(self, packet, ns=None):
+        """ Append one packet of up to 64 bytes, received at host time ns
+        (now if not given)"""
+        if ns is None:
+            ns = int(time.time()*1e9)
+        packet = bytearray(packet[:SLOT_SIZE])
+        if self.chunk is None:
+            offset = HEADER_SIZE + len(self.index)*(SLOT_SIZE +
+                                                     self.chunk_packets*SLOT_SIZE)
+            self.chunk = Chunk(offset, (0, self.packets, ns, ns, 0, 0, 0))
+            self.file.write(CHUNK.pack(CHUNK_MAGIC, 0, 0, 0, 0, 0, 0, 0))
+        self.file.write(str(packet) + '\0'*(SLOT_SIZE - len(packet)))
+
+        c = self.chunk
+        c.packets += 1
+        c.last_ns = ns
+        if len(packet) >= 8 and packet[0] == STREAM_START:
+            stamp = struct.unpack_from('<I', str(packet), 4)[0]
+            if c.stream_packets == 0:
+                c.first_stamp = stamp
+            c.last_stamp = stamp
+            c.stream_packets += 1
+        self.packets += 1
+
+        if c.packets == self.chunk_packets:
+            self._write_chunk_header()
+            self.chunk = None
+
+    def flush(self):
+        """ Write the header of the open chunk and flush the file"""
+        if self.chunk is not None:
+            self._write_chunk_header()
+        self.file.flush()
+
+    def close(self):
+        """ Finish the last chunk and write the index"""
+        if self.file is None:
+            return
+        if self.chunk is not None:
+            self._write_chunk_header()
+            self.chunk = None
+        self.file.seek(0, 2)
+        index_offset = self.file.tell()
+        self.file.write(INDEX.pack(INDEX_MAGIC, len(self.index)))
+        for entry in self.index:
+            self.file.write(INDEX_ENTRY.pack(*entry))
+        self._write_at(0, self._header(len(self.index), index_offset))
+        self.file.close()
+        self.file = None
+
+class CaptureReader(object):
+    """ A capture file mapped read only"""
+    def __init__(self, path):
+        self.file = open(path, 'rb')
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        size = len(self.map)
+        if size < HEADER_SIZE:
+            raise ValueError('%s is not a capture file' % path)
+        (magic, version, header_size, slot_size, reserved, self.chunk_packets,
+         chunk_count, self.start_ns, self.index_offset,
+         serial) = HEADER.unpack_from(self.map, 0)
+        if magic != MAGIC or version != VERSION or slot_size != SLOT_SIZE or \
+           self.chunk_packets == 0:
+            raise ValueError('%s is not a capture file' % path)
+        self.serial = serial.rstrip('\0')
+        chunk_size = SLOT_SIZE + self.chunk_packets*SLOT_SIZE
+
+        self.chunks = []
+        if self.index_offset:
+            count = INDEX.unpack_from(self.map, self.index_offset)[1]
+            for i in range(count):
+                offset = INDEX_ENTRY.unpack_from(self.map,
+                    self.index_offset + INDEX.size + i*INDEX_ENTRY.size)[0]
+                self.chunks.append(self._chunk(offset))
+        else:
+            # Not closed: walk the chunks, the last one may be cut short.
+            offset = HEADER_SIZE
+            while offset + SLOT_SIZE <= size:
+                fields = CHUNK.unpack_from(self.map, offset)
+                if fields[0] != CHUNK_MAGIC or fields[1] == 0 or \
+                   fields[1] > (size - offset - SLOT_SIZE)/SLOT_SIZE:
+                    break
+                self.chunks.append(Chunk(offset, fields[1:]))
+                offset += chunk_size
+        self.packets = sum(c.packets for c in self.chunks)
+
+    def _chunk(self, offset):
+        return Chunk(offset, CHUNK.unpack_from(self.map, offset)[1:])
+
+    def indexed(self):
+        """ Whether the file was closed"""
+        return self.index_offset != 0
+
+    def chunk_packet(self, chunk, i):
+        """ Return packet i of a chunk as a bytearray"""
+        start = chunk.offset + SLOT_SIZE + i*SLOT_SIZE
+        return bytearray(self.map[start:start + SLOT_SIZE])
+
+    def packet(self, index):
+        """ Return packet number index of the file, or None"""
+        n = index // self.chunk_packets
+        if n >= len(self.chunks) or \
+           index - self.chunks[n].first_packet >= self.chunks[n].packets:
+            return None
+        return self.chunk_packet(self.chunks[n], index - self.chunks[n].first_packet)
+
+    def find_chunk(self, ns):
+        """ Return the number of the last chunk that starts at or before
+        host time ns, 0 if none"""
+        low, high = 0, len(self.chunks)
+        while high - low > 1:
+            mid = (low + high)//2
+            if self.chunks[mid].first_ns <= ns:
+                low = mid
+            else:
+                high = mid
+        return low
+
+    def iter_packets(self, first=0):
+        """ Yield the packets from chunk first on"""
+        for c in self.chunks[first:]:
+            for i in range(c.packets):
+                yield self.chunk_packet(c, i)
+
+    def samples(self):
+        """ Return a dict of channel -> samples of every stream packet"""
+        data = {}
+        for packet in self.iter_packets():
+            for ch, samples in decode_frames(packet).items():
+                data.setdefault(ch, []).extend(samples)
+        return data
+
+    def close(self):
+        self.map.close()
+        self.file.close()
+
+if __name__ == '__main__':
+    cap = CaptureReader(sys.argv[1])
+    print "serial %s, %d packets in %d chunks%s" % (cap.serial or '-',
+        cap.packets, len(cap.chunks), '' if cap.indexed() else ', not closed')
+    for n, c in enumerate(cap.chunks):
+        print "chunk %4d: %5d packets from %d, %.3f..%.3f s, device time" \
+            " %u..%u" % (n, c.packets, c.first_packet,
+                         (c.first_ns - cap.start_ns)/1e9,
+                         (c.last_ns - cap.start_ns)/1e9,
+                         c.first_stamp, c.last_stamp)
+    for ch, samples in sorted(cap.samples().items()):
+        print "AN%d: %d samples" % (ch, len(samples))
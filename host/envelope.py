@@ -0,0 +1,136 @@
+#!/bin/python
+
+"""
+Min/max envelope of a growing recording, for plotting it at any zoom
+level with about two points per pixel.
+
+The samples stay in the caller's lists of times and values; Envelope
+only keeps summaries of them. Level 0 has one bucket per FACTOR samples,
+level 1 one per FACTOR level 0 buckets and so on. Every bucket holds its
+start time and the lowest and highest value with their times. update()
+takes the samples appended since the last call and closes the buckets
+they complete, level by level, so keeping the envelope costs about
+1/(FACTOR - 1) bucket merges per sample however long the recording is.
+
+view() picks the level with about one bucket per pixel across the x
+range and returns two points per bucket, the minimum and the maximum in
+time order. The end of the recording that no bucket of that level
+covers yet is filled in from the finer levels and the raw samples, so
+the newest samples show at once.
+
+Times must not decrease.
+"""
+
+from bisect import bisect_left, bisect_right
+
+FACTOR = 4
+
+class _Level(object):
+    """ The closed buckets of one level"""
+    def __init__(self):
+        self.start = []     # Time of the first sample
+        self.lo = []
+        self.lo_time = []
+        self.hi = []
+        self.hi_time = []
+
+class Envelope(object):
+    def __init__(self, times, values):
+        """ times and values are the lists the samples are appended to"""
+        self.times = times
+        self.values = values
+        self.levels = []
+        self.count = 0      # Samples taken by update()
+
+    def update(self):
+        """ Take the samples appended since the last call"""
+        count = min(len(self.times), len(self.values))
+        while self.count + FACTOR <= count:
+            self._close_raw(self.count)
+            self.count += FACTOR
+            self._cascade()
+        # A partial bucket is left for the next call, view() reads those
+        # samples directly.
+
+    def _close_raw(self, first):
+        """ Close a level 0 bucket of the samples from first on"""
+        times = self.times
+        values = self.values
+        lo = hi = first
+        for i in range(first + 1, first + FACTOR):
+            if values[i] < values[lo]:
+                lo = i
+            if values[i] > values[hi]:
+                hi = i
+        if not self.levels:
+            self.levels.append(_Level())
+        self._append(self.levels[0], times[first], values[lo], times[lo],
+                     values[hi], times[hi])
+
+    def _cascade(self):
+        """ Close the buckets of the higher levels that the last level 0
+        bucket completed"""
+        j = 0
+        while len(self.levels[j].start) % FACTOR == 0:
+            child = self.levels[j]
+            first = len(child.start) - FACTOR
+            lo = min(range(first, first + FACTOR), key=child.lo.__getitem__)
+            hi = max(range(first, first + FACTOR), key=child.hi.__getitem__)
+            if j + 1 == len(self.levels):
+                self.levels.append(_Level())
+            self._append(self.levels[j + 1], child.start[first], child.lo[lo],
+                         child.lo_time[lo], child.hi[hi], child.hi_time[hi])
+            j += 1
+
+    def _append(self, level, start, lo, lo_time, hi, hi_time):
+        level.start.append(start)
+        level.lo.append(lo)
+        level.lo_time.append(lo_time)
+        level.hi.append(hi)
+        level.hi_time.append(hi_time)
+
+    def view(self, xmin, xmax, pixels):
+        """ Return lists of times and values to draw the samples between
+        xmin and xmax across pixels pixels"""
+        first = bisect_left(self.times, xmin)
+        last = bisect_right(self.times, xmax)
+
+        # Coarsest level with about one bucket per pixel, between half and
+        # two. Level j has buckets of FACTOR**(j + 1) samples.
+        level = -1
+        size = 1
+        while level + 1 < len(self.levels) and \
+              2*(last - first) >= size*FACTOR*max(pixels, 1):
+            level += 1
+            size *= FACTOR
+        if level < 0:
+            return self.times[first:last], self.values[first:last]
+
+        xs = []
+        ys = []
+        pos = first - first % size
+        for j in range(level, -1, -1):
+            bucket_size = FACTOR**(j + 1)
+            if pos >= last:
+                break
+            b = pos//bucket_size
+            stop = min(len(self.levels[j].start), -(-last//bucket_size))
+            self._points(self.levels[j], b, stop, xs, ys)
+            pos = max(pos, stop*bucket_size)
+        if pos < last:
+            xs.extend(self.times[pos:last])
+            ys.extend(self.values[pos:last])
+        return xs, ys
+
+    def _points(self, level, b, stop, xs, ys):
+        for i in range(b, stop):
+            if level.lo_time[i] <= level.hi_time[i]:
+                xs.append(level.lo_time[i])
+                ys.append(level.lo[i])
+                xs.append(level.hi_time[i])
+                ys.append(level.hi[i])
+            else:
+                xs.append(level.hi_time[i])
+                ys.append(level.hi[i])
+                xs.append(level.lo_time[i])
+                ys.append(level.lo[i])
@@ -0,0 +1,108 @@
+#!/bin/python
+
+"""
+Events of the PIC18F2550 libUSB device: changes of RB4-RB7, debounced
+presses and releases of the pushbuttons and A/D threshold crossings.
+
+The device queues them and sends them on the interrupt endpoint 0x83,
+which the host polls every 1 ms frame, so waiting for the pushbutton
+needs no commands and sees a press within a couple of frames. The
+endpoint is only in alternate settings 1 (isochronous stream) and 2
+(bulk stream), so the default setting 0 reserves no bandwidth; this
+script selects 2. A packet
+holds up to 4 records of 8 bytes:
+    [0]     type
+    [1..3]  PINS:      PORTB, the pins of RB4-RB7 that changed, 0
+            BUTTON:    buttons down, the buttons that changed (bit 0 sw2,
+                       bit 1 sw3), 0
+            THRESHOLD: channel (bit 7 set when rising), sample LSB first
+            LOST:      records dropped on the device, LSB first, 0
+    [4..7]  device time in instruction cycles at 12 MHz, LSB first
+
+Thresholds are only checked on conversions that run anyway, streamed or
+one shot 'A'.
+
+Usage: python events.py [pin mask] [channel low high]
+Prints the events as they come until Ctrl-C.
+"""
+
+import errno
+import struct
+import sys
+import usb.core
+
+EVENT_CONFIG = 0x8C
+EVENT_EP = 0x83
+RECORD_SIZE = 8
+ALT_BULK_EVENTS = 2
+
+PINS = 0x01
+BUTTON = 0x02
+THRESHOLD = 0x03
+LOST = 0x04
+
+PIN_MASK = 0xF0
+THRESHOLD_OFF = 0xFF
+RISING = 0x80
+
+CYCLE_TIME = 1.0/12e6
+
+def configure(dev, pins=PIN_MASK, channel=THRESHOLD_OFF, low=0, high=0):
+    """ Set the RB4-RB7 pins that raise PINS events and the channel and
+    levels of the threshold. A sample at or above high is a rising
+    crossing, one at or below low after it a falling one."""
+    dev.write(1, [EVENT_CONFIG, pins, channel, low & 0xFF, low >> 8,
+                  high & 0xFF, high >> 8])
+
+def decode(packet):
+    """ Return the records of an event packet as (type, data, time)
+    tuples, data being bytes 1..3 and time the device time"""
+    packet = bytearray(packet)
+    events = []
+    for i in range(0, len(packet) - RECORD_SIZE + 1, RECORD_SIZE):
+        events.append((packet[i], packet[i + 1:i + 4],
+                       struct.unpack_from('<I', str(packet), i + 4)[0]))
+    return events
+
+def wait_events(dev, timeout=1000):
+    """ Wait for the next event packet and return its records, [] on
+    timeout"""
+    try:
+        return decode(dev.read(EVENT_EP, 32, timeout=timeout))
+    except usb.core.USBError as e:
+        if e.errno != errno.ETIMEDOUT:
+            raise
+        return []
+
+def describe(event):
+    kind, data, stamp = event
+    if kind == PINS:
+        text = "RB7-RB4 %s, changed %s" % (format(data[0] >> 4, '04b'),
+                                           format(data[1] >> 4, '04b'))
+    elif kind == BUTTON:
+        text = ', '.join("sw%d %s" % (n + 2, 'down' if data[0] & (1 << n) else 'up')
+                         for n in range(2) if data[1] & (1 << n))
+    elif kind == THRESHOLD:
+        text = "AN%d %s at %d" % (data[0] & 0x0F,
+                                  'rising' if data[0] & RISING else 'falling',
+                                  data[1] | data[2] << 8)
+    elif kind == LOST:
+        text = "%d events lost" % (data[0] | data[1] << 8)
+    else:
+        text = "unknown event 0x%02x" % kind
+    return "%12.6f s  %s" % (stamp*CYCLE_TIME, text)
+
+if __name__ == '__main__':
+    args = [int(a, 0) for a in sys.argv[1:]]
+    dev = usb.core.find(idVendor=0x04d8, idProduct=0x0204)
+    dev.set_configuration()
+    dev.set_interface_altsetting(interface=0, alternate_setting=ALT_BULK_EVENTS)
+
+    if len(args) >= 4:
+        configure(dev, args[0], args[1], args[2], args[3])
+    elif args:
+        configure(dev, args[0])
+
+    while True:
+        for event in wait_events(dev):
+            print describe(event)
@@ -0,0 +1,62 @@
+#!/bin/python
+
+"""
+Read and write all of PORTA, PORTB and PORTC of the PIC18F2550 libUSB
+device in one round trip.
+
+Both commands reply with a snapshot of the three ports, read within 250 ns
+of each other:
+    [0]     command echo
+    [1..3]  PORTA, PORTB, PORTC (pin levels)
+    [4..6]  LATA, LATB, LATC
+    [7..9]  TRISA, TRISB, TRISC
+
+Usage: python gpio.py
+"""
+
+import usb.core
+
+PORT_SNAPSHOT = 0x86
+PORT_WRITE = 0x87
+
+PORTS = 'ABC'
+
+def _read_snapshot(dev, command):
+    reply = dev.read(0x81, 64, timeout=1000)
+    while reply[0] != command:
+        # Other packets still in flight, eg a logic analyzer upload.
+        reply = dev.read(0x81, 64, timeout=1000)
+    return {
+        'port': dict(zip(PORTS, reply[1:4])),
+        'lat': dict(zip(PORTS, reply[4:7])),
+        'tris': dict(zip(PORTS, reply[7:10])),
+        }
+
+def snapshot(dev):
+    """ Return dicts of the pin levels, latches and directions of every
+    port, keyed by 'port', 'lat' and 'tris' and then by port letter."""
+    dev.write(1, [PORT_SNAPSHOT])
+    return _read_snapshot(dev, PORT_SNAPSHOT)
+
+def write_ports(dev, values, masks=None):
+    """ Set the latches in values, a dict of port letter -> byte. Only the
+    bits set in masks change, all of them if masks is None. Returns the
+    snapshot taken right after the write."""
+    if masks is None:
+        masks = dict((port, 0xFF) for port in values)
+    packet = [PORT_WRITE]
+    packet += [masks.get(port, 0) for port in PORTS]
+    packet += [values.get(port, 0) for port in PORTS]
+    dev.write(1, packet)
+    return _read_snapshot(dev, PORT_WRITE)
+
+if __name__ == '__main__':
+    dev = usb.core.find(idVendor=0x04d8, idProduct=0x0204)
+    dev.set_configuration()
+
+    state = snapshot(dev)
+    for port in PORTS:
+        print "PORT%s %s  LAT%s %s  TRIS%s %s" % (port,
+            format(state['port'][port], '08b'), port,
+            format(state['lat'][port], '08b'), port,
+            format(state['tris'][port], '08b'))
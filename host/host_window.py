@@ -29,6 +29,9 @@ from matplotlib.backends.backend_wxagg import \
     NavigationToolbar2WxAgg as NavigationToolbar
 import pylab
 
+from adc_packet import decode_single, single_time, DeviceClock
+from envelope import Envelope
+
 def _configure_device():
     """ Configure and get the USB device running. Returns device class if
     success and None if failed"""
@@ -48,21 +51,31 @@ class VSDataAquisition(object):
         """ Configure the device and set class properties"""
         self.data0 = []     # This will hold data from ADC0
         self.data1 = []     # This will hold data from ADC1
+        self.time0 = []     # Device time of each ADC0 sample in seconds.
+                            # The wx timer does not fire evenly.
+        self.clock = DeviceClock()
+        self.envelope0 = Envelope(self.time0, self.data0)
         self.dev = _configure_device()
 
+    def clear(self):
+        """ Forget the samples of the last measurement"""
+        self.data0 = []
+        self.time0 = []
+        self.envelope0 = Envelope(self.time0, self.data0)
+
     def get_data(self):
         """ Get the next data from ADC0. For ADC1, use get_dc_offset()"""
         self.dev.write(1, 'A0')
-        digit1, digit2 = self.dev.read(0x81, 64)[:2]
+        packet = self.dev.read(0x81, 64)
         # Save the data as voltage between 0.0 and 5.0
-        self.data0.append((digit1 + 256*digit2)*5.0/1024)
+        self.data0.append(decode_single(packet)*5.0/1024)
+        self.time0.append(self.clock.seconds(single_time(packet)))
         
     def get_dc_offset(self):
         """ Get the initial DC offset of the analog output"""
         self.dev.write(1, 'A1')
-        digit1, digit2 = self.dev.read(0x81, 64)[:2]
         # Save the data as voltage between 0.0 and 5.0
-        self.data1.append((digit1 + 256*digit2)*5.0/1024)
+        self.data1.append(decode_single(self.dev.read(0x81, 64))*5.0/1024)
 
     def sample(self):
         """ Set the sample bit for getting intial DC offset"""
@@ -218,9 +231,9 @@ device and restart the software'''
 
     def draw_plot(self):
         """ Redraw the plot after every data aquisition."""
-        # X axis is auto follow.
-        XLEN = 100
-        xmax = max(len(self.daq.data0), XLEN)
+        # X axis is auto follow, in seconds of device time.
+        XLEN = 10.0
+        xmax = max(self.daq.time0[-1] if self.daq.time0 else 0, XLEN)
         xmin = xmax - XLEN
 
         # The Y value will lie between 0.0 and 5.0 volts
@@ -236,8 +249,13 @@ device and restart the software'''
         pylab.setp(self.main_plot.get_xticklabels(), 
             visible=True)
         
-        self.plot_data.set_xdata(arange(len(self.daq.data0)))
-        self.plot_data.set_ydata(array(self.daq.data0))
+        # Only about two points per pixel of the envelope are drawn, so a
+        # redraw costs the same however long the recording is.
+        self.daq.envelope0.update()
+        xs, ys = self.daq.envelope0.view(xmin, xmax,
+                                         int(self.main_plot.bbox.width))
+        self.plot_data.set_xdata(array(xs))
+        self.plot_data.set_ydata(array(ys))
         
         self.canvas.draw()
 
@@ -260,7 +278,7 @@ device and restart the software'''
 
     def start_stop(self, event):
         """ Restart measurements and complete calculations"""
-        self.daq.data0= []
+        self.daq.clear()
         self.control_box.txt_info_box.SetLabel('Starting measurement')
         self.sampling_timer.Start(self.SAMPLING_TIME, oneShot=True)
             
@@ -0,0 +1,93 @@
+#!/bin/python
+
+"""
+Logic analyzer capture of RB2-RB7 on the PIC18F2550 libUSB device.
+
+The device samples PORTB into its own RAM every period instruction cycles
+(12 MHz) and uploads the 512 samples once the capture is complete. Each
+data packet is
+    [0]     0x88 (capture command echo)
+    [1]     number of samples in the packet
+    [2..3]  index of its first sample, LSB first
+    [4..]   PORTB samples
+The last packet is followed by 2 bytes, LSB first: the number of samples
+the device took late, because USB held up its interrupt for more than a
+period. The times after a late sample are that much later than shown.
+The trigger sample is at index pre_trigger.
+
+Usage: python logic_capture.py [trigger mask] [trigger value] [edge]
+                               [pre-trigger samples] [period]
+Prints one line per change of RB2-RB7 with its time from the trigger.
+"""
+
+import sys
+import usb.core
+
+LA_START = 0x88
+LA_STOP = 0x89
+
+TRIGGER_LEVEL = 0
+TRIGGER_EDGE = 1
+
+BUFFER_SIZE = 512
+CYCLE_TIME = 1.0/12e6
+INPUT_MASK = 0xFC           # RB2-RB7
+
+def start_capture(dev, mask=0, value=0, mode=TRIGGER_LEVEL, pre_trigger=0,
+                  period=0):
+    """ Arm a capture. A mask of 0 triggers at once, period 0 is 50 kS/s"""
+    dev.write(1, [LA_START, mode, mask, value,
+                  pre_trigger & 0xFF, pre_trigger >> 8,
+                  period & 0xFF, period >> 8])
+
+def stop_capture(dev):
+    """ Abort a capture"""
+    dev.write(1, [LA_STOP])
+
+def read_capture(dev, timeout=10000):
+    """ Wait for the trigger and return the BUFFER_SIZE samples and the
+    number of them taken late. Other packets, eg of a running A/D
+    stream, are skipped."""
+    samples = [0]*BUFFER_SIZE
+    received = 0
+    late = 0
+    while received < BUFFER_SIZE:
+        packet = dev.read(0x81, 64, timeout=timeout)
+        if packet[0] != LA_START:
+            continue
+        count = packet[1]
+        offset = packet[2] + 256*packet[3]
+        samples[offset:offset+count] = packet[4:4+count]
+        received += count
+        if offset + count == BUFFER_SIZE:
+            late = packet[4+count] + 256*packet[5+count]
+    return samples, late
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    mask = int(args[0], 0) if len(args) > 0 else 0
+    value = int(args[1], 0) if len(args) > 1 else 0
+    mode = TRIGGER_EDGE if len(args) > 2 and args[2] == 'edge' \
+        else TRIGGER_LEVEL
+    pre_trigger = int(args[3]) if len(args) > 3 else 0
+    period = int(args[4]) if len(args) > 4 else 240
+
+    dev = usb.core.find(idVendor=0x04d8, idProduct=0x0204)
+    dev.set_configuration()
+
+    start_capture(dev, mask, value, mode, pre_trigger, period)
+    try:
+        samples, late = read_capture(dev)
+    except KeyboardInterrupt:
+        stop_capture(dev)
+        sys.exit(1)
+
+    previous = None
+    for i, sample in enumerate(samples):
+        sample &= INPUT_MASK
+        if sample != previous:
+            t = (i - pre_trigger)*period*CYCLE_TIME*1e6
+            print "%10.1f us  RB7..RB2 %s" % (t, format(sample >> 2, '06b'))
+            previous = sample
+    if late:
+        print "%d samples taken late, the times after them are off" % late
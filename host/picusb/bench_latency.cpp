@@ -0,0 +1,238 @@
+/********************************************************************
+ FileName:      bench_latency.cpp
+ Dependencies:  picusb.h, standin.h, histogram.h
+ Hardware:      PIC18F2550 libUSB device of the Firmware folder, or none
+                with -e.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Measures the round trip time of single commands, from request() to its
+ reply, and prints the percentiles of each command at each depth.
+ Depth 1 is sequential: the next command goes out when the reply to the
+ last one is in, which is what a control loop on the host sees. Deeper
+ runs keep that many tagged commands in flight and show what the
+ firmware and the bus add when commands queue up. In flight replies
+ are waited for oldest first; the firmware answers in order, so that
+ only delays a time stamp when the host itself falls behind.
+
+ Commands:
+   button   0x81 pushbutton
+   adc      'A' one shot conversion of AN0
+   led      0x80 toggle LED, answered with the tagged ack
+   gpio     PWB2H of application.c, one port write
+   port     0x87 port write with empty masks, the port snapshot
+
+ Usage: bench_latency [-n count] [-q depths] [-c commands] [-e]
+   -n   Commands timed per command and depth, default 2000
+   -q   Comma separated depths, default 1,4,16
+   -c   Comma separated commands, default all of them
+   -e   Run against StandIn, the software model of the firmware, instead
+        of a board
+********************************************************************/
+
+#include "histogram.h"
+#include "picusb.h"
+#include "standin.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace picusb;
+
+typedef std::chrono::steady_clock Clock;
+
+// Commands not timed before each run, to get streaming and the caches
+// going.
+static const int WARMUP_COUNT = 50;
+
+// A reply that takes longer than this is taken as lost.
+static const int REPLY_TIMEOUT_MS = 1000;
+
+struct Probe
+{
+    const char *name;
+    uint8_t cmd[8];
+    int length;
+};
+
+static const Probe probes[] = {
+    { "button", { CMD_PUSHBUTTON }, 1 },
+    { "adc",    { 'A', '0' }, 2 },
+    { "led",    { CMD_TOGGLE_LED }, 1 },
+    { "gpio",   { 'P', 'W', 'B', '2', 'H' }, 5 },
+    { "port",   { CMD_PORT_WRITE, 0, 0, 0, 0, 0, 0 }, 7 },
+};
+
+static std::vector<int> parseList(const char *text)
+{
+    std::vector<int> values;
+    const char *p = text;
+
+    while (*p)
+    {
+        values.push_back(atoi(p));
+        p = strchr(p, ',');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return values;
+}
+
+static std::vector<std::string> parseNames(const char *text)
+{
+    std::vector<std::string> names;
+    const char *p = text;
+    const char *comma;
+
+    while (*p)
+    {
+        comma = strchr(p, ',');
+        if (comma == NULL)
+        {
+            names.push_back(p);
+            break;
+        }
+        names.push_back(std::string(p, comma));
+        p = comma + 1;
+    }
+    return names;
+}
+
+/******************************************************************************
+ * Function:        static void run(Transport &dev, const Probe &probe,
+ *                                  int depth, int count, Histogram *times)
+ *
+ * Overview:        Sends probe count times with up to depth of them in
+ *                  flight and records the round trip of each in ns into
+ *                  times, if given. Throws Error if a reply is lost.
+ *****************************************************************************/
+static void run(Transport &dev, const Probe &probe, int depth, int count,
+                Histogram *times)
+{
+    std::deque<std::pair<Clock::time_point, std::future<Reply> > > inFlight;
+    Clock::time_point sent;
+    int issued = 0;
+
+    while (issued < count || !inFlight.empty())
+    {
+        while (issued < count && (int)inFlight.size() < depth)
+        {
+            sent = Clock::now();
+            inFlight.push_back(std::make_pair(sent, dev.request(probe.cmd, probe.length)));
+            issued++;
+        }
+
+        std::future<Reply> &reply = inFlight.front().second;
+        if (reply.wait_for(std::chrono::milliseconds(REPLY_TIMEOUT_MS)) !=
+            std::future_status::ready)
+            throw Error(std::string("No reply to ") + probe.name, ERROR_TIMEOUT);
+        reply.get();
+        if (times != NULL)
+            times->record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - inFlight.front().first).count());
+        inFlight.pop_front();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> depths = parseList("1,4,16");
+    std::vector<std::string> names;
+    int count = 2000;
+    bool standIn = false;
+    size_t p;
+    size_t d;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-e") == 0)
+            standIn = true;
+        else if (i + 1 == argc)
+            break;
+        else if (strcmp(argv[i], "-n") == 0)
+            count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-q") == 0)
+            depths = parseList(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0)
+            names = parseNames(argv[++i]);
+    }
+    if (names.empty())
+    {
+        for (p = 0; p < sizeof(probes) / sizeof(probes[0]); p++)
+            names.push_back(probes[p].name);
+    }
+
+    try
+    {
+        std::unique_ptr<Context> ctx;
+        std::unique_ptr<Transport> dev;
+
+        if (standIn)
+        {
+            dev.reset(new StandIn());
+        }
+        else
+        {
+            ctx.reset(new Context());
+            dev = Device::open(*ctx);
+        }
+
+        printf("%-8s %6s %8s %10s %9s %9s %9s %9s %9s %9s\n", "command", "depth",
+               "count", "cmds/s", "min us", "p50 us", "p90 us", "p99 us",
+               "p99.9 us", "max us");
+        for (i = 0; i < (int)names.size(); i++)
+        {
+            const Probe *probe = NULL;
+
+            for (p = 0; p < sizeof(probes) / sizeof(probes[0]); p++)
+            {
+                if (names[i] == probes[p].name)
+                    probe = &probes[p];
+            }
+            if (probe == NULL)
+            {
+                fprintf(stderr, "Unknown command %s\n", names[i].c_str());
+                return 1;
+            }
+
+            for (d = 0; d < depths.size(); d++)
+            {
+                Histogram times;
+                Clock::time_point start;
+                double elapsed;
+
+                run(*dev, *probe, depths[d], WARMUP_COUNT, NULL);
+                start = Clock::now();
+                run(*dev, *probe, depths[d], count, &times);
+                elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+                printf("%-8s %6d %8llu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                       probe->name, depths[d], (unsigned long long)times.count(),
+                       times.count() / elapsed, times.min() / 1e3,
+                       times.percentile(50) / 1e3, times.percentile(90) / 1e3,
+                       times.percentile(99) / 1e3, times.percentile(99.9) / 1e3,
+                       times.max() / 1e3);
+            }
+        }
+        dev->stopStreaming();
+    }
+    catch (const Error &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
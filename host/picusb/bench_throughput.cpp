@@ -0,0 +1,219 @@
+/********************************************************************
+ FileName:      bench_throughput.cpp
+ Dependencies:  picusb.h, standin.h
+ Hardware:      PIC18F2550 libUSB device of the Firmware folder, or none
+                with -e.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Streams A/D samples from the device with different numbers of IN
+ transfers in flight and prints the packet and sample rates for each.
+ With one transfer in flight the host has to resubmit after every
+ packet, which is what the synchronous usb_bulk_read() loop of the Qt3
+ demo does.
+
+ Usage: bench_throughput [-d depths] [-s seconds] [-p period] [-c channels]
+                         [-r slots] [-i] [-e]
+   -d   Comma separated queue depths to try, default 1,2,4,8,16
+   -s   Seconds per depth, default 3
+   -p   Stream period in 12 MHz ticks, default 240 (50 kS/s per frame)
+   -c   Comma separated A/D channels, default 0
+   -r   Receive into a PacketRing of this many slots, drained by a
+        second thread, instead of counting in the transfer callback
+   -i   Stream on the isochronous endpoint (ALT_ISO). A transfer then
+        covers ISO_TRANSFER_PACKETS frames, and the frames in which the
+        device had nothing to send are printed as empty
+   -e   Run against StandIn, the software model of the firmware, instead
+        of a board
+********************************************************************/
+
+#include "picusb.h"
+#include "standin.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace picusb;
+
+static std::vector<int> parseList(const char *text)
+{
+    std::vector<int> values;
+    const char *p = text;
+
+    while (*p)
+    {
+        values.push_back(atoi(p));
+        p = strchr(p, ',');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return values;
+}
+
+// Samples in a stream packet, the low 6 bits of its second byte.
+static int streamSamples(const uint8_t *packet, int length)
+{
+    if (length < 2 || packet[0] != CMD_STREAM_START)
+        return 0;
+    return packet[1] & 0x3F;
+}
+
+static void drain(Transport &dev)
+{
+    uint8_t packet[PACKET_SIZE];
+
+    while (dev.altSetting() != ALT_ISO && dev.readStream(packet, 50) > 0)
+        ;
+    while (dev.read(packet, 50) > 0)
+        ;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> depths = parseList("1,2,4,8,16");
+    std::vector<int> channels = parseList("0");
+    int seconds = 3;
+    int period = 240;
+    int ringSlots = 0;
+    bool standIn = false;
+    bool iso = false;
+    int i;
+    size_t d;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-e") == 0)
+            standIn = true;
+        else if (strcmp(argv[i], "-i") == 0)
+            iso = true;
+        else if (i + 1 == argc)
+            break;
+        else if (strcmp(argv[i], "-d") == 0)
+            depths = parseList(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0)
+            period = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0)
+            channels = parseList(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0)
+            ringSlots = atoi(argv[++i]);
+    }
+
+    try
+    {
+        std::unique_ptr<Context> ctx;
+        std::unique_ptr<Transport> dev;
+        uint8_t cmd[PACKET_SIZE];
+
+        if (standIn)
+        {
+            dev.reset(new StandIn());
+        }
+        else
+        {
+            ctx.reset(new Context());
+            dev = Device::open(*ctx);
+        }
+
+        if (iso)
+            dev->setAltSetting(ALT_ISO);
+
+        cmd[0] = CMD_SCAN_LIST;
+        cmd[1] = (uint8_t)channels.size();
+        for (d = 0; d < channels.size(); d++)
+            cmd[2 + d] = (uint8_t)channels[d];
+        dev->write(cmd, 2 + channels.size());
+        drain(*dev);
+
+        printf("%6s %12s %12s %12s %8s %8s %8s\n",
+               "depth", "packets/s", "KB/s", "samples/s", "errors", "dropped", "empty");
+        for (d = 0; d < depths.size(); d++)
+        {
+            std::atomic<uint64_t> samples(0);
+            std::atomic<bool> draining(true);
+            std::unique_ptr<PacketRing> ring;
+            std::thread consumer;
+            std::chrono::steady_clock::time_point start;
+            double elapsed;
+            Stats before;
+            Stats after;
+
+            before = dev->stats();
+            if (ringSlots > 0)
+            {
+                ring.reset(new PacketRing(ringSlots));
+                PacketRing *r = ring.get();
+                consumer = std::thread([r, &samples, &draining]() {
+                    const uint8_t *packet;
+
+                    while (draining || r->size() > 0)
+                    {
+                        packet = r->front();
+                        if (packet == NULL)
+                        {
+                            std::this_thread::yield();
+                            continue;
+                        }
+                        samples += streamSamples(packet, PACKET_SIZE);
+                        r->pop();
+                    }
+                });
+                dev->startStreaming(*ring, depths[d]);
+            }
+            else
+            {
+                dev->startStreaming([&samples](const uint8_t *packet, int length) {
+                    samples += streamSamples(packet, length);
+                }, depths[d]);
+            }
+
+            cmd[0] = CMD_STREAM_START;
+            cmd[1] = STREAM_CHANNEL_SCAN_LIST;
+            cmd[2] = (uint8_t)period;
+            cmd[3] = (uint8_t)(period >> 8);
+            cmd[4] = STREAM_FORMAT_PACKED10;
+            start = std::chrono::steady_clock::now();
+            dev->write(cmd, 5);
+            std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+            cmd[0] = CMD_STREAM_STOP;
+            dev->write(cmd, 1);
+            elapsed = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            dev->stopStreaming();
+            if (ring)
+            {
+                draining = false;
+                consumer.join();
+            }
+            drain(*dev);
+
+            after = dev->stats();
+            printf("%6d %12.0f %12.1f %12.0f %8llu %8llu %8llu\n", depths[d],
+                   (after.packets - before.packets) / elapsed,
+                   (after.bytes - before.bytes) / elapsed / 1024,
+                   samples / elapsed,
+                   (unsigned long long)(after.errors - before.errors +
+                                        after.isoErrors - before.isoErrors),
+                   (unsigned long long)(ring ? ring->dropped() : 0),
+                   (unsigned long long)(after.isoEmpty - before.isoEmpty));
+        }
+    }
+    catch (const Error &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,336 @@
+/********************************************************************
+ FileName:      capture.cpp
+ Dependencies:  capture.h
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+********************************************************************/
+
+#include "capture.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace picusb {
+
+// First byte and header size of a stream packet, see adc_packet.py.
+static const uint8_t STREAM_PACKET = 0x82;
+static const size_t STREAM_PACKET_HEADER = 8;
+
+static std::runtime_error fileError(const std::string &what, const std::string &path)
+{
+    return std::runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+static uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t stampOf(const uint8_t *packet)
+{
+    return packet[4] | (packet[5] << 8) | (packet[6] << 16) | ((uint32_t)packet[7] << 24);
+}
+
+/******************************************************************************
+ * CaptureWriter
+ *****************************************************************************/
+CaptureWriter::CaptureWriter(const std::string &path, const std::string &serial,
+                             uint32_t chunkPackets)
+    : file_(NULL), path_(path), chunkOffset_(0), packets_(0)
+{
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, CAPTURE_MAGIC, sizeof(header_.magic));
+    header_.version = CAPTURE_VERSION;
+    header_.headerSize = CAPTURE_HEADER_SIZE;
+    header_.slotSize = CAPTURE_SLOT_SIZE;
+    header_.chunkPackets = std::max(chunkPackets, (uint32_t)1);
+    header_.startNs = nowNs();
+    memcpy(header_.serial, serial.data(), std::min(serial.size(), sizeof(header_.serial)));
+    memset(&chunk_, 0, sizeof(chunk_));
+
+    file_ = fopen(path.c_str(), "w+b");
+    if (file_ == NULL)
+        throw fileError("Cannot create", path);
+    writeAt(0, &header_, sizeof(header_));
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (const std::exception &)
+    {
+    }
+}
+
+void CaptureWriter::append(const uint8_t *packet, size_t length)
+{
+    append(packet, length, nowNs());
+}
+
+/******************************************************************************
+ * Function:        void CaptureWriter::append(const uint8_t *packet,
+ *                                             size_t length, uint64_t hostNs)
+ *
+ * Overview:        Opens a chunk with a blank header if none is open, then
+ *                  writes the packet to the end of the file, padded to its
+ *                  slot. The chunk header is only written again when the
+ *                  chunk is full, on flush() and on close(), so a packet
+ *                  costs one buffered write.
+ *****************************************************************************/
+void CaptureWriter::append(const uint8_t *packet, size_t length, uint64_t hostNs)
+{
+    uint8_t slot[CAPTURE_SLOT_SIZE];
+
+    if (file_ == NULL)
+        throw std::runtime_error("Capture " + path_ + " is closed");
+
+    if (chunk_.packets == 0)
+    {
+        chunkOffset_ = CAPTURE_HEADER_SIZE + (uint64_t)index_.size() *
+            (CAPTURE_SLOT_SIZE + (uint64_t)header_.chunkPackets * CAPTURE_SLOT_SIZE);
+        memset(&chunk_, 0, sizeof(chunk_));
+        memcpy(chunk_.magic, CAPTURE_CHUNK_MAGIC, sizeof(chunk_.magic));
+        chunk_.firstPacket = packets_;
+        chunk_.firstNs = hostNs;
+        if (fwrite(&chunk_, sizeof(chunk_), 1, file_) != 1)
+            throw fileError("Cannot write", path_);
+    }
+
+    if (length > CAPTURE_SLOT_SIZE)
+        length = CAPTURE_SLOT_SIZE;
+    memcpy(slot, packet, length);
+    memset(slot + length, 0, CAPTURE_SLOT_SIZE - length);
+    if (fwrite(slot, sizeof(slot), 1, file_) != 1)
+        throw fileError("Cannot write", path_);
+
+    chunk_.packets++;
+    chunk_.lastNs = hostNs;
+    if (length >= STREAM_PACKET_HEADER && packet[0] == STREAM_PACKET)
+    {
+        if (chunk_.streamPackets++ == 0)
+            chunk_.firstStamp = stampOf(packet);
+        chunk_.lastStamp = stampOf(packet);
+    }
+    packets_++;
+
+    if (chunk_.packets == header_.chunkPackets)
+    {
+        writeChunkHeader();
+        chunk_.packets = 0;
+    }
+}
+
+void CaptureWriter::flush()
+{
+    if (file_ == NULL)
+        return;
+    if (chunk_.packets > 0)
+        writeChunkHeader();
+    if (fflush(file_) != 0)
+        throw fileError("Cannot write", path_);
+}
+
+void CaptureWriter::close()
+{
+    CaptureIndex index;
+    long end;
+
+    if (file_ == NULL)
+        return;
+
+    if (chunk_.packets > 0)
+    {
+        writeChunkHeader();
+        chunk_.packets = 0;
+    }
+
+    if (fseek(file_, 0, SEEK_END) != 0 || (end = ftell(file_)) < 0)
+        throw fileError("Cannot write", path_);
+    memset(&index, 0, sizeof(index));
+    memcpy(index.magic, CAPTURE_INDEX_MAGIC, sizeof(index.magic));
+    index.chunkCount = (uint32_t)index_.size();
+    if (fwrite(&index, sizeof(index), 1, file_) != 1 ||
+        (!index_.empty() &&
+         fwrite(&index_[0], sizeof(index_[0]), index_.size(), file_) != index_.size()))
+        throw fileError("Cannot write", path_);
+
+    header_.chunkCount = (uint32_t)index_.size();
+    header_.indexOffset = (uint64_t)end;
+    writeAt(0, &header_, sizeof(header_));
+
+    if (fclose(file_) != 0)
+    {
+        file_ = NULL;
+        throw fileError("Cannot write", path_);
+    }
+    file_ = NULL;
+}
+
+// Writes the header of the open chunk in place and, the first time, adds
+// it to the index.
+void CaptureWriter::writeChunkHeader()
+{
+    CaptureIndexEntry entry;
+
+    writeAt(chunkOffset_, &chunk_, sizeof(chunk_));
+
+    entry.offset = chunkOffset_;
+    entry.firstPacket = chunk_.firstPacket;
+    entry.firstNs = chunk_.firstNs;
+    entry.firstStamp = chunk_.firstStamp;
+    entry.packets = chunk_.packets;
+    if (!index_.empty() && index_.back().offset == chunkOffset_)
+        index_.back() = entry;
+    else
+        index_.push_back(entry);
+}
+
+// Writes at offset and goes back to the end of the file for append().
+void CaptureWriter::writeAt(uint64_t offset, const void *data, size_t length)
+{
+    if (fseek(file_, (long)offset, SEEK_SET) != 0 ||
+        fwrite(data, length, 1, file_) != 1 ||
+        fseek(file_, 0, SEEK_END) != 0)
+        throw fileError("Cannot write", path_);
+}
+
+/******************************************************************************
+ * CaptureReader
+ *****************************************************************************/
+CaptureReader::CaptureReader(const std::string &path)
+    : data_(NULL), size_(0), header_(NULL), chunkSize_(0), packets_(0)
+{
+    const CaptureIndex *index;
+    const CaptureIndexEntry *entries;
+    const CaptureChunk *chunk;
+    struct stat st;
+    void *memory;
+    size_t offset;
+    size_t slots;
+    uint32_t i;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw fileError("Cannot open", path);
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        throw fileError("Cannot open", path);
+    }
+    size_ = (size_t)st.st_size;
+    if (size_ < CAPTURE_HEADER_SIZE)
+    {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+    memory = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+        throw fileError("Cannot map", path);
+    data_ = static_cast<const uint8_t *>(memory);
+    header_ = reinterpret_cast<const CaptureHeader *>(data_);
+
+    if (memcmp(header_->magic, CAPTURE_MAGIC, sizeof(header_->magic)) != 0 ||
+        header_->version != CAPTURE_VERSION || header_->slotSize != CAPTURE_SLOT_SIZE ||
+        header_->chunkPackets == 0)
+    {
+        munmap(memory, size_);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+    chunkSize_ = CAPTURE_SLOT_SIZE + (size_t)header_->chunkPackets * CAPTURE_SLOT_SIZE;
+
+    if (header_->indexOffset != 0 &&
+        header_->indexOffset + sizeof(CaptureIndex) <= size_)
+    {
+        index = reinterpret_cast<const CaptureIndex *>(data_ + header_->indexOffset);
+        entries = reinterpret_cast<const CaptureIndexEntry *>(index + 1);
+        for (i = 0; i < index->chunkCount; i++)
+        {
+            if (header_->indexOffset + sizeof(CaptureIndex) +
+                (i + 1) * sizeof(CaptureIndexEntry) > size_)
+                break;
+            chunks_.push_back(reinterpret_cast<const CaptureChunk *>(data_ + entries[i].offset));
+        }
+    }
+    else
+    {
+        // Not closed: walk the chunks, the last one may be cut short.
+        for (offset = CAPTURE_HEADER_SIZE; offset + CAPTURE_SLOT_SIZE <= size_;
+             offset += chunkSize_)
+        {
+            chunk = reinterpret_cast<const CaptureChunk *>(data_ + offset);
+            if (memcmp(chunk->magic, CAPTURE_CHUNK_MAGIC, sizeof(chunk->magic)) != 0 ||
+                chunk->packets == 0)
+                break;
+            slots = (size_ - offset - CAPTURE_SLOT_SIZE) / CAPTURE_SLOT_SIZE;
+            if (chunk->packets > slots)
+                break;
+            chunks_.push_back(chunk);
+        }
+    }
+
+    for (i = 0; i < chunks_.size(); i++)
+        packets_ += chunks_[i]->packets;
+}
+
+CaptureReader::~CaptureReader()
+{
+    munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+std::string CaptureReader::serial() const
+{
+    return std::string(header_->serial,
+                       strnlen(header_->serial, sizeof(header_->serial)));
+}
+
+const uint8_t *CaptureReader::chunkPacket(size_t n, uint32_t i) const
+{
+    return reinterpret_cast<const uint8_t *>(chunks_[n]) + CAPTURE_SLOT_SIZE +
+        (size_t)i * CAPTURE_SLOT_SIZE;
+}
+
+const uint8_t *CaptureReader::packet(uint64_t index) const
+{
+    size_t n;
+
+    // Every chunk but the last is full.
+    n = (size_t)(index / header_->chunkPackets);
+    if (n >= chunks_.size() || index - chunks_[n]->firstPacket >= chunks_[n]->packets)
+        return NULL;
+    return chunkPacket(n, (uint32_t)(index - chunks_[n]->firstPacket));
+}
+
+size_t CaptureReader::findChunk(uint64_t ns) const
+{
+    size_t low = 0;
+    size_t high = chunks_.size();
+    size_t mid;
+
+    while (high - low > 1)
+    {
+        mid = (low + high) / 2;
+        if (chunks_[mid]->firstNs <= ns)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+} // namespace picusb
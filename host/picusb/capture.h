@@ -0,0 +1,187 @@
+/********************************************************************
+ FileName:      capture.h
+ Dependencies:  None (POSIX mmap)
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Capture files hold the IN packets of a stream as they came off the
+ bus, 64 bytes each, so they can be written at the full stream rate and
+ reopened in any size. All fields are little endian. The headers are
+ 64 bytes like the packets, so every packet sits at a multiple of 64 in
+ the file and readers use it in place from an mmap.
+
+   File header, 64 bytes (CaptureHeader)
+   Chunk 0:  chunk header, 64 bytes (CaptureChunk), then chunkPackets
+             packet slots of 64 bytes
+   Chunk 1:  ...
+   Index, written by close() (CaptureIndex, then one
+             CaptureIndexEntry per chunk)
+
+ Chunks are all the same size, the last one is only partly used, so
+ chunk n starts at CAPTURE_HEADER_SIZE + n * chunk size whether or not
+ there is an index. The index repeats the chunk headers in one place,
+ so finding a time does not touch the pages of every chunk. A file that
+ was not closed has no index and its header says so: readers then walk
+ the chunk headers, and get every chunk the writer had finished or
+ flush()ed.
+
+ Each chunk header has the host time of its first and last packet and
+ the device time of its first and last stream packet, see
+ adc_packet.py. host/capture.py reads and writes the same files.
+********************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace picusb {
+
+const char CAPTURE_MAGIC[8] = { 'P', 'I', 'C', 'U', 'S', 'B', 'C', 'P' };
+const char CAPTURE_CHUNK_MAGIC[4] = { 'C', 'H', 'N', 'K' };
+const char CAPTURE_INDEX_MAGIC[4] = { 'I', 'N', 'D', 'X' };
+const uint16_t CAPTURE_VERSION = 1;
+const size_t CAPTURE_HEADER_SIZE = 64;
+const size_t CAPTURE_SLOT_SIZE = 64;
+const uint32_t CAPTURE_CHUNK_PACKETS = 1024;    // 64 KB of packets per chunk
+
+#pragma pack(push, 1)
+
+struct CaptureHeader
+{
+    char magic[8];              // CAPTURE_MAGIC
+    uint16_t version;           // CAPTURE_VERSION
+    uint16_t headerSize;        // CAPTURE_HEADER_SIZE
+    uint16_t slotSize;          // CAPTURE_SLOT_SIZE
+    uint16_t reserved0;
+    uint32_t chunkPackets;      // Packet slots per chunk
+    uint32_t chunkCount;        // Chunks in the file, 0 until closed
+    uint64_t startNs;           // Host time the capture was opened, ns since 1970
+    uint64_t indexOffset;       // Of the CaptureIndex, 0 until closed
+    char serial[8];             // Serial number of the board, '\0' padded,
+                                // no '\0' if all 8 are used
+    uint8_t reserved[16];
+};
+
+struct CaptureChunk
+{
+    char magic[4];              // CAPTURE_CHUNK_MAGIC
+    uint32_t packets;           // Slots in use
+    uint64_t firstPacket;       // Number of its first packet in the file
+    uint64_t firstNs;           // Host time of the first and the last packet
+    uint64_t lastNs;
+    uint32_t firstStamp;        // Device time of the first and the last
+    uint32_t lastStamp;         // stream packet, 0 if there is none
+    uint32_t streamPackets;     // Of the packets, those that are stream packets
+    uint8_t reserved[20];
+};
+
+struct CaptureIndex
+{
+    char magic[4];              // CAPTURE_INDEX_MAGIC
+    uint32_t chunkCount;
+    uint64_t reserved;
+};
+
+struct CaptureIndexEntry
+{
+    uint64_t offset;            // Of the chunk header
+    uint64_t firstPacket;
+    uint64_t firstNs;
+    uint32_t firstStamp;
+    uint32_t packets;
+};
+
+#pragma pack(pop)
+
+// Appends packets to a new capture file. Writes go through stdio, so
+// append() costs a copy into its buffer. Not thread safe. Throws
+// std::runtime_error if the file cannot be written.
+class CaptureWriter
+{
+public:
+    CaptureWriter(const std::string &path, const std::string &serial = "",
+                  uint32_t chunkPackets = CAPTURE_CHUNK_PACKETS);
+    ~CaptureWriter();
+
+    // Appends one packet of up to CAPTURE_SLOT_SIZE bytes, received at
+    // the host time now or hostNs.
+    void append(const uint8_t *packet, size_t length = CAPTURE_SLOT_SIZE);
+    void append(const uint8_t *packet, size_t length, uint64_t hostNs);
+
+    // Writes the header of the open chunk and flushes, so that a reader
+    // or a crash sees every packet so far.
+    void flush();
+
+    // Finishes the last chunk and writes the index. Called by the
+    // destructor.
+    void close();
+
+    uint64_t packets() const { return packets_; }
+
+private:
+    CaptureWriter(const CaptureWriter &);
+    CaptureWriter &operator=(const CaptureWriter &);
+
+    void writeAt(uint64_t offset, const void *data, size_t length);
+    void writeChunkHeader();
+
+    FILE *file_;
+    std::string path_;
+    CaptureHeader header_;
+    CaptureChunk chunk_;            // The open one
+    uint64_t chunkOffset_;
+    uint64_t packets_;
+    std::vector<CaptureIndexEntry> index_;
+};
+
+// A capture file mapped read only. Packets are used in place.
+class CaptureReader
+{
+public:
+    // Throws std::runtime_error if path is not a capture file.
+    explicit CaptureReader(const std::string &path);
+    ~CaptureReader();
+
+    const CaptureHeader &header() const { return *header_; }
+    std::string serial() const;
+
+    // Whether the file was closed. Without an index the chunks were
+    // found by walking them.
+    bool indexed() const { return header_->indexOffset != 0; }
+
+    size_t chunks() const { return chunks_.size(); }
+    const CaptureChunk &chunk(size_t n) const { return *chunks_[n]; }
+    const uint8_t *chunkPacket(size_t n, uint32_t i) const;
+    uint64_t packets() const { return packets_; }
+
+    // Packet number index of the whole file.
+    const uint8_t *packet(uint64_t index) const;
+
+    // The last chunk that starts at or before host time ns, 0 if none.
+    size_t findChunk(uint64_t ns) const;
+
+private:
+    CaptureReader(const CaptureReader &);
+    CaptureReader &operator=(const CaptureReader &);
+
+    const uint8_t *data_;
+    size_t size_;
+    const CaptureHeader *header_;
+    size_t chunkSize_;
+    std::vector<const CaptureChunk *> chunks_;
+    uint64_t packets_;
+};
+
+} // namespace picusb
+
+#endif // CAPTURE_H
@@ -0,0 +1,236 @@
+/********************************************************************
+ FileName:      filter.cpp
+ Dependencies:  filter.h
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+********************************************************************/
+
+#include "filter.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace picusb {
+
+static const int STREAM_FORMAT_SHIFT = 6;
+static const uint8_t STREAM_COUNT_MASK = 0x3F;
+static const int SIMD_WIDTH = 4;
+
+int decodeStream(const uint8_t *packet, uint16_t *samples)
+{
+    const uint8_t *p = packet + STREAM_HEADER_SIZE;
+    const uint8_t *end = packet + PACKET_SIZE;
+    int count;
+    int group;
+    int i;
+    int j;
+
+    if (packet[0] != CMD_STREAM_START)
+        return 0;
+    count = packet[1] & STREAM_COUNT_MASK;
+
+    if ((packet[1] >> STREAM_FORMAT_SHIFT) == STREAM_FORMAT_PACKED10)
+    {
+        // Groups of 4 low bytes and a byte of their top 2 bits.
+        for (i = 0; i < count; i += group)
+        {
+            group = (count - i < 4) ? count - i : 4;
+            if (p + group >= end)
+                break;
+            for (j = 0; j < group; j++)
+                samples[i + j] = p[j] | (((p[group] >> (j << 1)) & 0x03) << 8);
+            p += group + 1;
+        }
+        return i;
+    }
+
+    for (i = 0; i < count && p + 1 < end; i++, p += 2)
+        samples[i] = p[0] | (p[1] << 8);
+    return i;
+}
+
+std::vector<float> designLowPass(int taps, double cutoff)
+{
+    std::vector<float> h(taps > 0 ? taps : 1, 1.0f);
+    double centre = (taps - 1) / 2.0;
+    double sum = 0;
+    double x;
+    double w;
+    int i;
+
+    if (taps <= 1)
+        return h;
+    for (i = 0; i < taps; i++)
+    {
+        x = i - centre;
+        w = 0.42 - 0.5 * cos(2 * M_PI * i / (taps - 1)) + 0.08 * cos(4 * M_PI * i / (taps - 1));
+        h[i] = (float)(w * ((x == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x)));
+        sum += h[i];
+    }
+    for (i = 0; i < taps; i++)
+        h[i] = (float)(h[i] / sum);
+    return h;
+}
+
+// Sum of a[k] * b[k] for k below n, a multiple of SIMD_WIDTH.
+static float dot(const float *a, const float *b, size_t n)
+{
+#if defined(__SSE__)
+    __m128 acc = _mm_setzero_ps();
+    float lanes[SIMD_WIDTH];
+    size_t k;
+
+    for (k = 0; k < n; k += SIMD_WIDTH)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+    _mm_storeu_ps(lanes, acc);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+    float acc[SIMD_WIDTH] = { 0, 0, 0, 0 };
+    size_t k;
+    int l;
+
+    for (k = 0; k < n; k += SIMD_WIDTH)
+    {
+        for (l = 0; l < SIMD_WIDTH; l++)
+            acc[l] += a[k + l] * b[k + l];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+}
+
+/******************************************************************************
+ * ChannelFilter
+ *****************************************************************************/
+ChannelFilter::ChannelFilter(const std::vector<float> &taps, int decimation,
+                             double dcCutoff)
+    : phase_(0), decimation_(decimation > 1 ? decimation : 1),
+      dcPole_(0), dcInput_(0), dcOutput_(0)
+{
+    size_t length = taps.empty() ? 1 : taps.size();
+    size_t padded = (length + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    size_t k;
+
+    taps_.assign(padded, 0);
+    for (k = 0; k < length; k++)
+        taps_[padded - 1 - k] = taps.empty() ? 1.0f : taps[k];
+    history_.assign(padded - 1 + STREAM_MAX_SAMPLES, 0);
+    if (dcCutoff > 0)
+        dcPole_ = (float)(1 - 2 * M_PI * dcCutoff);
+}
+
+void ChannelFilter::reset()
+{
+    history_.assign(history_.size(), 0);
+    phase_ = 0;
+    dcInput_ = 0;
+    dcOutput_ = 0;
+}
+
+/******************************************************************************
+ * Function:        size_t ChannelFilter::process(float *block, size_t n)
+ *
+ * Overview:        Appends the block to the input history and computes an
+ *                  output at every decimation_-th input, the newest input
+ *                  of its window. The window of output i starts at input
+ *                  i of the history, so the outputs can overwrite the
+ *                  block they came from.
+ *****************************************************************************/
+size_t ChannelFilter::process(float *block, size_t n)
+{
+    size_t keep = taps_.size() - 1;
+    size_t out = 0;
+    size_t i;
+    float y;
+
+    if (history_.size() < keep + n)
+        history_.resize(keep + n);
+    memcpy(&history_[keep], block, n * sizeof(float));
+
+    for (i = phase_; i < n; i += decimation_)
+    {
+        y = dot(&history_[i], &taps_[0], taps_.size());
+        if (dcPole_ != 0)
+        {
+            dcOutput_ = y - dcInput_ + dcPole_ * dcOutput_;
+            dcInput_ = y;
+            y = dcOutput_;
+        }
+        block[out++] = y;
+    }
+    phase_ = i - n;
+
+    memmove(&history_[0], &history_[n], keep * sizeof(float));
+    return out;
+}
+
+/******************************************************************************
+ * StreamFilter
+ *****************************************************************************/
+StreamFilter::StreamFilter(const FilterConfig &config)
+    : config_(config)
+{
+    int decimation = config.decimation > 1 ? config.decimation : 1;
+    int c;
+
+    if (config.taps > 0)
+        taps_ = designLowPass(config.taps, config.cutoff / decimation);
+    for (c = 0; c < STREAM_CHANNELS; c++)
+        filters_.push_back(ChannelFilter(taps_, decimation, config.dcCutoff));
+}
+
+void StreamFilter::reset()
+{
+    size_t c;
+
+    for (c = 0; c < filters_.size(); c++)
+        filters_[c].reset();
+}
+
+bool StreamFilter::process(const uint8_t *packet, const Consumer &consumer)
+{
+    uint16_t samples[STREAM_MAX_SAMPLES];
+    int channels[STREAM_CHANNELS];
+    int channelCount = 0;
+    uint16_t mask;
+    int frames;
+    int count;
+    int c;
+    int f;
+
+    count = decodeStream(packet, samples);
+    if (count == 0)
+        return packet[0] == CMD_STREAM_START;
+
+    mask = packet[2] | (packet[3] << 8);
+    for (c = 0; c < STREAM_CHANNELS; c++)
+    {
+        if (mask & (1 << c))
+            channels[channelCount++] = c;
+    }
+    if (channelCount == 0)
+        return true;
+
+    // Whole frames only, one sample per channel each.
+    frames = count / channelCount;
+    for (c = 0; c < channelCount; c++)
+    {
+        for (f = 0; f < frames; f++)
+            blocks_[c][f] = samples[f * channelCount + c] * config_.scale;
+    }
+    for (c = 0; c < channelCount; c++)
+    {
+        size_t outputs = filters_[channels[c]].process(blocks_[c], frames);
+
+        if (outputs > 0)
+            consumer(channels[c], blocks_[c], outputs);
+    }
+    return true;
+}
+
+} // namespace picusb
@@ -0,0 +1,122 @@
+/********************************************************************
+ FileName:      filter.h
+ Dependencies:  transport.h
+ Compiler:      g++ (C++11), SSE on x86 when the compiler targets it
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ A processing stage for A/D streams that sits between a receive ring
+ and the consumers. StreamFilter takes stream packets as they come out
+ of the ring, splits their frames into one block per channel, scales
+ them to volts and runs each block through that channel's ChannelFilter:
+ FIR low-pass, decimation by an integer factor and DC removal. The
+ blocks are packet sized and filtered in place, so nothing is allocated
+ after construction.
+
+ The FIR only computes the outputs that survive decimation. Its taps
+ are kept reversed and padded to a multiple of four, and each output is
+ one dot product over a contiguous window of the input history, done
+ four products at a time with SSE or in a plain loop the compiler can
+ vectorize on other targets. DC removal is a one pole high-pass on the
+ decimated output.
+********************************************************************/
+
+#ifndef PICUSB_FILTER_H
+#define PICUSB_FILTER_H
+
+#include "transport.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace picusb {
+
+// Most samples one stream packet can announce, the 6 bit count of [1].
+const int STREAM_MAX_SAMPLES = 63;
+const int STREAM_CHANNELS = 16;
+
+// Volts per A/D count with the 5 V supply as reference.
+const float ADC_VOLTS_PER_COUNT = 5.0f / 1024;
+
+// Unpacks the samples of a stream packet, frames interleaved as sent.
+// Returns their number, 0 if packet is not a stream packet.
+int decodeStream(const uint8_t *packet, uint16_t *samples);
+
+// Windowed sinc (Blackman) low-pass with unity gain at DC. cutoff is a
+// fraction of the sample rate, below 0.5.
+std::vector<float> designLowPass(int taps, double cutoff);
+
+// FIR low-pass, decimation and DC removal of one channel.
+class ChannelFilter
+{
+public:
+    // taps may be empty for no FIR. decimation of 1 keeps every sample.
+    // dcCutoff is the corner of the DC removal as a fraction of the
+    // output rate, 0 to keep DC.
+    ChannelFilter(const std::vector<float> &taps, int decimation, double dcCutoff);
+
+    // Filters n samples of block in place. The outputs are written to
+    // the start of block; returns how many there are.
+    size_t process(float *block, size_t n);
+
+    // Forgets the history, eg when the stream restarts.
+    void reset();
+
+private:
+    std::vector<float> taps_;       // Reversed, zero padded at the front
+    std::vector<float> history_;    // taps_.size() - 1 inputs, then a block
+    size_t phase_;                  // Inputs to skip before the next output
+    int decimation_;
+    float dcPole_;
+    float dcInput_;
+    float dcOutput_;
+};
+
+struct FilterConfig
+{
+    FilterConfig()
+        : taps(63), cutoff(0.4), decimation(1), dcCutoff(0), scale(ADC_VOLTS_PER_COUNT)
+    {
+    }
+
+    int taps;           // FIR length, 0 for none
+    double cutoff;      // Of the low-pass, as a fraction of the output rate
+    int decimation;
+    double dcCutoff;    // See ChannelFilter, 0 to keep DC
+    float scale;        // Multiplies the A/D counts
+};
+
+// The stage for one stream. Not thread safe: call process() from the
+// thread that drains the ring.
+class StreamFilter
+{
+public:
+    // Gets the filtered samples of one channel of one packet. They stay
+    // valid until the next process().
+    typedef std::function<void(int channel, const float *samples, size_t count)> Consumer;
+
+    explicit StreamFilter(const FilterConfig &config = FilterConfig());
+
+    // Filters the frames of a stream packet and passes every channel's
+    // block to consumer, lowest channel first. Returns false if packet
+    // is not a stream packet.
+    bool process(const uint8_t *packet, const Consumer &consumer);
+
+    void reset();
+
+private:
+    FilterConfig config_;
+    std::vector<float> taps_;
+    std::vector<ChannelFilter> filters_;        // Indexed by channel
+    float blocks_[STREAM_CHANNELS][STREAM_MAX_SAMPLES];
+};
+
+} // namespace picusb
+
+#endif // PICUSB_FILTER_H
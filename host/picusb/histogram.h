@@ -0,0 +1,135 @@
+/********************************************************************
+ FileName:      histogram.h
+ Dependencies:  None
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Histogram of 64 bit values in the manner of HdrHistogram: values below
+ SUB_BUCKETS are counted exactly, larger ones in buckets that double in
+ width with every power of two, SUB_BUCKETS / 2 of them per power. Every
+ value is kept to within 1/64 (1.6%) of itself over the whole range, in
+ a fixed table of under 4000 counters that recording never resizes.
+
+ Percentiles return the highest value of their bucket, so they never
+ read lower than what was recorded.
+********************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace picusb {
+
+class Histogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 7;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int HALF_BUCKETS = SUB_BUCKETS / 2;
+
+    Histogram()
+        : counts_((64 - SUB_BUCKET_BITS + 2) * HALF_BUCKETS, 0)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        counts_.assign(counts_.size(), 0);
+        count_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+    }
+
+    void record(uint64_t value)
+    {
+        counts_[index(value)]++;
+        count_++;
+        if (value < min_)
+            min_ = value;
+        if (value > max_)
+            max_ = value;
+    }
+
+    // Adds the counts of other.
+    void add(const Histogram &other)
+    {
+        size_t i;
+
+        for (i = 0; i < counts_.size(); i++)
+            counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        if (other.min_ < min_)
+            min_ = other.min_;
+        if (other.max_ > max_)
+            max_ = other.max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+
+    // The value that percent of the recorded values are at or below, eg
+    // percentile(99.9). 0 if nothing was recorded.
+    uint64_t percentile(double percent) const
+    {
+        uint64_t target;
+        uint64_t seen = 0;
+        uint64_t value;
+        size_t i;
+
+        if (count_ == 0)
+            return 0;
+        target = (uint64_t)(percent / 100.0 * count_ + 0.5);
+        if (target < 1)
+            target = 1;
+        if (target > count_)
+            target = count_;
+        for (i = 0; i < counts_.size(); i++)
+        {
+            seen += counts_[i];
+            if (seen >= target)
+                break;
+        }
+        value = highest(i);
+        return (value < max_) ? value : max_;
+    }
+
+private:
+    // Values below SUB_BUCKETS index themselves. Above, shift is the
+    // number of low bits dropped, which leaves a sub bucket in the upper
+    // half of 0..SUB_BUCKETS - 1.
+    static size_t index(uint64_t value)
+    {
+        int shift = 0;
+
+        while ((value >> shift) >= (uint64_t)SUB_BUCKETS)
+            shift++;
+        return (size_t)shift * HALF_BUCKETS + (size_t)(value >> shift);
+    }
+
+    static uint64_t highest(size_t index)
+    {
+        int shift = (index < (size_t)SUB_BUCKETS) ? 0 : (int)(index / HALF_BUCKETS) - 1;
+        uint64_t sub = index - (size_t)shift * HALF_BUCKETS;
+
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+} // namespace picusb
+
+#endif // HISTOGRAM_H
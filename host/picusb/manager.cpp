@@ -0,0 +1,394 @@
+/********************************************************************
+ FileName:      manager.cpp
+ Dependencies:  manager.h
+ Hardware:      PIC18F2550 libUSB devices of the Firmware folder.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+********************************************************************/
+
+#include "manager.h"
+
+#include <algorithm>
+
+namespace picusb {
+
+static double millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+Manager::Manager(Context &ctx)
+    : ctx_(ctx), streaming_(false), ringSlots_(0), queueDepth_(0),
+      alt_(ALT_BULK), hotplug_(false), hotplugHandle_(), hotplugRunning_(false)
+{
+}
+
+Manager::~Manager()
+{
+    closeAll();
+}
+
+/******************************************************************************
+ * Function:        size_t Manager::openAll()
+ *
+ * Overview:        Reads the serial number of every attached board first
+ *                  and claims only the ones not open yet: a second claim
+ *                  of a board that is open here would fail with
+ *                  LIBUSB_ERROR_BUSY anyway. A board that cannot be
+ *                  claimed is skipped, it may belong to another process.
+ *****************************************************************************/
+size_t Manager::openAll()
+{
+    std::vector<libusb_device_handle *> found;
+    std::vector<std::string> serials;
+    size_t opened = 0;
+    size_t i;
+
+    findBoards(ctx_, [&](const std::string &serial, libusb_device_handle *handle) {
+        Board *board = find(serial);
+
+        if ((board != NULL && board->device) ||
+            std::find(serials.begin(), serials.end(), serial) != serials.end())
+            return false;
+        serials.push_back(serial);
+        found.push_back(handle);
+        return true;
+    });
+
+    for (i = 0; i < found.size(); i++)
+    {
+        try
+        {
+            if (attach(Device::claim(ctx_, found[i]), NULL))
+                opened++;
+        }
+        catch (const Error &)
+        {
+        }
+    }
+    return opened;
+}
+
+void Manager::closeAll()
+{
+    disableHotplug();
+    stopStreaming();
+    std::lock_guard<std::mutex> lock(mutex_);
+    boards_.clear();
+}
+
+size_t Manager::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return boards_.size();
+}
+
+std::vector<std::string> Manager::serials() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> result;
+    std::map<std::string, Board>::const_iterator it;
+
+    for (it = boards_.begin(); it != boards_.end(); ++it)
+        result.push_back(it->first);
+    return result;
+}
+
+std::vector<Board *> Manager::boards()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Board *> result;
+    std::map<std::string, Board>::iterator it;
+
+    for (it = boards_.begin(); it != boards_.end(); ++it)
+        result.push_back(&it->second);
+    return result;
+}
+
+Board *Manager::find(const std::string &serial)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Board>::iterator it = boards_.find(serial);
+
+    return (it != boards_.end()) ? &it->second : NULL;
+}
+
+void Manager::writeAll(const uint8_t *data, int length)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Board>::iterator it;
+
+    for (it = boards_.begin(); it != boards_.end(); ++it)
+    {
+        if (it->second.device)
+            it->second.device->write(data, length);
+    }
+}
+
+void Manager::startStreaming(size_t ringSlots, int queueDepth, const CommandList &start,
+                             int alt)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Board>::iterator it;
+
+    streaming_ = true;
+    ringSlots_ = ringSlots;
+    queueDepth_ = queueDepth;
+    alt_ = alt;
+    startCommands_ = start;
+    for (it = boards_.begin(); it != boards_.end(); ++it)
+    {
+        // Detached boards get their ring now too, so that a consumer
+        // never sees Board::ring change under it.
+        if (it->second.device)
+            it->second.device->stopStreaming();
+        it->second.ring.reset(new PacketRing(ringSlots));
+        if (it->second.device)
+            startDevice(it->second, *it->second.device);
+    }
+}
+
+void Manager::stopStreaming()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Board>::iterator it;
+
+    streaming_ = false;
+    for (it = boards_.begin(); it != boards_.end(); ++it)
+    {
+        if (it->second.device)
+            it->second.device->stopStreaming();
+    }
+}
+
+// Selects the alternate setting, starts receiving into the board's ring
+// and sends the start commands. A reattached board comes back in the
+// default setting, so the setting is always selected again. Called with
+// mutex_ held.
+void Manager::startDevice(Board &board, Device &device)
+{
+    size_t i;
+
+    device.setAltSetting(alt_);
+    device.startStreaming(*board.ring, queueDepth_);
+    for (i = 0; i < startCommands_.size(); i++)
+        device.write(startCommands_[i].data(), (int)startCommands_[i].size());
+}
+
+/******************************************************************************
+ * Function:        bool Manager::attach(std::unique_ptr<Device> device,
+ *                                       const Clock::time_point *arrived)
+ *
+ * Overview:        Takes over a claimed device as the board of its serial
+ *                  number and restarts streaming on it if the manager is
+ *                  streaming. A board seen before counts as reattached,
+ *                  timed from arrived, the hotplug event, if given. A new
+ *                  board is set up completely before it is added, so
+ *                  boards() never returns one that is half done.
+ *
+ * Output:          false if that board is attached already.
+ *****************************************************************************/
+bool Manager::attach(std::unique_ptr<Device> device, const Clock::time_point *arrived)
+{
+    std::map<std::string, Board>::iterator it;
+    ReattachCallback reattached;
+    Board added;
+    Board *board;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        it = boards_.find(device->serial());
+        board = (it != boards_.end()) ? &it->second : &added;
+        if (board->device)
+            return false;
+        if (board == &added)
+        {
+            added.serial = device->serial();
+            added.reattach = ReattachStats();
+            if (streaming_)
+                added.ring.reset(new PacketRing(ringSlots_));
+        }
+        if (streaming_)
+        {
+            try
+            {
+                startDevice(*board, *device);
+            }
+            catch (const Error &)
+            {
+                // Gone again already, the next arrival retries.
+                return false;
+            }
+        }
+        board->device = std::move(device);
+        if (board == &added)
+        {
+            boards_[added.serial] = std::move(added);
+            return true;
+        }
+        if (arrived == NULL)
+            return true;
+
+        board->reattach.count++;
+        board->reattach.lastMs = millisecondsSince(*arrived);
+        if (board->reattach.lastMs > board->reattach.maxMs)
+            board->reattach.maxMs = board->reattach.lastMs;
+        board->reattach.lastOutageMs = millisecondsSince(board->left);
+        reattached = reattached_;
+    }
+
+    if (reattached)
+        reattached(*board);
+    return true;
+}
+
+/******************************************************************************
+ * Hotplug
+ *
+ * The libusb callback runs on the event thread, where no synchronous
+ * transfer may be made, so it only queues the event. The hotplug thread
+ * then opens, claims and restarts the boards.
+ *****************************************************************************/
+bool Manager::enableHotplug(ReattachCallback reattached)
+{
+    int rc;
+
+    if (hotplug_)
+        return true;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return false;
+
+    reattached_ = reattached;
+    hotplugRunning_ = true;
+    hotplugThread_ = std::thread(&Manager::hotplugLoop, this);
+    rc = libusb_hotplug_register_callback(ctx_.get(),
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_NO_FLAGS, VENDOR_ID, PRODUCT_ID,
+            LIBUSB_HOTPLUG_MATCH_ANY, &Manager::hotplugCallback, this,
+            &hotplugHandle_);
+    if (rc < 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex_);
+            hotplugRunning_ = false;
+        }
+        queued_.notify_all();
+        hotplugThread_.join();
+        throw Error("libusb_hotplug_register_callback", rc);
+    }
+    hotplug_ = true;
+    return true;
+}
+
+void Manager::disableHotplug()
+{
+    if (!hotplug_)
+        return;
+    hotplug_ = false;
+    libusb_hotplug_deregister_callback(ctx_.get(), hotplugHandle_);
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        hotplugRunning_ = false;
+    }
+    queued_.notify_all();
+    hotplugThread_.join();
+
+    while (!queue_.empty())
+    {
+        libusb_unref_device(queue_.front().device);
+        queue_.pop_front();
+    }
+}
+
+int LIBUSB_CALL Manager::hotplugCallback(libusb_context *, libusb_device *device,
+                                         libusb_hotplug_event event, void *user)
+{
+    Manager *manager = static_cast<Manager *>(user);
+    HotplugEvent e;
+
+    e.device = libusb_ref_device(device);
+    e.event = event;
+    e.time = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(manager->queueMutex_);
+        manager->queue_.push_back(e);
+    }
+    manager->queued_.notify_one();
+    return 0;                           // Stay registered
+}
+
+void Manager::hotplugLoop()
+{
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    HotplugEvent e;
+
+    for (;;)
+    {
+        while (hotplugRunning_ && queue_.empty())
+            queued_.wait(lock);
+        if (!hotplugRunning_)
+            break;
+        e = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+
+        if (e.event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+            arrived(e);
+        else
+            left(e);
+        libusb_unref_device(e.device);
+
+        lock.lock();
+    }
+}
+
+void Manager::arrived(const HotplugEvent &e)
+{
+    libusb_device_handle *handle;
+    Board *board;
+
+    if (libusb_open(e.device, &handle) < 0)
+        return;
+    board = find(readSerial(handle));
+    if (board != NULL && board->device)
+    {
+        libusb_close(handle);
+        return;
+    }
+    try
+    {
+        attach(Device::claim(ctx_, handle), &e.time);
+    }
+    catch (const Error &)
+    {
+    }
+}
+
+// Closes the board whose device left. Its transfers come back with
+// LIBUSB_TRANSFER_NO_DEVICE, so closing it does not block for long.
+void Manager::left(const HotplugEvent &e)
+{
+    std::unique_ptr<Device> gone;
+    std::map<std::string, Board>::iterator it;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (it = boards_.begin(); it != boards_.end(); ++it)
+        {
+            if (it->second.device &&
+                libusb_get_device(it->second.device->handle()) == e.device)
+            {
+                gone = std::move(it->second.device);
+                it->second.left = e.time;
+                break;
+            }
+        }
+    }
+}
+
+} // namespace picusb
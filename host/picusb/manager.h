@@ -0,0 +1,161 @@
+/********************************************************************
+ FileName:      manager.h
+ Dependencies:  picusb.h
+ Hardware:      PIC18F2550 libUSB devices of the Firmware folder, each
+                programmed with its own serial number.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Opens every attached board and keeps them by serial number, so one
+ process can run all the boards of a test station. All boards share the
+ event thread of one Context. While streaming, every board receives into
+ its own PacketRing, so a slow consumer of one board never holds up the
+ others.
+
+ With hotplug enabled, libusb reports boards arriving and leaving,
+ filtered on VENDOR_ID/PRODUCT_ID, so the bus never has to be rescanned.
+ A board that leaves keeps its entry and its ring; when it comes back it
+ is claimed again and, if the manager is streaming, restarted with the
+ same ring, queue depth, alternate setting and start commands. The time this takes is
+ recorded in the board's ReattachStats.
+
+ Boards that still have the default serial number all look the same;
+ only the first one found of each serial number is opened. Give every
+ board its own number with host/serial_number.py.
+********************************************************************/
+
+#ifndef PICUSB_MANAGER_H
+#define PICUSB_MANAGER_H
+
+#include "picusb.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace picusb {
+
+typedef std::chrono::steady_clock Clock;
+
+// Commands sent to a board to start it, eg CMD_SCAN_LIST and
+// CMD_STREAM_START, each one packet.
+typedef std::vector<std::vector<uint8_t> > CommandList;
+
+struct ReattachStats
+{
+    unsigned count;         // Times the board came back
+    double lastMs;          // Arrival to streaming again, last time
+    double maxMs;           // Same, worst case
+    double lastOutageMs;    // Removal to streaming again, last time
+};
+
+struct Board
+{
+    std::string serial;
+    std::unique_ptr<PacketRing> ring;   // Only once streaming started
+    std::unique_ptr<Device> device;     // NULL while detached. Destroyed
+                                        // before its ring.
+    Clock::time_point left;             // When it was last detached
+    ReattachStats reattach;
+};
+
+class Manager
+{
+public:
+    // Called on the hotplug thread after a board has been reattached.
+    typedef std::function<void(const Board &board)> ReattachCallback;
+
+    explicit Manager(Context &ctx);
+    ~Manager();
+
+    // Opens every attached board that is not open yet. Returns how many
+    // were opened. Throws Error if the device list cannot be read.
+    size_t openAll();
+
+    // Registers for hotplug events and starts the thread that opens and
+    // closes boards as they come and go. Returns false if libusb has no
+    // hotplug support on this platform.
+    bool enableHotplug(ReattachCallback reattached = ReattachCallback());
+    void disableHotplug();
+
+    // Stops and closes every board.
+    void closeAll();
+
+    size_t size() const;
+
+    // Serial numbers of the known boards, in order.
+    std::vector<std::string> serials() const;
+
+    // The known boards, in order of serial number. The pointers stay
+    // valid until closeAll(), so a consumer can keep them while hotplug
+    // adds boards. Board::device changes on the hotplug thread; use it
+    // only while hotplug is off or through writeAll().
+    std::vector<Board *> boards();
+
+    // The board with this serial number, or NULL.
+    Board *find(const std::string &serial);
+
+    // Sends the same command to every attached board. Throws Error.
+    void writeAll(const uint8_t *data, int length);
+
+    // Gives every board a PacketRing of ringSlots packets, selects the
+    // alternate setting alt, starts receiving into the ring and then
+    // sends the start commands. Boards that attach later while streaming
+    // get the same. Throws Error if a board refuses alt.
+    void startStreaming(size_t ringSlots, int queueDepth = 8,
+                        const CommandList &start = CommandList(),
+                        int alt = ALT_BULK);
+
+    // Stops receiving on every board. The rings are kept until the next
+    // startStreaming() so that they can still be drained.
+    void stopStreaming();
+
+private:
+    Manager(const Manager &);
+    Manager &operator=(const Manager &);
+
+    struct HotplugEvent
+    {
+        libusb_device *device;          // Referenced until handled
+        libusb_hotplug_event event;
+        Clock::time_point time;
+    };
+
+    static int LIBUSB_CALL hotplugCallback(libusb_context *ctx, libusb_device *device,
+                                           libusb_hotplug_event event, void *user);
+    void hotplugLoop();
+    void arrived(const HotplugEvent &e);
+    void left(const HotplugEvent &e);
+    bool attach(std::unique_ptr<Device> device, const Clock::time_point *arrived);
+    void startDevice(Board &board, Device &device);
+
+    Context &ctx_;
+    mutable std::mutex mutex_;          // Guards all below but the queue
+    std::map<std::string, Board> boards_;
+    bool streaming_;
+    size_t ringSlots_;
+    int queueDepth_;
+    int alt_;
+    CommandList startCommands_;
+
+    bool hotplug_;
+    libusb_hotplug_callback_handle hotplugHandle_;
+    ReattachCallback reattached_;
+    std::thread hotplugThread_;
+    std::mutex queueMutex_;             // Guards queue_ and hotplugRunning_
+    std::condition_variable queued_;
+    std::deque<HotplugEvent> queue_;
+    bool hotplugRunning_;
+};
+
+} // namespace picusb
+
+#endif // PICUSB_MANAGER_H
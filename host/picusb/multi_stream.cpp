@@ -0,0 +1,252 @@
+/********************************************************************
+ FileName:      multi_stream.cpp
+ Dependencies:  manager.h, capture.h, filter.h
+ Hardware:      PIC18F2550 libUSB devices of the Firmware folder, each
+                programmed with its own serial number.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Streams A/D samples from every attached board at once, all on the
+ event thread of one Context, and prints the sample rate and drops of
+ each board. One consumer thread drains the rings of all boards.
+
+ Boards are watched with hotplug. One that is unplugged and plugged in
+ again during the run is restarted with the same settings, the
+ alternate setting of -i included, and the time that took is printed
+ then and in the summary.
+
+ With -o the consumer also writes the packets of each board to its own
+ capture file, prefix-serial.cap, as they leave the ring. With -d the
+ consumer runs them through a StreamFilter per board, low-pass and
+ decimation by the factor given, and prints the filtered rate and the
+ mean of each channel in volts.
+
+ Usage: multi_stream [-s seconds] [-p period] [-c channels] [-r slots]
+                     [-o prefix] [-d decimation] [-i]
+   -s   Seconds to stream, default 3
+   -p   Stream period in 12 MHz ticks, default 240 (50 kS/s per frame)
+   -c   Comma separated A/D channels, default 0
+   -r   PacketRing slots per board, default 1024
+   -o   Write every board's packets to prefix-serial.cap
+   -d   Filter and decimate by this factor, default no filtering
+   -i   Stream on the isochronous endpoint (ALT_ISO)
+********************************************************************/
+
+#include "capture.h"
+#include "filter.h"
+#include "manager.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace picusb;
+
+static std::vector<int> parseList(const char *text)
+{
+    std::vector<int> values;
+    const char *p = text;
+
+    while (*p)
+    {
+        values.push_back(atoi(p));
+        p = strchr(p, ',');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return values;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> channels = parseList("0");
+    int seconds = 3;
+    int period = 240;
+    int ringSlots = 1024;
+    std::string prefix;
+    int decimation = 0;
+    bool iso = false;
+    int i;
+    size_t c;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-i") == 0)
+            iso = true;
+        else if (i + 1 == argc)
+            break;
+        else if (strcmp(argv[i], "-s") == 0)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0)
+            period = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0)
+            channels = parseList(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0)
+            ringSlots = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0)
+            prefix = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0)
+            decimation = atoi(argv[++i]);
+    }
+
+    try
+    {
+        Context ctx;
+        Manager boards(ctx);
+        std::map<Board *, uint64_t> samples;    // Consumer thread only
+        std::map<Board *, std::unique_ptr<CaptureWriter> > captures;
+        std::map<Board *, std::unique_ptr<StreamFilter> > filters;
+        std::map<Board *, std::map<int, std::pair<uint64_t, double> > > filtered;
+        FilterConfig config;
+        std::atomic<bool> draining(true);
+        std::thread consumer;
+        std::vector<Board *> list;
+        std::vector<uint8_t> scan;
+        std::vector<uint8_t> start;
+        CommandList commands;
+        uint8_t cmd[PACKET_SIZE];
+        size_t b;
+
+        if (boards.openAll() == 0)
+        {
+            fprintf(stderr, "No boards found\n");
+            return 1;
+        }
+
+        scan.push_back(CMD_SCAN_LIST);
+        scan.push_back((uint8_t)channels.size());
+        for (c = 0; c < channels.size(); c++)
+            scan.push_back((uint8_t)channels[c]);
+        start.push_back(CMD_STREAM_START);
+        start.push_back(STREAM_CHANNEL_SCAN_LIST);
+        start.push_back((uint8_t)period);
+        start.push_back((uint8_t)(period >> 8));
+        start.push_back(STREAM_FORMAT_PACKED10);
+        commands.push_back(scan);
+        commands.push_back(start);
+
+        // Files for boards that only show up later are opened by the
+        // consumer.
+        list = boards.boards();
+        for (b = 0; b < list.size() && !prefix.empty(); b++)
+            captures[list[b]].reset(new CaptureWriter(prefix + "-" + list[b]->serial +
+                                                      ".cap", list[b]->serial));
+
+        // Only stream packets reach the rings, anything that comes on
+        // the reply endpoint is dropped. A reattached board is put back
+        // in the same alternate setting before the commands are sent.
+        boards.startStreaming(ringSlots, 8, commands, iso ? ALT_ISO : ALT_BULK);
+        if (!boards.enableHotplug([](const Board &board) {
+                printf("%s reattached in %.1f ms, %.1f ms after it left\n",
+                       board.serial.c_str(), board.reattach.lastMs,
+                       board.reattach.lastOutageMs);
+            }))
+            fprintf(stderr, "No hotplug support, boards will not be reattached\n");
+
+        config.decimation = decimation;
+
+        consumer = std::thread([&]() {
+            const uint8_t *packet;
+            std::vector<Board *> current;
+            bool idle;
+            size_t n;
+
+            do
+            {
+                idle = true;
+                current = boards.boards();
+                for (n = 0; n < current.size(); n++)
+                {
+                    PacketRing *ring = current[n]->ring.get();
+                    std::unique_ptr<CaptureWriter> &capture = captures[current[n]];
+                    std::unique_ptr<StreamFilter> &filter = filters[current[n]];
+                    std::map<int, std::pair<uint64_t, double> > &sums = filtered[current[n]];
+
+                    if (!prefix.empty() && !capture)
+                        capture.reset(new CaptureWriter(prefix + "-" + current[n]->serial +
+                                                        ".cap", current[n]->serial));
+                    if (decimation > 0 && !filter)
+                        filter.reset(new StreamFilter(config));
+                    while ((packet = ring->front()) != NULL)
+                    {
+                        if (capture)
+                            capture->append(packet);
+                        if (filter)
+                        {
+                            filter->process(packet, [&](int channel, const float *volts,
+                                                        size_t count) {
+                                std::pair<uint64_t, double> &sum = sums[channel];
+                                size_t k;
+
+                                sum.first += count;
+                                for (k = 0; k < count; k++)
+                                    sum.second += volts[k];
+                            });
+                        }
+                        if (packet[0] == CMD_STREAM_START)
+                            samples[current[n]] += packet[1] & 0x3F;
+                        ring->pop();
+                        idle = false;
+                    }
+                }
+                if (idle)
+                    std::this_thread::yield();
+            } while (draining || !idle);
+        });
+
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        boards.disableHotplug();
+        cmd[0] = CMD_STREAM_STOP;
+        boards.writeAll(cmd, 1);
+        boards.stopStreaming();
+        draining = false;
+        consumer.join();
+        captures.clear();
+
+        printf("%-10s %12s %8s %10s %10s %10s\n", "serial", "samples/s",
+               "dropped", "reattach", "last ms", "max ms");
+        list = boards.boards();
+        for (b = 0; b < list.size(); b++)
+        {
+            printf("%-10s %12.0f %8llu %10u %10.1f %10.1f\n",
+                   list[b]->serial.c_str(),
+                   (double)samples[list[b]] / seconds,
+                   (unsigned long long)list[b]->ring->dropped(),
+                   list[b]->reattach.count, list[b]->reattach.lastMs,
+                   list[b]->reattach.maxMs);
+        }
+
+        for (b = 0; b < list.size() && decimation > 0; b++)
+        {
+            std::map<int, std::pair<uint64_t, double> > &sums = filtered[list[b]];
+            std::map<int, std::pair<uint64_t, double> >::const_iterator sum;
+
+            for (sum = sums.begin(); sum != sums.end(); ++sum)
+            {
+                printf("%-10s AN%-2d %10.0f filtered samples/s, mean %.4f V\n",
+                       list[b]->serial.c_str(), sum->first,
+                       (double)sum->second.first / seconds,
+                       sum->second.first ? sum->second.second / sum->second.first : 0.0);
+            }
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
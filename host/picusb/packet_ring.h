@@ -0,0 +1,195 @@
+/********************************************************************
+ FileName:      packet_ring.h
+ Dependencies:  None
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Fixed capacity single producer, single consumer ring of 64 byte packet
+ slots. Every slot is one cache aligned line and the producer and
+ consumer indices live on cache lines of their own, so the two threads
+ only share a line when one of them reads the other's index. Nothing is
+ allocated after construction and no locks are taken.
+
+ The producer, the USB event thread, reserves slots ahead of time and
+ hands them to libusb as transfer buffers, so packets land in the ring
+ in place. USB transfers on one endpoint complete in the order they
+ were submitted, so reserved slots are committed in the same order.
+********************************************************************/
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace picusb {
+
+const size_t CACHE_LINE_SIZE = 64;
+const size_t RING_SLOT_SIZE = 64;   // One full speed bulk packet
+
+class PacketRing
+{
+public:
+    // capacity is rounded up to a power of two.
+    explicit PacketRing(size_t capacity)
+        : slots_(NULL), reserved_(0), tailCache_(0), dropped_(0), headCache_(0)
+    {
+        void *memory;
+
+        capacity_ = 1;
+        while (capacity_ < capacity)
+            capacity_ <<= 1;
+        mask_ = capacity_ - 1;
+        if (posix_memalign(&memory, CACHE_LINE_SIZE, capacity_ * RING_SLOT_SIZE) != 0)
+            throw std::bad_alloc();
+        slots_ = static_cast<uint8_t *>(memory);
+        memset(slots_, 0, capacity_ * RING_SLOT_SIZE);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    ~PacketRing()
+    {
+        free(slots_);
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    // Packets ready for the consumer. Exact only on the consumer thread.
+    size_t size() const
+    {
+        return head_.load(std::memory_order_acquire) -
+               tail_.load(std::memory_order_acquire);
+    }
+
+    // Packets the producer could not store because the ring was full.
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    /* Producer side ********************************************************/
+
+    // Returns the next free slot and keeps it for the producer, or NULL if
+    // every slot is either full or already reserved.
+    uint8_t *reserve()
+    {
+        if (reserved_ - tailCache_ >= capacity_)
+        {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (reserved_ - tailCache_ >= capacity_)
+                return NULL;
+        }
+        return slot(reserved_++);
+    }
+
+    // Hands the oldest reserved slot to the consumer.
+    void commit()
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    // Gives back the slot the last reserve() returned, before it is used.
+    void unreserve()
+    {
+        reserved_--;
+    }
+
+    // Gives back every reserved slot that was not committed.
+    void cancelReservations()
+    {
+        reserved_ = head_.load(std::memory_order_relaxed);
+    }
+
+    // Copies length bytes into the next slot and commits it. Counts a drop
+    // and returns false if the ring is full. Not for use while slots are
+    // reserved.
+    bool push(const uint8_t *data, size_t length)
+    {
+        uint8_t *p = reserve();
+
+        if (p == NULL)
+        {
+            countDrop();
+            return false;
+        }
+        if (length > RING_SLOT_SIZE)
+            length = RING_SLOT_SIZE;
+        memcpy(p, data, length);
+        memset(p + length, 0, RING_SLOT_SIZE - length);
+        commit();
+        return true;
+    }
+
+    void countDrop()
+    {
+        dropped_.store(dropped_.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+    }
+
+    /* Consumer side ********************************************************/
+
+    // The oldest packet, or NULL if the ring is empty. It stays valid
+    // until pop().
+    const uint8_t *front()
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+
+        if (tail == headCache_)
+        {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (tail == headCache_)
+                return NULL;
+        }
+        return slot(tail);
+    }
+
+    void pop()
+    {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+private:
+    PacketRing(const PacketRing &);
+    PacketRing &operator=(const PacketRing &);
+
+    uint8_t *slot(size_t index) const
+    {
+        return slots_ + (index & mask_) * RING_SLOT_SIZE;
+    }
+
+    // The groups below are a cache line apart, so that they never share
+    // one however the object itself is aligned.
+
+    // Read only after construction.
+    uint8_t *slots_;
+    size_t capacity_;
+    size_t mask_;
+    char pad0_[CACHE_LINE_SIZE];
+
+    std::atomic<size_t> head_;      // Next slot to commit, written by the producer
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail_;      // Next slot to read, written by the consumer
+    char pad2_[CACHE_LINE_SIZE];
+
+    // Producer only.
+    size_t reserved_;
+    size_t tailCache_;              // Last tail_ seen by the producer
+    std::atomic<uint64_t> dropped_;
+    char pad3_[CACHE_LINE_SIZE];
+
+    // Consumer only.
+    size_t headCache_;
+};
+
+} // namespace picusb
+
+#endif // PACKET_RING_H
@@ -0,0 +1,657 @@
+/********************************************************************
+ FileName:      picusb.cpp
+ Dependencies:  picusb.h
+ Hardware:      PIC18F2550 libUSB device of the Firmware folder.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+********************************************************************/
+
+#include "picusb.h"
+
+#include <cstring>
+
+namespace picusb {
+
+// Error codes from libusb are thrown as they are.
+static_assert(ERROR_IO == LIBUSB_ERROR_IO &&
+              ERROR_INVALID_PARAM == LIBUSB_ERROR_INVALID_PARAM &&
+              ERROR_ACCESS == LIBUSB_ERROR_ACCESS &&
+              ERROR_NO_DEVICE == LIBUSB_ERROR_NO_DEVICE &&
+              ERROR_NOT_FOUND == LIBUSB_ERROR_NOT_FOUND &&
+              ERROR_BUSY == LIBUSB_ERROR_BUSY &&
+              ERROR_TIMEOUT == LIBUSB_ERROR_TIMEOUT &&
+              ERROR_OVERFLOW == LIBUSB_ERROR_OVERFLOW &&
+              ERROR_PIPE == LIBUSB_ERROR_PIPE &&
+              ERROR_INTERRUPTED == LIBUSB_ERROR_INTERRUPTED &&
+              ERROR_NO_MEM == LIBUSB_ERROR_NO_MEM &&
+              ERROR_NOT_SUPPORTED == LIBUSB_ERROR_NOT_SUPPORTED &&
+              ERROR_OTHER == LIBUSB_ERROR_OTHER,
+              "ERROR_xxx must match LIBUSB_ERROR_xxx");
+
+// How long the event thread blocks in libusb before it checks whether it
+// should stop.
+static const int EVENT_TIMEOUT_US = 100000;
+
+static void check(int rc, const char *what)
+{
+    if (rc < 0)
+        throw Error(what, rc);
+}
+
+static int bulkRead(libusb_device_handle *handle, unsigned char endpoint,
+                    uint8_t *packet, unsigned timeoutMs)
+{
+    int transferred = 0;
+    int rc;
+
+    rc = libusb_bulk_transfer(handle, endpoint, packet, PACKET_SIZE,
+                              &transferred, timeoutMs);
+    if (rc == LIBUSB_ERROR_TIMEOUT)
+        return 0;
+    check(rc, "IN transfer");
+    return transferred;
+}
+
+/******************************************************************************
+ * Context
+ *****************************************************************************/
+Context::Context()
+    : ctx_(NULL), running_(true)
+{
+    check(libusb_init(&ctx_), "libusb_init");
+    thread_ = std::thread(&Context::eventLoop, this);
+}
+
+Context::~Context()
+{
+    running_ = false;
+    thread_.join();
+    libusb_exit(ctx_);
+}
+
+void Context::eventLoop()
+{
+    timeval tv;
+
+    while (running_)
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = EVENT_TIMEOUT_US;
+        libusb_handle_events_timeout_completed(ctx_, &tv, NULL);
+    }
+}
+
+/******************************************************************************
+ * Function:        void findBoards(Context &ctx, const BoardCallback &found)
+ *
+ * Overview:        Opens every attached device with VENDOR_ID/PRODUCT_ID in
+ *                  turn and passes it to found with its serial number.
+ *                  Devices that cannot be opened, eg because another
+ *                  process has them, are skipped.
+ *****************************************************************************/
+void findBoards(Context &ctx, const BoardCallback &found)
+{
+    libusb_device **list;
+    libusb_device_descriptor desc;
+    libusb_device_handle *handle;
+    ssize_t count;
+    ssize_t i;
+
+    count = libusb_get_device_list(ctx.get(), &list);
+    check((int)count, "libusb_get_device_list");
+    try
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+                desc.idVendor != VENDOR_ID || desc.idProduct != PRODUCT_ID)
+                continue;
+            if (libusb_open(list[i], &handle) < 0)
+                continue;
+            if (!found(readSerial(handle), handle))
+                libusb_close(handle);
+        }
+    }
+    catch (...)
+    {
+        libusb_free_device_list(list, 1);
+        throw;
+    }
+    libusb_free_device_list(list, 1);
+}
+
+std::string readSerial(libusb_device_handle *handle)
+{
+    libusb_device_descriptor desc;
+    unsigned char text[64];
+    int length;
+
+    if (libusb_get_device_descriptor(libusb_get_device(handle), &desc) < 0 ||
+        desc.iSerialNumber == 0)
+        return std::string();
+    length = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                                text, sizeof(text));
+    if (length < 0)
+        return std::string();
+    return std::string(reinterpret_cast<char *>(text), length);
+}
+
+/******************************************************************************
+ * Device
+ *****************************************************************************/
+std::unique_ptr<Device> Device::open(Context &ctx)
+{
+    libusb_device_handle *handle;
+
+    handle = libusb_open_device_with_vid_pid(ctx.get(), VENDOR_ID, PRODUCT_ID);
+    if (handle == NULL)
+        throw Error("No device", LIBUSB_ERROR_NO_DEVICE);
+    return claim(ctx, handle);
+}
+
+std::unique_ptr<Device> Device::open(Context &ctx, const std::string &serial)
+{
+    libusb_device_handle *handle = NULL;
+
+    findBoards(ctx, [&](const std::string &s, libusb_device_handle *h) {
+        if (handle != NULL || s != serial)
+            return false;
+        handle = h;
+        return true;
+    });
+    if (handle == NULL)
+        throw Error("No device " + serial, LIBUSB_ERROR_NO_DEVICE);
+    return claim(ctx, handle);
+}
+
+std::unique_ptr<Device> Device::claim(Context &ctx, libusb_device_handle *handle)
+{
+    int rc;
+
+    rc = libusb_set_configuration(handle, 1);
+    if (rc == 0)
+        rc = libusb_claim_interface(handle, 0);
+    if (rc < 0)
+    {
+        libusb_close(handle);
+        throw Error("Claim failed", rc);
+    }
+    return std::unique_ptr<Device>(new Device(ctx, handle));
+}
+
+Device::Device(Context &ctx, libusb_device_handle *handle)
+    : ctx_(ctx), handle_(handle), serial_(readSerial(handle)), ring_(NULL), alt_(ALT_BULK),
+      streaming_(false), disconnected_(false),
+      inFlight_(0), packets_(0), bytes_(0), errors_(0), isoEmpty_(0), isoErrors_(0)
+{
+}
+
+Device::~Device()
+{
+    stopStreaming();
+    libusb_release_interface(handle_, 0);
+    libusb_close(handle_);
+}
+
+void Device::write(const uint8_t *data, int length, unsigned timeoutMs)
+{
+    uint8_t packet[PACKET_SIZE];
+    int transferred;
+
+    if (length > PACKET_SIZE)
+        throw Error("Packet too long", LIBUSB_ERROR_INVALID_PARAM);
+    memset(packet, 0, sizeof(packet));
+    memcpy(packet, data, length);
+    check(libusb_bulk_transfer(handle_, EP_OUT, packet, PACKET_SIZE,
+                               &transferred, timeoutMs), "OUT transfer");
+}
+
+int Device::read(uint8_t *packet, unsigned timeoutMs)
+{
+    return bulkRead(handle_, EP_IN, packet, timeoutMs);
+}
+
+int Device::readStream(uint8_t *packet, unsigned timeoutMs)
+{
+    if (alt_ == ALT_ISO)
+        throw Error("EP_STREAM is isochronous", LIBUSB_ERROR_NOT_SUPPORTED);
+    return bulkRead(handle_, EP_STREAM, packet, timeoutMs);
+}
+
+int Device::waitEvents(Event *events, unsigned timeoutMs)
+{
+    uint8_t packet[EVENT_PACKET_SIZE];
+    int transferred = 0;
+    int rc;
+
+    if (alt_ == ALT_BULK)
+        throw Error("No EP_EVENT in ALT_BULK", LIBUSB_ERROR_NOT_SUPPORTED);
+    rc = libusb_interrupt_transfer(handle_, EP_EVENT, packet, sizeof(packet),
+                                   &transferred, timeoutMs);
+    if (rc == LIBUSB_ERROR_TIMEOUT)
+        return 0;
+    check(rc, "Event transfer");
+    return decodeEvents(packet, transferred, events);
+}
+
+int Device::controlIn(uint8_t request, uint16_t value, uint16_t index,
+                      uint8_t *data, int length, unsigned timeoutMs)
+{
+    int rc;
+
+    rc = libusb_control_transfer(handle_,
+                                 LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR |
+                                 LIBUSB_RECIPIENT_DEVICE,
+                                 request, value, index, data, (uint16_t)length, timeoutMs);
+    check(rc, "Vendor request");
+    return rc;
+}
+
+void Device::controlOut(uint8_t request, uint16_t value, uint16_t index,
+                        const uint8_t *data, int length, unsigned timeoutMs)
+{
+    int rc;
+
+    rc = libusb_control_transfer(handle_,
+                                 LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
+                                 LIBUSB_RECIPIENT_DEVICE,
+                                 request, value, index, const_cast<uint8_t *>(data),
+                                 (uint16_t)length, timeoutMs);
+    check(rc, "Vendor request");
+}
+
+void Device::setAltSetting(int alt)
+{
+    if (!transfers_.empty())
+        throw Error("Alternate setting while streaming", LIBUSB_ERROR_BUSY);
+    check(libusb_set_interface_alt_setting(handle_, 0, alt), "SET_INTERFACE");
+    alt_ = alt;
+}
+
+/******************************************************************************
+ * Function:        void Device::startStreaming(PacketCallback callback,
+ *                                              int queueDepth)
+ *
+ * Overview:        Allocates queueDepth EP_STREAM transfers and
+ *                  REPLY_TRANSFERS EP_IN transfers with their buffers in
+ *                  one block and submits all of them. Each one is
+ *                  resubmitted from inComplete() as soon as its packet has
+ *                  been handed on, so up to queueDepth stream packets can
+ *                  arrive back to back without waiting for the host, and
+ *                  a reply never waits for one of them. In ALT_ISO an
+ *                  EP_STREAM transfer covers ISO_TRANSFER_PACKETS frames
+ *                  and its buffer as many packets.
+ *****************************************************************************/
+void Device::startStreaming(PacketCallback callback, int queueDepth)
+{
+    stopStreaming();
+    callback_ = callback;
+    ring_ = NULL;
+    submitTransfers(queueDepth);
+}
+
+void Device::startStreaming(PacketRing &ring, int queueDepth)
+{
+    stopStreaming();
+    callback_ = PacketCallback();
+    ring_ = &ring;
+    submitTransfers(queueDepth);
+}
+
+void Device::submitTransfers(int queueDepth)
+{
+    InTransfer *in;
+    int isoPackets = (alt_ == ALT_ISO) ? ISO_TRANSFER_PACKETS : 0;
+    int streamSize = (alt_ == ALT_ISO) ? ISO_TRANSFER_PACKETS * PACKET_SIZE : PACKET_SIZE;
+    int count;
+    int i;
+    int rc;
+
+    if (queueDepth < 1)
+        queueDepth = 1;
+    count = queueDepth + REPLY_TRANSFERS;
+
+    buffers_.assign(queueDepth * streamSize + REPLY_TRANSFERS * PACKET_SIZE, 0);
+    transfers_.resize(count);
+    for (i = 0; i < count; i++)
+    {
+        in = &transfers_[i];
+        in->device = this;
+        in->endpoint = (i < queueDepth) ? EP_STREAM : EP_IN;
+        in->spare = (i < queueDepth) ? &buffers_[i * streamSize] :
+            &buffers_[queueDepth * streamSize + (i - queueDepth) * PACKET_SIZE];
+        in->transfer = libusb_alloc_transfer(in->endpoint == EP_STREAM ? isoPackets : 0);
+        if (in->transfer == NULL)
+        {
+            freeTransfers();
+            throw Error("libusb_alloc_transfer", LIBUSB_ERROR_NO_MEM);
+        }
+        // No timeout: the stream may pause for as long as it likes.
+        if (in->endpoint == EP_STREAM && isoPackets > 0)
+        {
+            libusb_fill_iso_transfer(in->transfer, handle_, in->endpoint,
+                                     in->spare, streamSize, isoPackets,
+                                     &Device::inCallback, in, 0);
+            libusb_set_iso_packet_lengths(in->transfer, PACKET_SIZE);
+        }
+        else
+        {
+            libusb_fill_bulk_transfer(in->transfer, handle_, in->endpoint,
+                                      nextBuffer(in), PACKET_SIZE,
+                                      &Device::inCallback, in, 0);
+        }
+    }
+
+    streaming_ = true;
+    for (i = 0; i < count; i++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            inFlight_++;
+        }
+        rc = libusb_submit_transfer(transfers_[i].transfer);
+        if (rc < 0)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                inFlight_--;
+            }
+            stopStreaming();
+            throw Error("libusb_submit_transfer", rc);
+        }
+    }
+}
+
+void Device::stopStreaming()
+{
+    size_t i;
+
+    if (transfers_.empty())
+        return;
+
+    streaming_ = false;
+    for (i = 0; i < transfers_.size(); i++)
+    {
+        if (transfers_[i].transfer != NULL)
+            libusb_cancel_transfer(transfers_[i].transfer);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (inFlight_ > 0)
+            idle_.wait(lock);
+    }
+    freeTransfers();
+    requests_.failAll(disconnected_ ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_INTERRUPTED);
+}
+
+void Device::freeTransfers()
+{
+    size_t i;
+
+    for (i = 0; i < transfers_.size(); i++)
+        libusb_free_transfer(transfers_[i].transfer);
+    transfers_.clear();
+    if (ring_ != NULL)
+        ring_->cancelReservations();
+}
+
+Stats Device::stats() const
+{
+    Stats s;
+
+    s.packets = packets_;
+    s.bytes = bytes_;
+    s.errors = errors_;
+    s.isoEmpty = isoEmpty_;
+    s.isoErrors = isoErrors_;
+    return s;
+}
+
+// A ring slot if one is free, else the transfer's own buffer. Only the
+// bulk stream endpoint receives into the ring.
+uint8_t *Device::nextBuffer(InTransfer *in)
+{
+    uint8_t *slot = NULL;
+
+    if (ring_ != NULL && in->endpoint == EP_STREAM && alt_ != ALT_ISO)
+        slot = ring_->reserve();
+    return (slot != NULL) ? slot : in->spare;
+}
+
+void LIBUSB_CALL Device::inCallback(libusb_transfer *transfer)
+{
+    InTransfer *in = static_cast<InTransfer *>(transfer->user_data);
+
+    in->device->inComplete(in);
+}
+
+/******************************************************************************
+ * Function:        void Device::inComplete(InTransfer *in)
+ *
+ * Overview:        Runs on the event thread for every IN transfer that
+ *                  comes back. An EP_IN packet goes to its request, or
+ *                  to the callback if there is no ring. An EP_STREAM
+ *                  packet in a ring slot is committed where it is, one in
+ *                  the spare buffer means the ring was full and it is
+ *                  dropped. The slot of a transfer that came back is
+ *                  always the oldest reservation, since the stream
+ *                  transfers complete in order, so it is committed even
+ *                  when the transfer failed, zeroed, or the next commit
+ *                  would hand out the wrong slot. A fresh slot that
+ *                  cannot be submitted is given straight back, so the
+ *                  ring never keeps a reservation no transfer holds. An
+ *                  isochronous transfer goes to isoComplete().
+ *****************************************************************************/
+void Device::inComplete(InTransfer *in)
+{
+    libusb_transfer *transfer = in->transfer;
+    bool reserved = false;
+    int length = 0;
+
+    switch (transfer->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        if (!streaming_)
+            break;
+        if (transfer->num_iso_packets > 0)
+        {
+            isoComplete(transfer);
+            break;
+        }
+        if (transfer->actual_length <= 0)
+            break;
+        length = transfer->actual_length;
+        packets_++;
+        bytes_ += length;
+        if (in->endpoint == EP_IN)
+        {
+            if (!requests_.complete(transfer->buffer, length) &&
+                ring_ == NULL && callback_)
+                callback_(transfer->buffer, length);
+            break;
+        }
+        if (ring_ == NULL)
+        {
+            if (callback_)
+                callback_(transfer->buffer, length);
+        }
+        else if (transfer->buffer == in->spare)
+        {
+            ring_->countDrop();
+        }
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        disconnected_ = true;
+        streaming_ = false;
+        requests_.failAll(LIBUSB_ERROR_NO_DEVICE);
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        break;
+    default:
+        errors_++;
+        break;
+    }
+
+    if (ring_ != NULL && streaming_ && in->endpoint == EP_STREAM)
+    {
+        if (transfer->buffer != in->spare)
+        {
+            memset(transfer->buffer + length, 0, PACKET_SIZE - length);
+            ring_->commit();
+        }
+        transfer->buffer = nextBuffer(in);
+        reserved = (transfer->buffer != in->spare);
+    }
+
+    if (streaming_ && libusb_submit_transfer(transfer) == 0)
+        return;
+    if (reserved)
+    {
+        ring_->unreserve();
+        transfer->buffer = in->spare;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--inFlight_ == 0)
+        idle_.notify_all();
+}
+
+/******************************************************************************
+ * Function:        void Device::isoComplete(libusb_transfer *transfer)
+ *
+ * Overview:        Hands on the packets of an isochronous transfer, one
+ *                  per frame, each by its own status. A frame in which the
+ *                  device had nothing armed comes back empty and one that
+ *                  failed, eg with a CRC error, is lost, since isochronous
+ *                  packets are not retried; both are counted and the
+ *                  stream goes on. No ring slots are reserved in ALT_ISO,
+ *                  so the packets can be pushed into the ring.
+ *****************************************************************************/
+void Device::isoComplete(libusb_transfer *transfer)
+{
+    libusb_iso_packet_descriptor *desc;
+    uint8_t *packet;
+    int i;
+
+    for (i = 0; i < transfer->num_iso_packets; i++)
+    {
+        desc = &transfer->iso_packet_desc[i];
+        if (desc->status != LIBUSB_TRANSFER_COMPLETED)
+        {
+            isoErrors_++;
+            continue;
+        }
+        if (desc->actual_length == 0)
+        {
+            isoEmpty_++;
+            continue;
+        }
+        packet = libusb_get_iso_packet_buffer_simple(transfer, i);
+        packets_++;
+        bytes_ += desc->actual_length;
+        if (ring_ != NULL)
+            ring_->push(packet, desc->actual_length);
+        else if (callback_)
+            callback_(packet, desc->actual_length);
+    }
+}
+
+/******************************************************************************
+ * Function:        std::future<Reply> Device::request(const uint8_t *data,
+ *                                                     int length)
+ *
+ * Overview:        Takes the next free tag, sends the command behind the
+ *                  tag header in an asynchronous OUT transfer of its own
+ *                  and leaves the promise for the tag to inComplete(). The
+ *                  OUT transfers queue in the host controller, so several
+ *                  commands can go out in one frame.
+ *****************************************************************************/
+std::future<Reply> Device::request(const uint8_t *data, int length)
+{
+    std::future<Reply> reply;
+    OutRequest *out;
+    int rc;
+
+    if (length > PACKET_SIZE - TAG_HEADER_SIZE)
+        throw Error("Packet too long", LIBUSB_ERROR_INVALID_PARAM);
+    if (disconnected_)
+        throw Error("Request", LIBUSB_ERROR_NO_DEVICE);
+    if (transfers_.empty())
+        startStreaming(PacketCallback());
+
+    out = new OutRequest;
+    out->device = this;
+    out->transfer = libusb_alloc_transfer(0);
+    if (out->transfer == NULL)
+    {
+        delete out;
+        throw Error("libusb_alloc_transfer", LIBUSB_ERROR_NO_MEM);
+    }
+
+    try
+    {
+        reply = requests_.add(out->tag);
+    }
+    catch (...)
+    {
+        libusb_free_transfer(out->transfer);
+        delete out;
+        throw;
+    }
+
+    memset(out->buffer, 0, sizeof(out->buffer));
+    out->buffer[0] = CMD_TAGGED;
+    out->buffer[1] = out->tag;
+    memcpy(out->buffer + TAG_HEADER_SIZE, data, length);
+    libusb_fill_bulk_transfer(out->transfer, handle_, EP_OUT, out->buffer,
+                              PACKET_SIZE, &Device::outCallback, out, 1000);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        inFlight_++;
+    }
+    rc = libusb_submit_transfer(out->transfer);
+    if (rc < 0)
+    {
+        out->transfer->status = LIBUSB_TRANSFER_ERROR;
+        requests_.fail(out->tag, rc);
+        outComplete(out);
+    }
+    return reply;
+}
+
+void LIBUSB_CALL Device::outCallback(libusb_transfer *transfer)
+{
+    OutRequest *out = static_cast<OutRequest *>(transfer->user_data);
+
+    out->device->outComplete(out);
+}
+
+void Device::outComplete(OutRequest *out)
+{
+    switch (out->transfer->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        requests_.fail(out->tag, LIBUSB_ERROR_NO_DEVICE);
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        requests_.fail(out->tag, LIBUSB_ERROR_TIMEOUT);
+        break;
+    default:
+        requests_.fail(out->tag, LIBUSB_ERROR_IO);
+        break;
+    }
+    libusb_free_transfer(out->transfer);
+    delete out;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--inFlight_ == 0)
+        idle_.notify_all();
+}
+
+} // namespace picusb
@@ -0,0 +1,246 @@
+/********************************************************************
+ FileName:      picusb.h
+ Dependencies:  libusb-1.0, transport.h
+ Hardware:      PIC18F2550 libUSB device of the Firmware folder,
+                VID 0x04D8, PID 0x0204.
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ Host library for the PIC18F2550 libUSB device. A Context owns the
+ libusb context and one thread that handles all libusb events, shared by
+ every Device opened on it. A Device is the Transport (transport.h) of
+ a board: it sends commands on EP1 OUT and, while streaming, keeps a
+ configurable number of asynchronous IN transfers submitted on the
+ stream endpoint, EP2 IN, so the host controller always has a buffer
+ ready for the next packet. Every stream packet received is either
+ handed to a callback on the event thread or received straight into a
+ PacketRing that another thread drains.
+
+ Device::request() sends a tagged command (CMD_TAGGED) without waiting
+ and returns a future for the reply. The firmware echoes the tag, so any
+ number of commands can be in flight and their replies are matched by
+ tag as they come in on the REPLY_TRANSFERS transfers kept on EP1 IN.
+ The stream never holds them up, however deep its queue.
+
+ In ALT_ISO the stream transfers are isochronous, ISO_TRANSFER_PACKETS
+ frames each. Every packet of such a transfer has a status of its own;
+ the good ones are handed on like bulk packets, empty and failed ones
+ are counted in Stats.
+
+ Device::waitEvents() reads the interrupt endpoint EP3 IN, which is in
+ ALT_ISO and ALT_BULK_EVENTS, with a synchronous transfer, which the
+ host controller polls every frame until the device has an event, so a
+ thread can block on pin changes and button presses without sending
+ any command.
+
+ controlIn() and controlOut() send vendor requests to the device on
+ EP0 with synchronous control transfers.
+
+ See ReadMe.txt for building.
+********************************************************************/
+
+#ifndef PICUSB_H
+#define PICUSB_H
+
+#include <libusb-1.0/libusb.h>
+
+#include "transport.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+
+namespace picusb {
+
+const uint16_t VENDOR_ID = 0x04D8;
+const uint16_t PRODUCT_ID = 0x0204;
+
+const unsigned char EP_OUT = 0x01;
+const unsigned char EP_IN = 0x81;
+const unsigned char EP_STREAM = 0x82;
+const unsigned char EP_EVENT = 0x83;
+const int ISO_TRANSFER_PACKETS = 8;     // Frames per EP_STREAM transfer in ALT_ISO
+const int SERIAL_LENGTH = 8;    // Characters in the serial number string
+
+// libusb context plus the thread that handles its events. All transfer
+// callbacks run on that thread.
+class Context
+{
+public:
+    Context();
+    ~Context();
+
+    libusb_context *get() const { return ctx_; }
+
+private:
+    Context(const Context &);
+    Context &operator=(const Context &);
+
+    void eventLoop();
+
+    libusb_context *ctx_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+};
+
+// Called by findBoards() for every attached board with its serial number
+// and a handle opened on it. Returns true to keep the handle, which it
+// then owns, or false to have it closed.
+typedef std::function<bool(const std::string &serial,
+                           libusb_device_handle *handle)> BoardCallback;
+
+void findBoards(Context &ctx, const BoardCallback &found);
+
+// Serial number string of an opened board, empty if it has none.
+std::string readSerial(libusb_device_handle *handle);
+
+// Transport over libusb. Packet callbacks run on the event thread.
+class Device : public Transport
+{
+public:
+    // Opens the first device with VENDOR_ID/PRODUCT_ID and claims
+    // interface 0. Throws Error if there is none.
+    static std::unique_ptr<Device> open(Context &ctx);
+
+    // Opens the board with this serial number. Throws Error if there is
+    // none.
+    static std::unique_ptr<Device> open(Context &ctx, const std::string &serial);
+
+    // Selects configuration 1, claims interface 0 and takes over the
+    // handle. Closes it and throws Error if that fails.
+    static std::unique_ptr<Device> claim(Context &ctx, libusb_device_handle *handle);
+
+    // Takes over an opened handle whose interface is claimed.
+    Device(Context &ctx, libusb_device_handle *handle);
+    ~Device();
+
+    // Sends one command packet, padded to PACKET_SIZE. Throws Error.
+    void write(const uint8_t *data, int length, unsigned timeoutMs = 1000);
+
+    // Reads one packet from EP_IN. Only while not streaming. Returns the
+    // length, 0 on timeout. Throws Error.
+    int read(uint8_t *packet, unsigned timeoutMs = 1000);
+
+    // Same from EP_STREAM, not in ALT_ISO.
+    int readStream(uint8_t *packet, unsigned timeoutMs = 1000);
+
+    // Waits for a packet on EP_EVENT, streaming or not, and decodes its
+    // records into events. Returns their number, 0 on timeout. Not in
+    // ALT_BULK, which has no EP_EVENT. Throws Error.
+    int waitEvents(Event *events, unsigned timeoutMs = 1000);
+
+    // Vendor requests to the device on EP0, streaming or not. Throws
+    // Error.
+    int controlIn(uint8_t request, uint16_t value, uint16_t index,
+                  uint8_t *data, int length, unsigned timeoutMs = 1000);
+    void controlOut(uint8_t request, uint16_t value, uint16_t index,
+                    const uint8_t *data = NULL, int length = 0,
+                    unsigned timeoutMs = 1000);
+
+    // Sends SET_INTERFACE for ALT_BULK, ALT_ISO or ALT_BULK_EVENTS. Not
+    // while streaming.
+    // Throws Error.
+    void setAltSetting(int alt);
+    int altSetting() const { return alt_; }
+
+    // Keeps queueDepth IN transfers submitted on EP_STREAM and
+    // REPLY_TRANSFERS on EP_IN and passes every packet but the replies
+    // of request() to callback until stopStreaming(). The device has to
+    // be told to send with a command, eg CMD_STREAM_START.
+    void startStreaming(PacketCallback callback, int queueDepth = 8);
+
+    // Same, but the EP_STREAM transfers read straight into slots
+    // reserved in ring, which the caller drains from any one thread.
+    // In ALT_ISO they read into their own buffers and the packets are
+    // copied into ring. Packets that arrive while the ring is full are
+    // counted in ring.dropped(). EP_IN packets that are not replies are
+    // dropped.
+    void startStreaming(PacketRing &ring, int queueDepth = 8);
+
+    // Cancels the IN transfers and waits until all of them are back.
+    // Requests still waiting for their reply fail.
+    void stopStreaming();
+
+    // Sends a command of up to PACKET_SIZE - TAG_HEADER_SIZE bytes with
+    // the next free tag and returns at once. The future gets the reply
+    // or throws Error if the device is gone, the command could not be
+    // sent or streaming is stopped before the reply came. The tag of a
+    // command that could not be sent stays in use for TAG_RETIRE_MS in
+    // case the board got it after all. Replies come in on the EP_IN transfers of
+    // startStreaming(), which is called without a callback if it was
+    // not; read() cannot be used then. Throws Error if all tags are
+    // in use.
+    std::future<Reply> request(const uint8_t *data, int length);
+
+    bool streaming() const { return streaming_; }
+    bool disconnected() const { return disconnected_; }
+    Stats stats() const;
+
+    const std::string &serial() const { return serial_; }
+    libusb_device_handle *handle() const { return handle_; }
+
+private:
+    Device(const Device &);
+    Device &operator=(const Device &);
+
+    // One queued IN transfer. spare is its own buffer, used when there is
+    // no ring, the ring is full or it is on EP_IN.
+    struct InTransfer
+    {
+        Device *device;
+        libusb_transfer *transfer;
+        unsigned char endpoint;
+        uint8_t *spare;
+    };
+
+    // One request() on its way out.
+    struct OutRequest
+    {
+        Device *device;
+        libusb_transfer *transfer;
+        uint8_t tag;
+        uint8_t buffer[PACKET_SIZE];
+    };
+
+    void submitTransfers(int queueDepth);
+    static void LIBUSB_CALL inCallback(libusb_transfer *transfer);
+    void inComplete(InTransfer *in);
+    void isoComplete(libusb_transfer *transfer);
+    uint8_t *nextBuffer(InTransfer *in);
+    void freeTransfers();
+    static void LIBUSB_CALL outCallback(libusb_transfer *transfer);
+    void outComplete(OutRequest *out);
+
+    Context &ctx_;
+    libusb_device_handle *handle_;
+    std::string serial_;
+    PacketCallback callback_;
+    PacketRing *ring_;
+    int alt_;                               // ALT_xxx
+    std::vector<InTransfer> transfers_;     // Not resized while streaming
+    std::vector<uint8_t> buffers_;
+
+    std::atomic<bool> streaming_;
+    std::atomic<bool> disconnected_;
+    int inFlight_;                  // IN and request transfers, guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable idle_;  // inFlight_ dropped to 0
+
+    RequestTable requests_;
+
+    std::atomic<uint64_t> packets_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<uint64_t> isoEmpty_;
+    std::atomic<uint64_t> isoErrors_;
+};
+
+} // namespace picusb
+
+#endif // PICUSB_H
@@ -0,0 +1,1727 @@
+/********************************************************************
+ FileName:      standin.cpp
+ Dependencies:  standin.h
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+********************************************************************/
+
+#include "standin.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace picusb {
+
+// Constants of Firmware/main.c
+static const uint32_t FCY = 12000000;                   // Timer1 and Timer3 ticks per second
+static const int STREAM_PAYLOAD_SIZE = PACKET_SIZE - STREAM_HEADER_SIZE;
+static const int STREAM_RAW16_SAMPLES = STREAM_PAYLOAD_SIZE / 2;
+static const int STREAM_PACKED10_SAMPLES = (STREAM_PAYLOAD_SIZE / 5) * 4 +
+    ((STREAM_PAYLOAD_SIZE % 5 > 1) ? STREAM_PAYLOAD_SIZE % 5 - 1 : 0);
+static const uint32_t STREAM_DEFAULT_PERIOD = 1200;
+static const uint32_t STREAM_MIN_PERIOD = 240;
+static const int STREAM_FORMAT_SHIFT = 6;
+static const uint32_t STREAM_FRAME_TICKS = FCY / 1000;
+static const uint16_t SCAN_VALID_MASK = 0x0F1F;
+static const uint16_t ADC_CONVERSION_CYCLES = (2 + 11) * 16;
+static const uint16_t ADC_ONE_SHOT_FAILED = 0xFFFF;
+static const int PORT_SNAPSHOT_PORT = 1;
+static const int PORT_SNAPSHOT_LAT = 4;
+static const int PORT_SNAPSHOT_TRIS = 7;
+static const int EVENT_DEBOUNCE_FRAMES = 8;
+
+// Device time a slot of a full speed frame takes, one 64 byte packet
+// with its token, handshake and gaps.
+static const uint32_t SLOT_TICKS = FCY / 1000 / StandIn::FRAME_PACKETS;
+
+// Constants of Firmware/application.c
+static const int APP_CMD_SIZE = 5;
+static const int APP_MAX_BATCH = 12;
+static const int APP_REPLY_HEADER = 2;
+static const int APP_PWM_STEPS = 100;
+static const uint32_t APP_PWM_STEP_TICKS = FCY / 5000;  // 200 us
+
+// The A/D input: a sine of 50 Hz times channel + 1 around mid scale.
+static const double SIGNAL_HZ = 50.0;
+static const double TWO_PI = 6.283185307179586;
+
+// The EUSART receive FIFO. Characters past it are lost, as after an
+// overrun on the board.
+static const size_t UART_FIFO_SIZE = 2;
+
+StandIn::StandIn(int framePackets)
+    : framePackets_(framePackets), start_(Clock::now()),
+      outQueued_(0), outSent_(0), readBuffer_(NULL), readStreamBuffer_(NULL),
+      eventReadBuffer_(NULL), eventReadLength_(0), control_(NULL),
+      inPerFrame_(1), ring_(NULL),
+      running_(true), streaming_(false), altSetting_(ALT_BULK), pushbutton_(false),
+      frames_(0), packets_(0), bytes_(0), isoEmpty_(0),
+      outFull_(false), outTagged_(false), outTag_(0),
+      inBufferNext_(0), inBufferOnBus_(0), replyTagged_(false),
+      streamBufferNext_(0), streamBufferOnBus_(0), streamIso_(false),
+      eventBufferNext_(0), eventBufferOnBus_(0), eventEndpoint_(false),
+      sofFrame_(0), sofTime_(0), slot_(0),
+      streamEnabled_(false), streamHead_(0), streamTail_(0),
+      streamStampHead_(0), streamStampTail_(0), streamPacketFill_(0),
+      streamPacketSamples_(STREAM_RAW16_SAMPLES), streamFormat_(STREAM_FORMAT_RAW16),
+      streamOverruns_(0), streamPeriod_(STREAM_DEFAULT_PERIOD), streamTrigger_(0),
+      scanMask_(0x0001), scanCount_(1), adcConversions_(0),
+      adcOneShotPending_(false), adcOneShotFailed_(false), adcOneShotChannel_(0), adcOneShotStamp_(0),
+      adcOneShotTagged_(false), adcOneShotTag_(0),
+      eventLost_(0), eventPinMask_(EVENT_PIN_MASK), eventPortB_(0),
+      eventThresholdChannel_(EVENT_THRESHOLD_OFF), eventThresholdLow_(0),
+      eventThresholdHigh_(0), eventThresholdAbove_(false),
+      buttonState_(0), buttonSteady_(0), buttonFrame_(0),
+      vendorPending_(false), vendorRequest_(0), vendorValue_(0), vendorIndex_(0),
+      taskStatsStart_(0),
+      pcfg_(0x0D), pwmEnabled_(0), uartTx_(false), uartRx_(false)
+{
+    int i;
+
+    for (i = 0; i < APP_NUM_PORTS; i++)
+    {
+        pins_[i] = 0;
+        tris_[i] = 0xFF;
+        lat_[i] = 0;
+    }
+    // mInitAllLEDs(): LATB0..3 are outputs, driven low. sw3 on RB5 has
+    // a pull up, like sw2.
+    tris_[1] = 0xF0;
+    pins_[1] = 0x20;
+    memset(inBuffers_, 0, sizeof(inBuffers_));
+    memset(inArmed_, 0, sizeof(inArmed_));
+    memset(streamBuffers_, 0, sizeof(streamBuffers_));
+    memset(streamArmed_, 0, sizeof(streamArmed_));
+    memset(eventBuffers_, 0, sizeof(eventBuffers_));
+    memset(eventLengths_, 0, sizeof(eventLengths_));
+    memset(outPacket_, 0, sizeof(outPacket_));
+    memset(pwmDuty_, 0, sizeof(pwmDuty_));
+    memset(vendorData_, 0, sizeof(vendorData_));
+    inPacket_ = inBuffers_[0];
+    scanChannels_[0] = 0;
+    eventPortB_ = port(1);
+
+    // SchedulerInit(), less the tasks of what the model leaves out.
+    taskRegister(TASK_ID_STREAM_ALT, &StandIn::streamAltTask, TASK_PRIORITY_HIGH);
+    taskRegister(TASK_ID_VENDOR, &StandIn::vendorTask, TASK_PRIORITY_HIGH);
+    taskRegister(TASK_ID_COMMANDS, &StandIn::commandTask, TASK_PRIORITY_NORMAL);
+    taskRegister(TASK_ID_ADC_ONE_SHOT, &StandIn::adcOneShotTask, TASK_PRIORITY_NORMAL);
+    taskRegister(TASK_ID_STREAM, &StandIn::streamTask, TASK_PRIORITY_NORMAL);
+    taskRegister(TASK_ID_EVENT, &StandIn::eventTask, TASK_PRIORITY_NORMAL);
+    taskRegister(TASK_ID_BUTTON, &StandIn::buttonTask, TASK_PRIORITY_LOW);
+
+    thread_ = std::thread(&StandIn::frameLoop, this);
+}
+
+StandIn::~StandIn()
+{
+    running_ = false;
+    thread_.join();
+    stopStreaming();
+}
+
+/******************************************************************************
+ * Host side
+ *****************************************************************************/
+void StandIn::write(const uint8_t *data, int length, unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    std::deque<OutPacket>::iterator i;
+    uint64_t seq;
+
+    if (length > PACKET_SIZE)
+        throw Error("Packet too long", ERROR_INVALID_PARAM);
+    queueOut(data, length, false, 0, seq);
+    while (outSent_ < seq)
+    {
+        if (changed_.wait_until(lock, deadline) == std::cv_status::timeout &&
+            outSent_ < seq)
+        {
+            // Cancelled, like a timed out libusb transfer.
+            for (i = hostOut_.begin(); i != hostOut_.end(); ++i)
+            {
+                if (i->seq == seq)
+                {
+                    hostOut_.erase(i);
+                    break;
+                }
+            }
+            throw Error("OUT transfer", ERROR_TIMEOUT);
+        }
+    }
+}
+
+int StandIn::read(uint8_t *packet, unsigned timeoutMs)
+{
+    return readFrom(readBuffer_, packet, timeoutMs);
+}
+
+int StandIn::readStream(uint8_t *packet, unsigned timeoutMs)
+{
+    if (altSetting() == ALT_ISO)
+        throw Error("Stream endpoint is isochronous", ERROR_NOT_SUPPORTED);
+    return readFrom(readStreamBuffer_, packet, timeoutMs);
+}
+
+// Unlike read(), also while streaming: the event endpoint is only ever
+// read here.
+int StandIn::waitEvents(Event *events, unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    uint8_t packet[EVENT_PACKET_SIZE];
+
+    if (altSetting() == ALT_BULK)
+        throw Error("No event endpoint in ALT_BULK", ERROR_NOT_SUPPORTED);
+
+    eventReadBuffer_ = packet;
+    while (eventReadBuffer_ != NULL)
+    {
+        if (changed_.wait_until(lock, deadline) == std::cv_status::timeout &&
+            eventReadBuffer_ != NULL)
+        {
+            eventReadBuffer_ = NULL;
+            return 0;
+        }
+    }
+    return decodeEvents(packet, eventReadLength_, events);
+}
+
+int StandIn::controlIn(uint8_t request, uint16_t value, uint16_t index,
+                       uint8_t *data, int length, unsigned timeoutMs)
+{
+    ControlTransfer transfer = { true, request, value, index, data, length, false, false, 0 };
+
+    return control(transfer, timeoutMs);
+}
+
+void StandIn::controlOut(uint8_t request, uint16_t value, uint16_t index,
+                         const uint8_t *data, int length, unsigned timeoutMs)
+{
+    ControlTransfer transfer = { false, request, value, index,
+                                 const_cast<uint8_t *>(data), length, false, false, 0 };
+
+    control(transfer, timeoutMs);
+}
+
+// Waits for controlTransaction() and vendorTask() to complete transfer.
+// One at a time, like the default control pipe.
+int StandIn::control(ControlTransfer &transfer, unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    if (control_ != NULL)
+        throw Error("Control transfer", ERROR_BUSY);
+    transfer.setup = false;
+    transfer.done = false;
+    control_ = &transfer;
+    while (!transfer.done)
+    {
+        if (changed_.wait_until(lock, deadline) == std::cv_status::timeout &&
+            !transfer.done)
+        {
+            control_ = NULL;
+            throw Error("Control transfer", ERROR_TIMEOUT);
+        }
+    }
+    control_ = NULL;
+    if (transfer.result < 0)
+        throw Error("Control transfer", transfer.result);
+    return transfer.result;
+}
+
+void StandIn::setAltSetting(int alt)
+{
+    if (streaming_)
+        throw Error("Alternate setting while streaming", ERROR_BUSY);
+    if (alt != ALT_BULK && alt != ALT_ISO && alt != ALT_BULK_EVENTS)
+        throw Error("SET_INTERFACE", ERROR_PIPE);
+    altSetting_ = alt;
+}
+
+// Waits for endpointIn() to fill packet through buffer, readBuffer_ or
+// readStreamBuffer_.
+int StandIn::readFrom(uint8_t *&buffer, uint8_t *packet, unsigned timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    if (streaming_)
+        throw Error("IN transfer", ERROR_BUSY);
+    buffer = packet;
+    while (buffer != NULL)
+    {
+        if (changed_.wait_until(lock, deadline) == std::cv_status::timeout &&
+            buffer != NULL)
+        {
+            buffer = NULL;
+            return 0;
+        }
+    }
+    return PACKET_SIZE;
+}
+
+void StandIn::startStreaming(PacketCallback callback, int queueDepth)
+{
+    stopStreaming();
+    std::lock_guard<std::mutex> deliverLock(deliverMutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    callback_ = callback;
+    ring_ = NULL;
+    inPerFrame_ = std::max(queueDepth, 1);
+    streaming_ = true;
+}
+
+void StandIn::startStreaming(PacketRing &ring, int queueDepth)
+{
+    stopStreaming();
+    std::lock_guard<std::mutex> deliverLock(deliverMutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    callback_ = PacketCallback();
+    ring_ = &ring;
+    inPerFrame_ = std::max(queueDepth, 1);
+    streaming_ = true;
+}
+
+void StandIn::stopStreaming()
+{
+    {
+        std::lock_guard<std::mutex> deliverLock(deliverMutex_);
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        streaming_ = false;
+        callback_ = PacketCallback();
+        ring_ = NULL;
+    }
+    requests_.failAll(ERROR_INTERRUPTED);
+}
+
+std::future<Reply> StandIn::request(const uint8_t *data, int length)
+{
+    std::future<Reply> reply;
+    uint8_t tag;
+    uint64_t seq;
+
+    if (length > PACKET_SIZE - TAG_HEADER_SIZE)
+        throw Error("Packet too long", ERROR_INVALID_PARAM);
+    if (!streaming_)
+        startStreaming(PacketCallback());
+
+    reply = requests_.add(tag);
+    std::lock_guard<std::mutex> lock(mutex_);
+    queueOut(data, length, true, tag, seq);
+    return reply;
+}
+
+Stats StandIn::stats() const
+{
+    Stats s;
+
+    s.packets = packets_;
+    s.bytes = bytes_;
+    s.errors = 0;
+    s.isoEmpty = isoEmpty_;
+    s.isoErrors = 0;
+    return s;
+}
+
+void StandIn::setPushbutton(bool pressed)
+{
+    pushbutton_ = pressed;
+}
+
+void StandIn::setPins(int port, uint8_t levels)
+{
+    if (port >= 0 && port < APP_NUM_PORTS)
+        pins_[port] = levels;
+}
+
+// With mutex_ held.
+void StandIn::queueOut(const uint8_t *data, int length, bool tagged, uint8_t tag,
+                       uint64_t &seq)
+{
+    OutPacket out;
+    int offset = 0;
+
+    memset(out.data, 0, sizeof(out.data));
+    if (tagged)
+    {
+        out.data[0] = CMD_TAGGED;
+        out.data[1] = tag;
+        offset = TAG_HEADER_SIZE;
+    }
+    memcpy(out.data + offset, data, length);
+    out.seq = seq = ++outQueued_;
+    hostOut_.push_back(out);
+}
+
+// Device time at the last SOF, from the wall clock.
+uint32_t StandIn::sofClock() const
+{
+    return (uint32_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start_).count() * (FCY / 1000000) / 1000);
+}
+
+// Device time, Timer3 of the firmware: the SOF plus the slots of the
+// frame that went by.
+uint32_t StandIn::now() const
+{
+    return sofTime_ + (uint32_t)slot_ * SLOT_TICKS;
+}
+
+uint16_t StandIn::convert(uint8_t channel, uint32_t time) const
+{
+    double t = (double)time / FCY;
+    double v = 511.5 + 511.5 * sin(TWO_PI * SIGNAL_HZ * (channel + 1) * t);
+
+    return (uint16_t)lround(v);
+}
+
+/******************************************************************************
+ * Function:        void StandIn::frameLoop()
+ *
+ * Overview:        One pass per 1 ms frame. After the SOF the frame is
+ *                  split into framePackets slots of SLOT_TICKS device
+ *                  time. In each the device runs its ProcessIO(), as the
+ *                  main loop of the firmware does many times per packet,
+ *                  then an OUT or an IN transaction takes the slot, the
+ *                  two taking turns and the IN transactions taking turns
+ *                  between the reply and the stream endpoint, or it
+ *                  passes with the host polling and the device NAKing. So a reply that is ready
+ *                  within the frame still goes out in it. The IN packets
+ *                  of the frame are handed over once the frame is done,
+ *                  outside mutex_, so a callback may call request(). A
+ *                  frame the thread overslept is skipped, not caught up
+ *                  with.
+ *****************************************************************************/
+void StandIn::frameLoop()
+{
+    Clock::time_point next = Clock::now();
+    std::vector<InPacket> packets;
+    bool outTurn = true;
+    bool streamTurn = true;
+    bool moved;
+    int counts[2];                      // Replies, stream packets
+    size_t i;
+
+    while (running_)
+    {
+        next += std::chrono::microseconds(FRAME_US);
+        std::this_thread::sleep_until(next);
+        if (Clock::now() - next > std::chrono::microseconds(FRAME_US))
+            next = Clock::now();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            sofFrame_ = (uint16_t)(++frames_ & 0x7FF);
+            sofTime_ = sofClock();
+            counts[0] = 0;
+            counts[1] = 0;
+            for (slot_ = 0; slot_ < framePackets_; slot_++)
+            {
+                processIO();
+                if (slot_ == 0)
+                {
+                    eventTransaction();
+                    controlTransaction();
+                }
+                if (slot_ == 0 && streamIso_)
+                {
+                    isoTransaction();
+                    continue;
+                }
+                if (outTurn)
+                    moved = outTransaction() || inTransaction(streamTurn, counts);
+                else
+                    moved = inTransaction(streamTurn, counts) || outTransaction();
+                if (moved)
+                    outTurn = !outTurn;
+            }
+            processIO();
+            packets.swap(delivered_);
+            delivered_.clear();
+        }
+
+        if (packets.empty())
+            continue;
+        std::lock_guard<std::mutex> deliverLock(deliverMutex_);
+        for (i = 0; i < packets.size(); i++)
+            deliver(packets[i]);
+    }
+}
+
+// The host has an OUT packet and the OUT endpoint is armed.
+bool StandIn::outTransaction()
+{
+    if (outFull_ || hostOut_.empty())
+        return false;
+
+    memcpy(outPacket_, hostOut_.front().data, PACKET_SIZE);
+    outSent_ = hostOut_.front().seq;
+    hostOut_.pop_front();
+    outFull_ = true;
+    changed_.notify_all();
+    return true;
+}
+
+// An IN transaction on the endpoint whose turn it is, else on the other
+// one. counts[] are the packets of the frame of each endpoint.
+bool StandIn::inTransaction(bool &streamTurn, int *counts)
+{
+    bool stream = streamTurn;
+
+    if (!endpointIn(stream, counts[stream]))
+    {
+        stream = !stream;
+        if (!endpointIn(stream, counts[stream]))
+            return false;
+    }
+    streamTurn = !stream;
+    return true;
+}
+
+// The host has an IN transfer waiting on the reply or the stream
+// endpoint and the device an armed buffer there.
+bool StandIn::endpointIn(bool stream, int &count)
+{
+    uint8_t *&readBuffer = stream ? readStreamBuffer_ : readBuffer_;
+    bool *armed = stream ? streamArmed_ : inArmed_;
+    int &onBus = stream ? streamBufferOnBus_ : inBufferOnBus_;
+    uint8_t *packet = stream ? streamBuffers_[onBus] : inBuffers_[onBus];
+    InPacket in;
+
+    if (stream && streamIso_)
+        return false;
+    if (!armed[onBus])
+        return false;
+    if (readBuffer != NULL)
+    {
+        memcpy(readBuffer, packet, PACKET_SIZE);
+        readBuffer = NULL;
+        changed_.notify_all();
+    }
+    else if (streaming_ && count < (stream ? inPerFrame_ : REPLY_TRANSFERS))
+    {
+        in.stream = stream;
+        memcpy(in.data, packet, PACKET_SIZE);
+        delivered_.push_back(in);
+        count++;
+    }
+    else
+    {
+        return false;
+    }
+    armed[onBus] = false;
+    onBus = (onBus + 1) % (stream ? STREAM_BUFFER_COUNT : IN_BUFFER_COUNT);
+    return true;
+}
+
+// The reserved isochronous transaction of the frame, while the host
+// streams. Nothing is retried: an empty frame is only counted.
+void StandIn::isoTransaction()
+{
+    InPacket in;
+
+    if (!streaming_)
+        return;
+    if (!streamArmed_[streamBufferOnBus_])
+    {
+        isoEmpty_++;
+        return;
+    }
+    in.stream = true;
+    memcpy(in.data, streamBuffers_[streamBufferOnBus_], PACKET_SIZE);
+    delivered_.push_back(in);
+    streamArmed_[streamBufferOnBus_] = false;
+    streamBufferOnBus_ = (streamBufferOnBus_ + 1) % STREAM_BUFFER_COUNT;
+}
+
+// The interrupt poll of the event endpoint, while waitEvents() waits.
+void StandIn::eventTransaction()
+{
+    if (eventReadBuffer_ == NULL || eventLengths_[eventBufferOnBus_] == 0)
+        return;
+    eventReadLength_ = eventLengths_[eventBufferOnBus_];
+    memcpy(eventReadBuffer_, eventBuffers_[eventBufferOnBus_], eventReadLength_);
+    eventReadBuffer_ = NULL;
+    changed_.notify_all();
+    eventLengths_[eventBufferOnBus_] = 0;
+    eventBufferOnBus_ = (eventBufferOnBus_ + 1) % EVENT_BUFFER_COUNT;
+}
+
+/******************************************************************************
+ * Function:        void StandIn::controlTransaction()
+ *
+ * Overview:        The setup stage of a waiting control transfer, with
+ *                  USBCBCheckOtherReq() on the device. GET requests are
+ *                  answered at once. The others are left for vendorTask()
+ *                  with their OUT data, and the transfer completes when
+ *                  it has applied them. Requests the firmware does not
+ *                  claim are stalled.
+ *****************************************************************************/
+void StandIn::controlTransaction()
+{
+    ControlTransfer *transfer = control_;
+    uint8_t reply[VENDOR_STATUS_SIZE];
+    int n;
+
+    if (transfer == NULL || transfer->setup || vendorPending_)
+        return;
+    transfer->setup = true;
+
+    switch (transfer->request)
+    {
+    case VENDOR_GET_STATUS:
+    case VENDOR_GET_TIME:
+        if (!transfer->in)
+            break;
+        n = std::min(vendorReply(*transfer, reply), transfer->length);
+        memcpy(transfer->data, reply, n);
+        transfer->result = n;
+        transfer->done = true;
+        changed_.notify_all();
+        return;
+    case VENDOR_STREAM_START:
+    case VENDOR_STREAM_STOP:
+    case VENDOR_SCAN_MASK:
+    case VENDOR_PORT_WRITE:
+        if (transfer->length != 0)
+            break;
+        vendorRequest_ = transfer->request;
+        vendorValue_ = transfer->value;
+        vendorIndex_ = transfer->index;
+        vendorPending_ = true;
+        return;
+    case VENDOR_EVENT_CONFIG:
+        if (transfer->in || transfer->length != VENDOR_DATA_SIZE)
+            break;
+        vendorRequest_ = transfer->request;
+        memcpy(vendorData_, transfer->data, VENDOR_DATA_SIZE);
+        vendorPending_ = true;
+        return;
+    }
+    transfer->result = ERROR_PIPE;
+    transfer->done = true;
+    changed_.notify_all();
+}
+
+// Fills reply like USBCBCheckOtherReq(). Returns its length.
+int StandIn::vendorReply(const ControlTransfer &transfer, uint8_t *reply)
+{
+    uint32_t t = now();
+
+    if (transfer.request == VENDOR_GET_TIME)
+    {
+        reply[0] = (uint8_t)sofFrame_;
+        reply[1] = (uint8_t)(sofFrame_ >> 8);
+        reply[2] = (uint8_t)sofTime_;
+        reply[3] = (uint8_t)(sofTime_ >> 8);
+        reply[4] = (uint8_t)(sofTime_ >> 16);
+        reply[5] = (uint8_t)(sofTime_ >> 24);
+        reply[6] = (uint8_t)t;
+        reply[7] = (uint8_t)(t >> 8);
+        reply[8] = (uint8_t)(t >> 16);
+        reply[9] = (uint8_t)(t >> 24);
+        return VENDOR_TIME_SIZE;
+    }
+
+    reply[0] = 0;
+    if (streamEnabled_)
+        reply[0] |= VENDOR_STATUS_STREAMING;
+    if (streamIso_)
+        reply[0] |= VENDOR_STATUS_ISO;
+    if (adcOneShotPending_)
+        reply[0] |= VENDOR_STATUS_ONE_SHOT;
+    reply[1] = streamFormat_;
+    reply[2] = (uint8_t)scanMask_;
+    reply[3] = (uint8_t)(scanMask_ >> 8);
+    reply[4] = (uint8_t)streamPeriod_;
+    reply[5] = (uint8_t)(streamPeriod_ >> 8);
+    reply[6] = (uint8_t)streamOverruns_;
+    reply[7] = (uint8_t)(streamOverruns_ >> 8);
+    reply[8] = 0;                       // LA_IDLE, there is no logic analyzer
+    reply[9] = eventPinMask_;
+    reply[10] = eventThresholdChannel_;
+    reply[11] = (uint8_t)altSetting_;
+    reply[12] = (uint8_t)t;
+    reply[13] = (uint8_t)(t >> 8);
+    reply[14] = (uint8_t)(t >> 16);
+    reply[15] = (uint8_t)(t >> 24);
+    return VENDOR_STATUS_SIZE;
+}
+
+// With deliverMutex_ held. Like Device, only stream packets go into the
+// ring.
+void StandIn::deliver(const InPacket &packet)
+{
+    if (!streaming_)
+        return;
+    packets_++;
+    bytes_ += PACKET_SIZE;
+    if (packet.stream)
+    {
+        if (ring_ != NULL)
+            ring_->push(packet.data, PACKET_SIZE);
+        else if (callback_)
+            callback_(packet.data, PACKET_SIZE);
+    }
+    else if (!requests_.complete(packet.data, PACKET_SIZE) &&
+             ring_ == NULL && callback_)
+    {
+        callback_(packet.data, PACKET_SIZE);
+    }
+}
+
+/******************************************************************************
+ * Function:        void StandIn::processIO()
+ *
+ * Overview:        A pass of SchedulerRun() of Firmware/main.c, with the
+ *                  A/D and Timer2 interrupts run first for the time that
+ *                  passed. Every task runs on every pass; periods and the
+ *                  pass budget are not modelled, only the accounting.
+ *****************************************************************************/
+void StandIn::processIO()
+{
+    Clock::time_point start;
+    uint32_t cycles;
+    size_t i;
+
+    pwmTask();
+    eventPinTask();
+    streamConvert();
+
+    for (i = 0; i < tasks_.size(); i++)
+    {
+        start = Clock::now();
+        (this->*tasks_[i].run)();
+        cycles = (uint32_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count() * (FCY / 1000000) / 1000);
+        tasks_[i].cycles += cycles;
+        if (cycles > tasks_[i].maxCycles)
+            tasks_[i].maxCycles = (uint16_t)std::min(cycles, (uint32_t)0xFFFF);
+        if (tasks_[i].runs != 0xFFFF)
+            tasks_[i].runs++;
+    }
+}
+
+// Behind the tasks of the same or a higher priority, as TaskRegister().
+void StandIn::taskRegister(uint8_t id, void (StandIn::*run)(), uint8_t priority)
+{
+    Task task = { id, priority, run, 0, 0, 0 };
+    std::vector<Task>::iterator i = tasks_.end();
+
+    while (i != tasks_.begin() && (i - 1)->priority > priority)
+        --i;
+    tasks_.insert(i, task);
+}
+
+void StandIn::taskStatsReset()
+{
+    size_t i;
+
+    for (i = 0; i < tasks_.size(); i++)
+    {
+        tasks_[i].runs = 0;
+        tasks_[i].cycles = 0;
+        tasks_[i].maxCycles = 0;
+    }
+    taskStatsStart_ = now();
+}
+
+// ProcessIO() of Firmware/main.c, the command of outPacket_.
+void StandIn::commandTask()
+{
+    bool outPacketDone;
+    int i;
+
+    if (outFull_)
+    {
+        if (outPacket_[0] == CMD_TAGGED)
+        {
+            outTag_ = outPacket_[1];
+            for (i = 0; i < PACKET_SIZE - TAG_HEADER_SIZE; i++)
+                outPacket_[i] = outPacket_[i + TAG_HEADER_SIZE];
+            for (; i < PACKET_SIZE; i++)
+                outPacket_[i] = 0;
+            outTagged_ = true;
+        }
+
+        outPacketDone = false;
+        if (!outTagged_ || !inBufferBusy())
+        {
+            if (outTagged_)
+                tagReply(outTag_);
+
+            outPacketDone = dispatch();
+
+            if (replyTagged_)
+            {
+                if (outPacketDone)
+                {
+                    inPacket_[0] = outPacket_[0];
+                    inBufferSend();
+                }
+                else
+                {
+                    replyTagged_ = false;
+                    inPacket_ = inBuffers_[inBufferNext_];
+                }
+            }
+        }
+
+        if (outPacketDone)
+        {
+            outTagged_ = false;
+            outFull_ = false;
+        }
+    }
+}
+
+// asciiCommands[] and binaryCommands[]. Unknown commands are dropped.
+bool StandIn::dispatch()
+{
+    switch (outPacket_[0])
+    {
+    case 'A':
+        return cmdAdcOneShot();
+    case 'D':
+    case 'M':
+    case 'P':
+    case 'U':
+        return appBatchRun();
+    case CMD_TOGGLE_LED:
+        return cmdToggleLed();
+    case CMD_PUSHBUTTON:
+        return cmdPushbutton();
+    case CMD_STREAM_START:
+        streamStart(outPacket_[1], (uint16_t)(outPacket_[3] << 8 | outPacket_[2]),
+                    outPacket_[4]);
+        return true;
+    case CMD_STREAM_STOP:
+        streamEnabled_ = false;
+        return true;
+    case CMD_SCAN_LIST:
+        if (outPacket_[1] <= PACKET_SIZE - 2)
+        {
+            streamEnabled_ = false;
+            scanSetList(outPacket_[1], &outPacket_[2]);
+        }
+        return true;
+    case CMD_ADC_STATS:
+        return cmdAdcStats();
+    case CMD_PORT_SNAPSHOT:
+        return cmdPortSnapshot();
+    case CMD_PORT_WRITE:
+        return cmdPortWrite();
+    case CMD_TIME:
+        return cmdTime();
+    case CMD_EVENT_CONFIG:
+        return cmdEventConfig();
+    case CMD_TASK_STATS:
+        return cmdTaskStats();
+    default:
+        return true;
+    }
+}
+
+void StandIn::inBufferSend()
+{
+    inArmed_[inBufferNext_] = true;
+    inBufferNext_ = (inBufferNext_ + 1) % IN_BUFFER_COUNT;
+    inPacket_ = inBuffers_[inBufferNext_];
+    replyTagged_ = false;
+}
+
+void StandIn::streamBufferSend()
+{
+    streamArmed_[streamBufferNext_] = true;
+    streamBufferNext_ = (streamBufferNext_ + 1) % STREAM_BUFFER_COUNT;
+}
+
+void StandIn::tagReply(uint8_t tag)
+{
+    inBuffers_[inBufferNext_][0] = CMD_TAGGED;
+    inBuffers_[inBufferNext_][1] = tag;
+    inPacket_ = inBuffers_[inBufferNext_] + TAG_HEADER_SIZE;
+    replyTagged_ = true;
+}
+
+bool StandIn::tagDefer(uint8_t *tag)
+{
+    if (!replyTagged_)
+        return false;
+    *tag = outTag_;
+    replyTagged_ = false;
+    inPacket_ = inBuffers_[inBufferNext_];
+    return true;
+}
+
+bool StandIn::appBatchRun()
+{
+    if (inBufferBusy())
+        return false;
+
+    appBatch(outPacket_, inPacket_);
+    inBufferSend();
+    return true;
+}
+
+bool StandIn::cmdAdcOneShot()
+{
+    if (isAppCmd(outPacket_))
+        return appBatchRun();
+
+    if (streamEnabled_)
+    {
+        // The stream keeps the A/D, the reply is the failed sample.
+        if (inBufferBusy())
+            return false;
+        memset(inPacket_, 0, 6);
+        inPacket_[0] = (uint8_t)ADC_ONE_SHOT_FAILED;
+        inPacket_[1] = (uint8_t)(ADC_ONE_SHOT_FAILED >> 8);
+        inBufferSend();
+        return true;
+    }
+    if (adcOneShotPending_)
+        return false;
+    streamHead_ = 0;
+    streamTail_ = 0;
+    adcOneShotPending_ = true;
+    adcOneShotFailed_ = false;
+    adcOneShotChannel_ = (outPacket_[1] == '1') ? 1 : 0;
+    adcOneShotStamp_ = now() + ADC_CONVERSION_CYCLES;
+    adcOneShotTagged_ = tagDefer(&adcOneShotTag_);
+    return true;
+}
+
+// The LEDs are LATB0 and LATB1.
+bool StandIn::cmdToggleLed()
+{
+    if (((lat_[1] >> 0) & 1) == ((lat_[1] >> 1) & 1))
+        lat_[1] ^= 0x03;
+    else
+        lat_[1] |= 0x03;
+    return true;
+}
+
+bool StandIn::cmdPushbutton()
+{
+    if (!inBufferBusy())
+    {
+        inPacket_[0] = CMD_PUSHBUTTON;
+        inPacket_[1] = pushbutton_ ? 0x00 : 0x01;
+        inBufferSend();
+    }
+    return true;
+}
+
+// There is no interrupt to time, the ISR cycles read 0.
+bool StandIn::cmdAdcStats()
+{
+    if (!inBufferBusy())
+    {
+        memset(inPacket_, 0, 13);
+        inPacket_[0] = CMD_ADC_STATS;
+        inPacket_[1] = (uint8_t)ADC_CONVERSION_CYCLES;
+        inPacket_[2] = (uint8_t)(ADC_CONVERSION_CYCLES >> 8);
+        inPacket_[7] = (uint8_t)streamOverruns_;
+        inPacket_[8] = (uint8_t)(streamOverruns_ >> 8);
+        inPacket_[9] = (uint8_t)adcConversions_;
+        inPacket_[10] = (uint8_t)(adcConversions_ >> 8);
+        inPacket_[11] = (uint8_t)(adcConversions_ >> 16);
+        inPacket_[12] = (uint8_t)(adcConversions_ >> 24);
+        inBufferSend();
+    }
+    return true;
+}
+
+bool StandIn::cmdPortSnapshot()
+{
+    if (inBufferBusy())
+        return false;
+
+    portSnapshotSend();
+    return true;
+}
+
+bool StandIn::cmdPortWrite()
+{
+    int i;
+
+    if (inBufferBusy())
+        return false;
+
+    for (i = 0; i < APP_NUM_PORTS; i++)
+        lat_[i] = (lat_[i] & ~outPacket_[1 + i]) | (outPacket_[4 + i] & outPacket_[1 + i]);
+    portSnapshotSend();
+    return true;
+}
+
+void StandIn::portSnapshotSend()
+{
+    int i;
+
+    inPacket_[0] = outPacket_[0];
+    for (i = 0; i < APP_NUM_PORTS; i++)
+    {
+        inPacket_[PORT_SNAPSHOT_PORT + i] = port(i);
+        inPacket_[PORT_SNAPSHOT_LAT + i] = lat_[i];
+        inPacket_[PORT_SNAPSHOT_TRIS + i] = tris_[i];
+    }
+    inBufferSend();
+}
+
+bool StandIn::cmdTime()
+{
+    uint32_t t;
+
+    if (inBufferBusy())
+        return false;
+
+    t = now();
+    inPacket_[0] = CMD_TIME;
+    inPacket_[1] = (uint8_t)sofFrame_;
+    inPacket_[2] = (uint8_t)(sofFrame_ >> 8);
+    inPacket_[3] = (uint8_t)sofTime_;
+    inPacket_[4] = (uint8_t)(sofTime_ >> 8);
+    inPacket_[5] = (uint8_t)(sofTime_ >> 16);
+    inPacket_[6] = (uint8_t)(sofTime_ >> 24);
+    inPacket_[7] = (uint8_t)t;
+    inPacket_[8] = (uint8_t)(t >> 8);
+    inPacket_[9] = (uint8_t)(t >> 16);
+    inPacket_[10] = (uint8_t)(t >> 24);
+    inBufferSend();
+    return true;
+}
+
+// Pin levels: outputs show their latch, RB4 is the pushbutton with its
+// pull up.
+uint8_t StandIn::port(int index) const
+{
+    uint8_t levels = pins_[index];
+
+    if (index == 1)
+        levels = pushbutton_ ? (levels & ~0x10) : (levels | 0x10);
+    return (lat_[index] & ~tris_[index]) | (levels & tris_[index]);
+}
+
+void StandIn::streamStart(uint8_t channel, uint16_t period, uint8_t format)
+{
+    streamEnabled_ = false;
+    if (adcOneShotPending_)
+        adcOneShotFailed_ = true;
+
+    if (channel != STREAM_CHANNEL_SCAN_LIST)
+        scanSetList(1, &channel);
+
+    if (format == STREAM_FORMAT_PACKED10)
+    {
+        streamFormat_ = STREAM_FORMAT_PACKED10;
+        streamPacketSamples_ = STREAM_PACKED10_SAMPLES;
+    }
+    else
+    {
+        streamFormat_ = STREAM_FORMAT_RAW16;
+        streamPacketSamples_ = STREAM_RAW16_SAMPLES;
+    }
+    streamPacketSamples_ -= streamPacketSamples_ % scanCount_;
+
+    streamPeriod_ = period;
+    if (streamPeriod_ == 0)
+        streamPeriod_ = STREAM_DEFAULT_PERIOD;
+    if (streamPeriod_ < STREAM_MIN_PERIOD * scanCount_)
+        streamPeriod_ = STREAM_MIN_PERIOD * scanCount_;
+    if (streamIso_ && streamPeriod_ * streamPacketSamples_ < STREAM_FRAME_TICKS * scanCount_)
+        streamPeriod_ = (STREAM_FRAME_TICKS * scanCount_ + streamPacketSamples_ - 1) /
+            streamPacketSamples_;
+
+    streamHead_ = 0;
+    streamTail_ = 0;
+    streamOverruns_ = 0;
+    streamStampHead_ = 0;
+    streamStampTail_ = 0;
+    streamPacketFill_ = 0;
+    streamTrigger_ = now() + streamPeriod_;
+    streamEnabled_ = true;
+}
+
+// StreamAltTask(): follows the alternate setting the host selected. The
+// event endpoint is only in ALT_ISO and ALT_BULK_EVENTS; records queued
+// without it wait in eventQueue_.
+void StandIn::streamAltTask()
+{
+    int alt = altSetting_;
+    bool iso = (alt == ALT_ISO);
+    bool events = (alt != ALT_BULK);
+
+    if (events != eventEndpoint_)
+    {
+        eventEndpoint_ = events;
+        memset(eventLengths_, 0, sizeof(eventLengths_));
+        eventBufferNext_ = 0;
+        eventBufferOnBus_ = 0;
+    }
+
+    if (iso == streamIso_)
+        return;
+    streamEnabled_ = false;
+    streamIso_ = iso;
+    memset(streamArmed_, 0, sizeof(streamArmed_));
+    streamBufferNext_ = 0;
+    streamBufferOnBus_ = 0;
+}
+
+/******************************************************************************
+ * Function:        void StandIn::streamConvert()
+ *
+ * Overview:        The CCP2 trigger and the A/D interrupt: converts every
+ *                  frame whose trigger time has passed into streamRing_,
+ *                  or counts an overrun for it if the ring is too full,
+ *                  and lets streamTask() take a packet out after each, as
+ *                  the main loop would between two interrupts.
+ *****************************************************************************/
+void StandIn::streamConvert()
+{
+    uint32_t t = now();
+    bool drop;
+    int i;
+
+    while (streamEnabled_ && (int32_t)(t - streamTrigger_) >= 0)
+    {
+        drop = ((streamTail_ - streamHead_ - 1) % STREAM_RING_SIZE) < (unsigned)scanCount_;
+        if (drop)
+        {
+            streamOverruns_++;
+        }
+        else
+        {
+            if (streamPacketFill_ == 0)
+            {
+                streamStamps_[streamStampHead_] = streamTrigger_;
+                streamStampHead_ = (streamStampHead_ + 1) % STREAM_STAMP_COUNT;
+            }
+            streamPacketFill_ += scanCount_;
+            if (streamPacketFill_ >= streamPacketSamples_)
+                streamPacketFill_ = 0;
+            for (i = 0; i < scanCount_; i++)
+            {
+                streamRing_[streamHead_] = convert(scanChannels_[i], streamTrigger_);
+                eventThreshold(scanChannels_[i], streamRing_[streamHead_]);
+                streamHead_ = (streamHead_ + 1) % STREAM_RING_SIZE;
+            }
+        }
+        adcConversions_ += scanCount_;
+        streamTrigger_ += streamPeriod_;
+        streamTask();
+    }
+}
+
+void StandIn::streamTask()
+{
+    uint8_t *packet;
+    uint8_t *p;
+    uint8_t high;
+    uint16_t sample;
+    uint32_t stamp;
+    int i;
+    int j;
+
+    if (!streamEnabled_ || streamBufferBusy())
+        return;
+    if ((int)((streamHead_ - streamTail_) % STREAM_RING_SIZE) < streamPacketSamples_)
+        return;
+
+    packet = streamBuffers_[streamBufferNext_];
+    packet[0] = CMD_STREAM_START;
+    packet[1] = (uint8_t)(streamFormat_ << STREAM_FORMAT_SHIFT | streamPacketSamples_);
+    packet[2] = (uint8_t)scanMask_;
+    packet[3] = (uint8_t)(scanMask_ >> 8);
+    stamp = streamStamps_[streamStampTail_];
+    streamStampTail_ = (streamStampTail_ + 1) % STREAM_STAMP_COUNT;
+    packet[4] = (uint8_t)stamp;
+    packet[5] = (uint8_t)(stamp >> 8);
+    packet[6] = (uint8_t)(stamp >> 16);
+    packet[7] = (uint8_t)(stamp >> 24);
+    p = &packet[STREAM_HEADER_SIZE];
+    if (streamFormat_ == STREAM_FORMAT_PACKED10)
+    {
+        for (i = 0; i < streamPacketSamples_; i += j)
+        {
+            high = 0;
+            for (j = 0; j < 4 && i + j < streamPacketSamples_; j++)
+            {
+                sample = streamRing_[streamTail_];
+                *p++ = (uint8_t)sample;
+                high |= ((sample >> 8) & 0x03) << (j << 1);
+                streamTail_ = (streamTail_ + 1) % STREAM_RING_SIZE;
+            }
+            *p++ = high;
+        }
+    }
+    else
+    {
+        for (i = 0; i < streamPacketSamples_; i++)
+        {
+            sample = streamRing_[streamTail_];
+            *p++ = (uint8_t)sample;
+            *p++ = (uint8_t)(sample >> 8);
+            streamTail_ = (streamTail_ + 1) % STREAM_RING_SIZE;
+        }
+    }
+    streamBufferSend();
+}
+
+// AdcOneShotTask(): ADC_ONE_SHOT_FAILED at time 0 if a stream started
+// before the reply went out.
+void StandIn::adcOneShotTask()
+{
+    uint16_t sample = ADC_ONE_SHOT_FAILED;
+    uint32_t stamp = 0;
+
+    if (!adcOneShotPending_)
+        return;
+    if (!adcOneShotFailed_ && (int32_t)(now() - adcOneShotStamp_) < 0)
+        return;
+    if (inBufferBusy())
+        return;
+
+    if (!adcOneShotFailed_)
+    {
+        sample = convert(adcOneShotChannel_, adcOneShotStamp_);
+        eventThreshold(adcOneShotChannel_, sample);
+        adcConversions_++;
+        stamp = adcOneShotStamp_;
+    }
+    if (adcOneShotTagged_)
+        tagReply(adcOneShotTag_);
+    inPacket_[0] = (uint8_t)sample;
+    inPacket_[1] = (uint8_t)(sample >> 8);
+    inPacket_[2] = (uint8_t)stamp;
+    inPacket_[3] = (uint8_t)(stamp >> 8);
+    inPacket_[4] = (uint8_t)(stamp >> 16);
+    inPacket_[5] = (uint8_t)(stamp >> 24);
+    adcOneShotPending_ = false;
+    adcOneShotFailed_ = false;
+    inBufferSend();
+}
+
+// CmdEventConfig() and EventConfig().
+bool StandIn::cmdTaskStats()
+{
+    uint8_t *p = inPacket_ + TASK_STATS_HEADER;
+    size_t first = std::min((size_t)outPacket_[1], tasks_.size());
+    uint32_t elapsed;
+    int n;
+
+    if (inBufferBusy())
+        return false;
+
+    for (n = 0; first + n < tasks_.size() && n < TASK_STATS_RECORDS; n++)
+    {
+        const Task &task = tasks_[first + n];
+
+        p[0] = task.id;
+        p[1] = task.priority;
+        p[2] = (uint8_t)task.runs;
+        p[3] = (uint8_t)(task.runs >> 8);
+        p[4] = (uint8_t)task.cycles;
+        p[5] = (uint8_t)(task.cycles >> 8);
+        p[6] = (uint8_t)(task.cycles >> 16);
+        p[7] = (uint8_t)(task.cycles >> 24);
+        p[8] = (uint8_t)task.maxCycles;
+        p[9] = (uint8_t)(task.maxCycles >> 8);
+        p += TASK_STATS_RECORD;
+    }
+
+    elapsed = now() - taskStatsStart_;
+    inPacket_[0] = CMD_TASK_STATS;
+    inPacket_[1] = (uint8_t)tasks_.size();
+    inPacket_[2] = (uint8_t)first;
+    inPacket_[3] = (uint8_t)n;
+    inPacket_[4] = (uint8_t)elapsed;
+    inPacket_[5] = (uint8_t)(elapsed >> 8);
+    inPacket_[6] = (uint8_t)(elapsed >> 16);
+    inPacket_[7] = (uint8_t)(elapsed >> 24);
+    inBufferSend();
+
+    if (outPacket_[2] & TASK_STATS_RESET)
+        taskStatsReset();
+    return true;
+}
+
+bool StandIn::cmdEventConfig()
+{
+    eventConfig(outPacket_[1], outPacket_[2],
+                (uint16_t)(outPacket_[4] << 8 | outPacket_[3]),
+                (uint16_t)(outPacket_[6] << 8 | outPacket_[5]));
+    return true;
+}
+
+void StandIn::eventConfig(uint8_t pins, uint8_t channel, uint16_t low, uint16_t high)
+{
+    eventPinMask_ = pins & EVENT_PIN_MASK;
+    eventThresholdChannel_ = (channel < 16) ? channel : EVENT_THRESHOLD_OFF;
+    eventThresholdLow_ = low;
+    eventThresholdHigh_ = high;
+    eventThresholdAbove_ = false;
+    eventPortB_ = port(1);
+}
+
+// Applies the request controlTransaction() left and completes its
+// transfer, if the host still waits for it.
+void StandIn::vendorTask()
+{
+    uint8_t mask;
+
+    if (!vendorPending_)
+        return;
+
+    switch (vendorRequest_)
+    {
+    case VENDOR_STREAM_START:
+        streamStart((uint8_t)vendorIndex_, vendorValue_, (uint8_t)(vendorIndex_ >> 8));
+        break;
+    case VENDOR_STREAM_STOP:
+        streamEnabled_ = false;
+        break;
+    case VENDOR_SCAN_MASK:
+        if (vendorValue_ & SCAN_VALID_MASK)
+        {
+            streamEnabled_ = false;
+            scanSetMask(vendorValue_ & SCAN_VALID_MASK);
+        }
+        break;
+    case VENDOR_PORT_WRITE:
+        mask = (uint8_t)vendorValue_;
+        if (vendorIndex_ < APP_NUM_PORTS)
+            lat_[vendorIndex_] = (lat_[vendorIndex_] & ~mask) | ((vendorValue_ >> 8) & mask);
+        break;
+    case VENDOR_EVENT_CONFIG:
+        eventConfig(vendorData_[0], vendorData_[1],
+                    (uint16_t)(vendorData_[3] << 8 | vendorData_[2]),
+                    (uint16_t)(vendorData_[5] << 8 | vendorData_[4]));
+        break;
+    }
+
+    vendorPending_ = false;
+    if (control_ != NULL && control_->setup)
+    {
+        control_->result = 0;
+        control_->done = true;
+        changed_.notify_all();
+    }
+}
+
+// mEventQueue(), at the device time of the slot.
+void StandIn::eventQueue(uint8_t type, uint8_t a, uint8_t b, uint8_t c)
+{
+    std::vector<uint8_t> record(EVENT_RECORD_SIZE);
+    uint32_t t = now();
+
+    if ((int)eventQueue_.size() == EVENT_QUEUE_SIZE - 1)
+    {
+        if (eventLost_ != 0xFFFF)
+            eventLost_++;
+        return;
+    }
+    record[0] = type;
+    record[1] = a;
+    record[2] = b;
+    record[3] = c;
+    record[4] = (uint8_t)t;
+    record[5] = (uint8_t)(t >> 8);
+    record[6] = (uint8_t)(t >> 16);
+    record[7] = (uint8_t)(t >> 24);
+    eventQueue_.push_back(record);
+}
+
+// The PORTB change interrupt, for the changes since the last slot.
+void StandIn::eventPinTask()
+{
+    uint8_t levels;
+    uint8_t changed;
+
+    if (eventPinMask_ == 0)
+        return;
+    levels = port(1);
+    changed = (levels ^ eventPortB_) & eventPinMask_;
+    eventPortB_ = levels;
+    if (changed)
+        eventQueue(EVENT_PINS, levels, changed, 0);
+}
+
+// The threshold check of the A/D interrupt.
+void StandIn::eventThreshold(uint8_t channel, uint16_t sample)
+{
+    if (channel != eventThresholdChannel_)
+        return;
+    if (!eventThresholdAbove_ && sample >= eventThresholdHigh_)
+    {
+        eventThresholdAbove_ = true;
+        eventQueue(EVENT_THRESHOLD, channel | EVENT_THRESHOLD_RISING,
+                   (uint8_t)sample, (uint8_t)(sample >> 8));
+    }
+    else if (eventThresholdAbove_ && sample <= eventThresholdLow_)
+    {
+        eventThresholdAbove_ = false;
+        eventQueue(EVENT_THRESHOLD, channel, (uint8_t)sample, (uint8_t)(sample >> 8));
+    }
+}
+
+// ButtonTask(): sw2 and sw3 sampled once per SOF, debounced.
+void StandIn::buttonTask()
+{
+    uint8_t levels;
+    uint8_t buttons;
+
+    if ((uint8_t)sofFrame_ == buttonFrame_)
+        return;
+    buttonFrame_ = (uint8_t)sofFrame_;
+
+    levels = port(1);
+    buttons = ((levels & 0x10) ? 0 : 0x01) | ((levels & 0x20) ? 0 : 0x02);
+    if (buttons == buttonState_)
+    {
+        buttonSteady_ = 0;
+        return;
+    }
+    if (++buttonSteady_ < EVENT_DEBOUNCE_FRAMES)
+        return;
+    buttonSteady_ = 0;
+    eventQueue(EVENT_BUTTON, buttons, buttons ^ buttonState_, 0);
+    buttonState_ = buttons;
+}
+
+// EventTask(): the queued records into the free event buffer, then an
+// EVENT_LOST record if any were dropped and there is room.
+void StandIn::eventTask()
+{
+    uint8_t *p;
+    uint32_t t;
+    int n;
+
+    if (!eventEndpoint_ || eventLengths_[eventBufferNext_] != 0)
+        return;
+    if (eventQueue_.empty() && eventLost_ == 0)
+        return;
+
+    p = eventBuffers_[eventBufferNext_];
+    for (n = 0; n < EVENT_PACKET_RECORDS && !eventQueue_.empty(); n++)
+    {
+        memcpy(p, &eventQueue_.front()[0], EVENT_RECORD_SIZE);
+        eventQueue_.pop_front();
+        p += EVENT_RECORD_SIZE;
+    }
+    if (n < EVENT_PACKET_RECORDS && eventQueue_.empty() && eventLost_ != 0)
+    {
+        t = now();
+        p[0] = EVENT_LOST;
+        p[1] = (uint8_t)eventLost_;
+        p[2] = (uint8_t)(eventLost_ >> 8);
+        p[3] = 0;
+        p[4] = (uint8_t)t;
+        p[5] = (uint8_t)(t >> 8);
+        p[6] = (uint8_t)(t >> 16);
+        p[7] = (uint8_t)(t >> 24);
+        eventLost_ = 0;
+        n++;
+    }
+    if (n == 0)
+        return;
+    eventLengths_[eventBufferNext_] = n * EVENT_RECORD_SIZE;
+    eventBufferNext_ = (eventBufferNext_ + 1) % EVENT_BUFFER_COUNT;
+}
+
+// ScanSetList() and ScanSetMask(): channels in ascending order, AN0 and
+// AN1 always analog.
+void StandIn::scanSetMask(uint16_t mask)
+{
+    uint8_t channels[SCAN_MAX_CHANNELS];
+    uint8_t count = 0;
+    uint8_t channel;
+
+    for (channel = 0; channel < 16 && count < SCAN_MAX_CHANNELS; channel++)
+    {
+        if (mask & ((uint16_t)1 << channel))
+            channels[count++] = channel;
+    }
+    scanSetList(count, channels);
+}
+
+void StandIn::scanSetList(uint8_t count, const uint8_t *channels)
+{
+    uint16_t mask = 0;
+    uint8_t channel;
+    uint8_t highest = 1;
+
+    while (count--)
+    {
+        if (*channels < 16)
+            mask |= (uint16_t)1 << *channels;
+        channels++;
+    }
+    mask &= SCAN_VALID_MASK;
+    if (mask == 0)
+        return;
+
+    scanMask_ = mask;
+    scanCount_ = 0;
+    for (channel = 0; channel < 16; channel++)
+    {
+        if (mask & ((uint16_t)1 << channel))
+        {
+            scanChannels_[scanCount_++] = channel;
+            if (channel > highest)
+                highest = channel;
+        }
+    }
+    pcfg_ = 14 - highest;
+
+    tris_[0] |= (uint8_t)(mask & 0x0F);
+    if (mask & 0x0010)  tris_[0] |= 0x20;
+    if (mask & 0x0100)  tris_[1] |= 0x04;
+    if (mask & 0x0200)  tris_[1] |= 0x08;
+    if (mask & 0x0400)  tris_[1] |= 0x02;
+    if (mask & 0x0800)  tris_[1] |= 0x10;
+}
+
+// The Timer2 interrupt: the PWM of CCP1 is on RC2, of CCP2 on RC1.
+void StandIn::pwmTask()
+{
+    unsigned step;
+
+    if (pwmEnabled_ == 0)
+        return;
+    step = (now() / APP_PWM_STEP_TICKS) % APP_PWM_STEPS;
+    if (pwmEnabled_ & 0x01)
+        lat_[2] = (step < pwmDuty_[0]) ? (lat_[2] | 0x04) : (lat_[2] & ~0x04);
+    if (pwmEnabled_ & 0x02)
+        lat_[2] = (step < pwmDuty_[1]) ? (lat_[2] | 0x02) : (lat_[2] & ~0x02);
+}
+
+/******************************************************************************
+ * application.c
+ *****************************************************************************/
+bool StandIn::isAppCmd(const uint8_t *cmd) const
+{
+    switch (cmd[0])
+    {
+    case 'A':
+    case 'D':
+    case 'M':
+    case 'P':
+    case 'U':
+        return cmd[1] == 'R' || cmd[1] == 'W';
+    default:
+        return false;
+    }
+}
+
+int StandIn::appCmd(const uint8_t *cmd)
+{
+    switch (cmd[0])
+    {
+    case 'A':
+        return adcHandler(cmd);
+    case 'D':
+        return dirHandler(cmd);
+    case 'M':
+        return pwmHandler(cmd);
+    case 'P':
+        return portHandler(cmd);
+    case 'U':
+        return uartHandler(cmd);
+    default:
+        return -1;
+    }
+}
+
+void StandIn::appBatch(const uint8_t *cmds, uint8_t *reply)
+{
+    int value;
+    int n;
+
+    reply[0] = cmds[0];
+    for (n = 0; n < APP_MAX_BATCH && isAppCmd(cmds); n++)
+    {
+        value = appCmd(cmds);
+        reply[APP_REPLY_HEADER + 2 * n] = (uint8_t)value;
+        reply[APP_REPLY_HEADER + 2 * n + 1] = (uint8_t)(value >> 8);
+        cmds += APP_CMD_SIZE;
+    }
+    reply[1] = (uint8_t)n;
+}
+
+// DWA0I, DWA0O
+int StandIn::dirHandler(const uint8_t *cmd)
+{
+    uint8_t port = cmd[2] - 'A';
+    uint8_t pbit = cmd[3] - '0';
+
+    if (port >= APP_NUM_PORTS || pbit > 7 || cmd[1] != 'W')
+        return -1;
+    if (cmd[4] == 'O')
+        tris_[port] &= ~(1 << pbit);
+    else if (cmd[4] == 'I')
+        tris_[port] |= 1 << pbit;
+    else
+        return -1;
+    return 0;
+}
+
+// PWA0H, PWA0L, PRA0X. A read returns the latch, not the pin.
+int StandIn::portHandler(const uint8_t *cmd)
+{
+    uint8_t port = cmd[2] - 'A';
+    uint8_t pbit = cmd[3] - '0';
+
+    if (port >= APP_NUM_PORTS || pbit > 7)
+        return -1;
+    if (cmd[1] == 'R' && cmd[4] == 'X')
+        return (lat_[port] >> pbit) & 1;
+    if (cmd[1] != 'W')
+        return -1;
+    if (cmd[4] == 'H')
+        lat_[port] |= 1 << pbit;
+    else if (cmd[4] == 'L')
+        lat_[port] &= ~(1 << pbit);
+    else
+        return -1;
+    return 0;
+}
+
+// AW00E, AW00D, ARC01. A read fails while a stream or an 'A' conversion
+// has the A/D.
+int StandIn::adcHandler(const uint8_t *cmd)
+{
+    uint8_t tens;
+    uint8_t ones;
+    uint8_t channel;
+
+    if (cmd[1] == 'W')
+    {
+        tens = cmd[2] - '0';
+        ones = cmd[3] - '0';
+    }
+    else if (cmd[2] == 'C')
+    {
+        tens = cmd[3] - '0';
+        ones = cmd[4] - '0';
+    }
+    else
+        return -1;
+    if (tens > 1 || ones > 9)
+        return -1;
+    channel = tens * 10 + ones;
+    if (channel > 12)
+        return -1;
+
+    if (cmd[1] == 'W')
+    {
+        if (cmd[4] == 'E')
+        {
+            if (pcfg_ > 14 - channel)
+                pcfg_ = 14 - channel;
+        }
+        else if (cmd[4] == 'D')
+        {
+            if (pcfg_ < 15 - channel)
+                pcfg_ = 15 - channel;
+        }
+        else
+            return -1;
+        return 0;
+    }
+
+    if (streamEnabled_ || adcOneShotPending_)
+        return -1;
+    adcConversions_++;
+    return convert(channel, now());
+}
+
+// MWS0X, MWS1X, MW050
+int StandIn::pwmHandler(const uint8_t *cmd)
+{
+    uint8_t channel;
+    uint8_t tens;
+    uint8_t ones;
+    uint8_t pin;
+
+    if (cmd[1] != 'W')
+        return -1;
+    if (cmd[2] == 'S')
+    {
+        channel = cmd[3] - '0';
+        if (channel >= APP_NUM_PWM || cmd[4] != 'X')
+            return -1;
+        pwmDuty_[channel] = 0;
+        pin = (channel == 0) ? 0x04 : 0x02;
+        lat_[2] &= ~pin;
+        tris_[2] &= ~pin;
+        pwmEnabled_ |= 1 << channel;
+        return 0;
+    }
+
+    channel = cmd[2] - '0';
+    tens = cmd[3] - '0';
+    ones = cmd[4] - '0';
+    if (channel >= APP_NUM_PWM || tens > 9 || ones > 9)
+        return -1;
+    if (!(pwmEnabled_ & (1 << channel)))
+        return -1;
+    pwmDuty_[channel] = tens * 10 + ones;
+    return 0;
+}
+
+// UWTXE, UWTXD, UWRXE, UWRXD, UWTtX, URRXX. TX is wired to RX.
+int StandIn::uartHandler(const uint8_t *cmd)
+{
+    int c;
+
+    if (cmd[1] == 'R')
+    {
+        if (cmd[2] != 'R' || !uartRx_ || uartLoop_.empty())
+            return -1;
+        c = uartLoop_.front();
+        uartLoop_.pop_front();
+        return c;
+    }
+
+    if (cmd[2] == 'T' && cmd[3] == 'X' && (cmd[4] == 'E' || cmd[4] == 'D'))
+    {
+        uartTx_ = (cmd[4] == 'E');
+    }
+    else if (cmd[2] == 'R' && cmd[3] == 'X' && (cmd[4] == 'E' || cmd[4] == 'D'))
+    {
+        uartRx_ = (cmd[4] == 'E');
+        if (!uartRx_)
+            uartLoop_.clear();
+    }
+    else if (cmd[2] == 'T' && cmd[4] == 'X')
+    {
+        if (!uartTx_)
+            return -1;
+        if (uartRx_ && uartLoop_.size() < UART_FIFO_SIZE)
+            uartLoop_.push_back(cmd[3]);
+        return 0;
+    }
+    else
+        return -1;
+
+    if (uartTx_ || uartRx_)
+    {
+        tris_[2] &= ~0x40;
+        tris_[2] |= 0x80;
+    }
+    return 0;
+}
+
+} // namespace picusb
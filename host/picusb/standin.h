@@ -0,0 +1,356 @@
+/********************************************************************
+ FileName:      standin.h
+ Dependencies:  transport.h
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ StandIn is a Transport with no board behind it. It runs a model of
+ ProcessIO() in Firmware/main.c on a thread of its own, so tools and
+ tests of the host library run without hardware:
+
+   'A'        One shot conversion, answered 17 us later with the time,
+              or at once with sample 0xFFFF while streaming
+   'A' 'D' 'M' 'P' 'U'
+              5 character commands of application.c, in batches
+   0x80       Toggle LED
+   0x81       Pushbutton, see setPushbutton()
+   0x82-0x84  Streaming, with the 64 sample ring and the overruns of
+              the firmware
+   0x85-0x87  A/D statistics, port snapshot and port write
+   0x8A       Device time and the last SOF
+   0x8B       Tagged commands
+   0x8C       Event configuration, with the events of EP3 in ALT_ISO and
+              ALT_BULK_EVENTS: RB4-RB7 changes, debounced sw2/sw3
+              changes and threshold crossings of the converted samples
+   0x8D       Task statistics of the scheduler, for the tasks the model
+              has, in the firmware's priority order. Their cycles are
+              the host time the model spent in them, scaled to 12 MHz.
+   EP0        The VENDOR_xxx requests; the others are applied by the
+              device's VendorTask() before the transfer completes
+
+ The logic analyzer commands are dropped like unknown ones.
+
+ The bus is modelled as full speed bulk: every 1 ms frame starts with an
+ SOF and has room for framePackets transactions of one 64 byte packet.
+ OUT and IN take turns, and the device time moves on by one slot per
+ transaction, so a reply that is ready within the frame goes out in it.
+ The device has one OUT buffer and two IN buffers on each of the reply
+ and the stream endpoint, like the firmware, and the two IN endpoints
+ take turns as well. The host takes at most queueDepth stream packets
+ and REPLY_TRANSFERS replies per frame, since every transfer is
+ resubmitted after its callback. In ALT_ISO the first slot of every
+ frame is the stream's isochronous transaction instead, which goes out
+ empty if the device has nothing armed, and the stream takes no other
+ slot. Packets reach the callback or the ring at the end of their
+ frame, on the frame thread. While waitEvents() waits the event
+ endpoint is polled at the start of every frame, like an interrupt
+ endpoint, without taking a slot, and so is a waiting control transfer.
+
+ The A/D reads a 50 Hz sine on AN0, 100 Hz on AN1 and so on, scaled to
+ the 10 bit range. The UART is looped back: characters sent with UWTtX
+ are read with URRXX while the receiver is enabled. Pin levels of
+ inputs are set with setPins(), outputs read back their latch. The LEDs
+ are LATB0 and LATB1, as on the board, but do not blink the USB state.
+********************************************************************/
+
+#ifndef PICUSB_STANDIN_H
+#define PICUSB_STANDIN_H
+
+#include "transport.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+namespace picusb {
+
+class StandIn : public Transport
+{
+public:
+    // Bulk packets of 64 bytes that fit in a full speed frame with
+    // nothing else on the bus.
+    static const int FRAME_PACKETS = 19;
+    static const int FRAME_US = 1000;
+
+    explicit StandIn(int framePackets = FRAME_PACKETS);
+    ~StandIn();
+
+    void write(const uint8_t *data, int length, unsigned timeoutMs = 1000);
+    int read(uint8_t *packet, unsigned timeoutMs = 1000);
+    int readStream(uint8_t *packet, unsigned timeoutMs = 1000);
+    int waitEvents(Event *events, unsigned timeoutMs = 1000);
+    int controlIn(uint8_t request, uint16_t value, uint16_t index,
+                  uint8_t *data, int length, unsigned timeoutMs = 1000);
+    void controlOut(uint8_t request, uint16_t value, uint16_t index,
+                    const uint8_t *data = NULL, int length = 0,
+                    unsigned timeoutMs = 1000);
+    void setAltSetting(int alt);
+    int altSetting() const { return altSetting_; }
+    void startStreaming(PacketCallback callback, int queueDepth = 8);
+    void startStreaming(PacketRing &ring, int queueDepth = 8);
+    void stopStreaming();
+    std::future<Reply> request(const uint8_t *data, int length);
+
+    bool streaming() const { return streaming_; }
+    bool disconnected() const { return false; }
+    Stats stats() const;
+
+    // Holds the pushbutton (sw2) down or lets it go.
+    void setPushbutton(bool pressed);
+
+    // Levels of the pins of PORTA, PORTB or PORTC (port 0..2) that are
+    // inputs.
+    void setPins(int port, uint8_t levels);
+
+    // Frames since construction.
+    uint64_t frames() const { return frames_; }
+
+private:
+    StandIn(const StandIn &);
+    StandIn &operator=(const StandIn &);
+
+    typedef std::chrono::steady_clock Clock;
+
+    static const int IN_BUFFER_COUNT = 2;
+    static const int STREAM_BUFFER_COUNT = 2;
+    static const int STREAM_RING_SIZE = 64;
+    static const int STREAM_STAMP_COUNT = 4;
+    static const int SCAN_MAX_CHANNELS = 9;
+    static const int APP_NUM_PORTS = 3;
+    static const int APP_NUM_PWM = 2;
+    static const int EVENT_QUEUE_SIZE = 8;
+    static const int EVENT_BUFFER_COUNT = 2;
+
+    // A packet the host wants to send. seq tells write() when it went.
+    struct OutPacket
+    {
+        uint64_t seq;
+        uint8_t data[PACKET_SIZE];
+    };
+
+    // An IN packet of the frame and its endpoint.
+    struct InPacket
+    {
+        bool stream;
+        uint8_t data[PACKET_SIZE];
+    };
+
+    // A task of the firmware scheduler and its statistics.
+    struct Task
+    {
+        uint8_t id;
+        uint8_t priority;
+        void (StandIn::*run)();
+        uint16_t runs;
+        uint32_t cycles;
+        uint16_t maxCycles;
+    };
+
+    // A vendor request the host waits for.
+    struct ControlTransfer
+    {
+        bool in;
+        uint8_t request;
+        uint16_t value;
+        uint16_t index;
+        uint8_t *data;
+        int length;
+        bool setup;         // The device has taken the setup stage
+        bool done;
+        int result;         // Length of the data stage or ERROR_xxx
+    };
+
+    int readFrom(uint8_t *&buffer, uint8_t *packet, unsigned timeoutMs);
+    void frameLoop();
+    bool outTransaction();
+    bool inTransaction(bool &streamTurn, int *counts);
+    bool endpointIn(bool stream, int &count);
+    void isoTransaction();
+    void eventTransaction();
+    int control(ControlTransfer &transfer, unsigned timeoutMs);
+    void controlTransaction();
+    int vendorReply(const ControlTransfer &transfer, uint8_t *reply);
+    void deliver(const InPacket &packet);
+    void queueOut(const uint8_t *data, int length, bool tagged, uint8_t tag,
+                  uint64_t &seq);
+    uint32_t sofClock() const;
+    uint32_t now() const;
+    uint16_t convert(uint8_t channel, uint32_t time) const;
+
+    // The firmware, frame thread only. Names follow main.c.
+    void processIO();
+    void taskRegister(uint8_t id, void (StandIn::*run)(), uint8_t priority);
+    void taskStatsReset();
+    void commandTask();
+    bool dispatch();
+    bool inBufferBusy() const { return inArmed_[inBufferNext_]; }
+    void inBufferSend();
+    bool streamBufferBusy() const { return streamArmed_[streamBufferNext_]; }
+    void streamBufferSend();
+    void tagReply(uint8_t tag);
+    bool tagDefer(uint8_t *tag);
+    bool appBatchRun();
+    bool cmdAdcOneShot();
+    bool cmdToggleLed();
+    bool cmdPushbutton();
+    bool cmdAdcStats();
+    bool cmdPortSnapshot();
+    bool cmdPortWrite();
+    bool cmdTime();
+    bool cmdTaskStats();
+    void portSnapshotSend();
+    void streamStart(uint8_t channel, uint16_t period, uint8_t format);
+    void streamConvert();
+    void pwmTask();
+    void streamTask();
+    void streamAltTask();
+    void adcOneShotTask();
+    bool cmdEventConfig();
+    void eventConfig(uint8_t pins, uint8_t channel, uint16_t low, uint16_t high);
+    void vendorTask();
+    void eventQueue(uint8_t type, uint8_t a, uint8_t b, uint8_t c);
+    void eventPinTask();
+    void eventThreshold(uint8_t channel, uint16_t sample);
+    void buttonTask();
+    void eventTask();
+    void scanSetList(uint8_t count, const uint8_t *channels);
+    void scanSetMask(uint16_t mask);
+    uint8_t port(int index) const;
+
+    // application.c
+    bool isAppCmd(const uint8_t *cmd) const;
+    int appCmd(const uint8_t *cmd);
+    void appBatch(const uint8_t *cmds, uint8_t *reply);
+    int dirHandler(const uint8_t *cmd);
+    int portHandler(const uint8_t *cmd);
+    int adcHandler(const uint8_t *cmd);
+    int pwmHandler(const uint8_t *cmd);
+    int uartHandler(const uint8_t *cmd);
+
+    const int framePackets_;
+    const Clock::time_point start_;
+
+    // Host side, guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable changed_;   // An OUT packet went or a read finished
+    std::deque<OutPacket> hostOut_;
+    uint64_t outQueued_;
+    uint64_t outSent_;
+    uint8_t *readBuffer_;               // A read() is waiting if not NULL
+    uint8_t *readStreamBuffer_;         // Same for readStream()
+    uint8_t *eventReadBuffer_;          // Same for waitEvents()
+    int eventReadLength_;
+    ControlTransfer *control_;          // A control transfer is waiting if not NULL
+    int inPerFrame_;                    // IN packets the host takes per frame
+    RequestTable requests_;
+
+    // Where IN packets go, guarded by deliverMutex_. The frame thread
+    // holds it while it hands packets over, never along with mutex_.
+    std::mutex deliverMutex_;
+    PacketCallback callback_;
+    PacketRing *ring_;
+
+    std::atomic<bool> running_;
+    std::atomic<bool> streaming_;
+    std::atomic<int> altSetting_;       // Of interface 0, set by the host
+    std::atomic<bool> pushbutton_;
+    std::atomic<uint8_t> pins_[APP_NUM_PORTS];
+    std::atomic<uint64_t> frames_;
+    std::atomic<uint64_t> packets_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> isoEmpty_;
+    std::vector<InPacket> delivered_;   // IN packets of the current frame, guarded by mutex_
+    std::thread thread_;
+
+    // Device side, frame thread only
+    uint8_t outPacket_[PACKET_SIZE];
+    bool outFull_;                      // outPacket_ holds a command
+    bool outTagged_;
+    uint8_t outTag_;
+    uint8_t inBuffers_[IN_BUFFER_COUNT][PACKET_SIZE];
+    bool inArmed_[IN_BUFFER_COUNT];
+    int inBufferNext_;                  // Filled next
+    int inBufferOnBus_;                 // Goes out next
+    uint8_t *inPacket_;
+    bool replyTagged_;
+    uint8_t streamBuffers_[STREAM_BUFFER_COUNT][PACKET_SIZE];
+    bool streamArmed_[STREAM_BUFFER_COUNT];
+    int streamBufferNext_;
+    int streamBufferOnBus_;
+    bool streamIso_;
+    uint8_t eventBuffers_[EVENT_BUFFER_COUNT][EVENT_PACKET_SIZE];
+    int eventLengths_[EVENT_BUFFER_COUNT];  // 0 if not armed
+    int eventBufferNext_;
+    int eventBufferOnBus_;
+    bool eventEndpoint_;                // In the alternate setting
+
+    uint16_t sofFrame_;
+    uint32_t sofTime_;
+    int slot_;                          // Of the current frame
+
+    bool streamEnabled_;
+    uint16_t streamRing_[STREAM_RING_SIZE];
+    unsigned streamHead_;
+    unsigned streamTail_;
+    uint32_t streamStamps_[STREAM_STAMP_COUNT];
+    unsigned streamStampHead_;
+    unsigned streamStampTail_;
+    int streamPacketFill_;
+    int streamPacketSamples_;
+    uint8_t streamFormat_;
+    uint16_t streamOverruns_;
+    uint32_t streamPeriod_;
+    uint32_t streamTrigger_;            // Time of the next frame
+    uint16_t scanMask_;
+    uint8_t scanChannels_[SCAN_MAX_CHANNELS];
+    int scanCount_;
+    uint32_t adcConversions_;
+
+    bool adcOneShotPending_;
+    bool adcOneShotFailed_;             // A stream started before the reply
+    uint8_t adcOneShotChannel_;
+    uint32_t adcOneShotStamp_;          // Time the conversion is done
+    bool adcOneShotTagged_;
+    uint8_t adcOneShotTag_;
+
+    std::deque<std::vector<uint8_t> > eventQueue_;  // Up to EVENT_QUEUE_SIZE - 1 records
+    uint16_t eventLost_;
+    uint8_t eventPinMask_;
+    uint8_t eventPortB_;
+    uint8_t eventThresholdChannel_;
+    uint16_t eventThresholdLow_;
+    uint16_t eventThresholdHigh_;
+    bool eventThresholdAbove_;
+    uint8_t buttonState_;
+    int buttonSteady_;
+    uint8_t buttonFrame_;
+
+    bool vendorPending_;                // Status stage waits for vendorTask()
+    uint8_t vendorRequest_;
+    uint16_t vendorValue_;
+    uint16_t vendorIndex_;
+    uint8_t vendorData_[VENDOR_DATA_SIZE];
+
+    std::vector<Task> tasks_;           // In priority order
+    uint32_t taskStatsStart_;
+
+    uint8_t tris_[APP_NUM_PORTS];
+    uint8_t lat_[APP_NUM_PORTS];
+    uint8_t pcfg_;                      // ADCON1 PCFG3:PCFG0
+    uint8_t pwmEnabled_;
+    uint8_t pwmDuty_[APP_NUM_PWM];
+    bool uartTx_;
+    bool uartRx_;
+    std::deque<uint8_t> uartLoop_;
+};
+
+} // namespace picusb
+
+#endif // PICUSB_STANDIN_H
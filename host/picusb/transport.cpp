@@ -0,0 +1,209 @@
+/********************************************************************
+ FileName:      transport.cpp
+ Dependencies:  transport.h
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+********************************************************************/
+
+#include "transport.h"
+
+
+namespace picusb {
+
+const char *errorName(int code)
+{
+    switch (code)
+    {
+    case 0:                     return "LIBUSB_SUCCESS";
+    case ERROR_IO:              return "LIBUSB_ERROR_IO";
+    case ERROR_INVALID_PARAM:   return "LIBUSB_ERROR_INVALID_PARAM";
+    case ERROR_ACCESS:          return "LIBUSB_ERROR_ACCESS";
+    case ERROR_NO_DEVICE:       return "LIBUSB_ERROR_NO_DEVICE";
+    case ERROR_NOT_FOUND:       return "LIBUSB_ERROR_NOT_FOUND";
+    case ERROR_BUSY:            return "LIBUSB_ERROR_BUSY";
+    case ERROR_TIMEOUT:         return "LIBUSB_ERROR_TIMEOUT";
+    case ERROR_OVERFLOW:        return "LIBUSB_ERROR_OVERFLOW";
+    case ERROR_PIPE:            return "LIBUSB_ERROR_PIPE";
+    case ERROR_INTERRUPTED:     return "LIBUSB_ERROR_INTERRUPTED";
+    case ERROR_NO_MEM:          return "LIBUSB_ERROR_NO_MEM";
+    case ERROR_NOT_SUPPORTED:   return "LIBUSB_ERROR_NOT_SUPPORTED";
+    case ERROR_OTHER:           return "LIBUSB_ERROR_OTHER";
+    default:                    return "**UNKNOWN**";
+    }
+}
+
+Error::Error(const std::string &what, int code)
+    : std::runtime_error(what + ": " + errorName(code)), code_(code)
+{
+}
+
+int decodeEvents(const uint8_t *packet, int length, Event *events)
+{
+    int n;
+
+    for (n = 0; (n + 1) * EVENT_RECORD_SIZE <= length && n < EVENT_PACKET_RECORDS; n++)
+    {
+        events[n].type = packet[0];
+        memcpy(events[n].data, packet + 1, sizeof(events[n].data));
+        events[n].stamp = packet[4] | (packet[5] << 8) | (packet[6] << 16) |
+            ((uint32_t)packet[7] << 24);
+        packet += EVENT_RECORD_SIZE;
+    }
+    return n;
+}
+
+static uint16_t word(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t dword(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/******************************************************************************
+ * Vendor requests
+ *****************************************************************************/
+DeviceStatus vendorStatus(Transport &transport)
+{
+    uint8_t reply[VENDOR_STATUS_SIZE];
+    DeviceStatus status;
+
+    if (transport.controlIn(VENDOR_GET_STATUS, 0, 0, reply, sizeof(reply)) < VENDOR_STATUS_SIZE)
+        throw Error("Short status reply", ERROR_IO);
+    status.flags = reply[0];
+    status.format = reply[1];
+    status.scanMask = word(reply + 2);
+    status.period = word(reply + 4);
+    status.overruns = word(reply + 6);
+    status.laState = reply[8];
+    status.eventPins = reply[9];
+    status.eventChannel = reply[10];
+    status.altSetting = reply[11];
+    status.time = dword(reply + 12);
+    return status;
+}
+
+DeviceTime vendorTime(Transport &transport)
+{
+    uint8_t reply[VENDOR_TIME_SIZE];
+    DeviceTime time;
+
+    if (transport.controlIn(VENDOR_GET_TIME, 0, 0, reply, sizeof(reply)) < VENDOR_TIME_SIZE)
+        throw Error("Short time reply", ERROR_IO);
+    time.frame = word(reply);
+    time.sofTime = dword(reply + 2);
+    time.time = dword(reply + 6);
+    return time;
+}
+
+void vendorStreamStart(Transport &transport, uint8_t channel, uint16_t period,
+                       uint8_t format)
+{
+    transport.controlOut(VENDOR_STREAM_START, period, channel | (format << 8));
+}
+
+void vendorStreamStop(Transport &transport)
+{
+    transport.controlOut(VENDOR_STREAM_STOP, 0, 0);
+}
+
+void vendorScanMask(Transport &transport, uint16_t mask)
+{
+    transport.controlOut(VENDOR_SCAN_MASK, mask, 0);
+}
+
+void vendorPortWrite(Transport &transport, int port, uint8_t mask, uint8_t value)
+{
+    transport.controlOut(VENDOR_PORT_WRITE, mask | (value << 8), (uint16_t)port);
+}
+
+void vendorEventConfig(Transport &transport, uint8_t pins, uint8_t channel,
+                       uint16_t low, uint16_t high)
+{
+    uint8_t data[VENDOR_DATA_SIZE] = {
+        pins, channel,
+        (uint8_t)low, (uint8_t)(low >> 8),
+        (uint8_t)high, (uint8_t)(high >> 8)
+    };
+
+    transport.controlOut(VENDOR_EVENT_CONFIG, 0, 0, data, sizeof(data));
+}
+
+/******************************************************************************
+ * RequestTable
+ *****************************************************************************/
+RequestTable::RequestTable()
+    : next_(0)
+{
+    int tag;
+
+    for (tag = 0; tag < TAG_COUNT; tag++)
+        state_[tag] = TAG_FREE;
+}
+
+std::future<Reply> RequestTable::add(uint8_t &tag)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int i;
+
+    for (i = 0; i < TAG_COUNT; i++, next_++)
+    {
+        if (state_[next_] == TAG_RETIRED && now >= retired_[next_])
+            state_[next_] = TAG_FREE;
+        if (state_[next_] == TAG_FREE)
+            break;
+    }
+    if (i == TAG_COUNT)
+        throw Error("All tags in use", ERROR_BUSY);
+    tag = next_++;
+    promises_[tag] = std::promise<Reply>();
+    state_[tag] = TAG_PENDING;
+    return promises_[tag].get_future();
+}
+
+bool RequestTable::complete(const uint8_t *packet, int length)
+{
+    uint8_t tag;
+
+    if (length < TAG_HEADER_SIZE || packet[0] != CMD_TAGGED)
+        return false;
+    tag = packet[1];
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_[tag] == TAG_PENDING)
+        promises_[tag].set_value(Reply(packet + TAG_HEADER_SIZE, packet + length));
+    state_[tag] = TAG_FREE;
+    return true;
+}
+
+void RequestTable::fail(uint8_t tag, int code)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (state_[tag] != TAG_PENDING)
+        return;
+    state_[tag] = TAG_RETIRED;
+    retired_[tag] = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(TAG_RETIRE_MS);
+    promises_[tag].set_exception(std::make_exception_ptr(Error("Request", code)));
+}
+
+void RequestTable::failAll(int code)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    int tag;
+
+    for (tag = 0; tag < TAG_COUNT; tag++)
+    {
+        if (state_[tag] == TAG_PENDING)
+            promises_[tag].set_exception(std::make_exception_ptr(Error("Request", code)));
+        state_[tag] = TAG_FREE;
+    }
+}
+
+} // namespace picusb
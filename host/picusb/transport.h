@@ -0,0 +1,347 @@
+/********************************************************************
+ FileName:      transport.h
+ Dependencies:  packet_ring.h
+ Compiler:      g++ (C++11)
+
+ Software License Agreement:
+ // Yet to insert a license agreement.
+
+********************************************************************
+ File Description:
+
+ The packet protocol of ProcessIO() in Firmware/main.c and the Transport
+ interface that carries it. Device carries it over libusb to a board,
+ StandIn (standin.h) to a software model of the firmware, so tools
+ written against Transport run with or without hardware.
+
+ Commands go out on EP1 OUT and their replies come back on EP1 IN.
+ Stream packets come on an IN endpoint of their own, EP2, so a reply
+ never waits behind a queue of stream packets. EP2 is a bulk endpoint
+ in alternate setting ALT_BULK of interface 0, the default, and in
+ ALT_BULK_EVENTS, and an isochronous one in ALT_ISO. Events, pin
+ changes, button presses and A/D threshold crossings, come on the
+ interrupt endpoint EP3, which the host polls every frame while it waits
+ for them. EP3 is in ALT_BULK_EVENTS and ALT_ISO only, so the default
+ setting reserves no bandwidth.
+
+ Status and configuration also go as vendor requests on EP0, see
+ USBCBCheckOtherReq(). Control transfers have bandwidth of their own in
+ every frame, so they get through while EP1 is busy, and a request that
+ changes the configuration only returns once the firmware has applied it.
+********************************************************************/
+
+#ifndef PICUSB_TRANSPORT_H
+#define PICUSB_TRANSPORT_H
+
+#include "packet_ring.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace picusb {
+
+const int PACKET_SIZE = 64;
+
+// Commands of ProcessIO() in Firmware/main.c
+const uint8_t CMD_TOGGLE_LED = 0x80;
+const uint8_t CMD_PUSHBUTTON = 0x81;
+const uint8_t CMD_STREAM_START = 0x82;
+const uint8_t CMD_STREAM_STOP = 0x83;
+const uint8_t CMD_SCAN_LIST = 0x84;
+const uint8_t CMD_ADC_STATS = 0x85;
+const uint8_t CMD_PORT_SNAPSHOT = 0x86;
+const uint8_t CMD_PORT_WRITE = 0x87;
+const uint8_t CMD_LA_START = 0x88;
+const uint8_t CMD_LA_STOP = 0x89;
+const uint8_t CMD_TIME = 0x8A;
+const uint8_t CMD_TAGGED = 0x8B;
+const uint8_t CMD_EVENT_CONFIG = 0x8C;
+const uint8_t CMD_TASK_STATS = 0x8D;
+
+// A tagged command is CMD_TAGGED, the tag and the command. Its reply is
+// CMD_TAGGED, the tag and the reply of the command, or just the command
+// byte for commands that have no reply of their own.
+const int TAG_HEADER_SIZE = 2;
+const int TAG_COUNT = 256;
+
+// A tag whose command failed to go out may still have reached the board,
+// so it is not reused until its reply comes or this long has passed.
+const unsigned TAG_RETIRE_MS = 5000;
+
+const uint8_t STREAM_CHANNEL_SCAN_LIST = 0xFF;
+const uint8_t STREAM_FORMAT_RAW16 = 0;
+const uint8_t STREAM_FORMAT_PACKED10 = 1;
+const int STREAM_HEADER_SIZE = 8;
+
+// IN transfers kept on the reply endpoint while streaming. The
+// queueDepth of startStreaming() is for the stream endpoint.
+const int REPLY_TRANSFERS = 2;
+
+// Alternate settings of interface 0. ALT_BULK reserves no bandwidth;
+// the stream gets what the bus has left, and there is no event
+// endpoint. ALT_BULK_EVENTS adds the event endpoint, which reserves
+// EVENT_PACKET_SIZE bytes every frame. ALT_ISO has the event endpoint
+// too and reserves one packet for the stream every 1 ms frame, so it
+// keeps its rate on a busy bus, but the firmware then clamps the stream
+// period to at most one packet per frame (44 kS/s in
+// STREAM_FORMAT_PACKED10) and a packet that fails is lost, not retried.
+const int ALT_BULK = 0;
+const int ALT_ISO = 1;
+const int ALT_BULK_EVENTS = 2;
+
+// Event records of EP3, see EventTask() in Firmware/main.c. A packet
+// holds up to EVENT_PACKET_RECORDS of them.
+const int EVENT_RECORD_SIZE = 8;
+const int EVENT_PACKET_SIZE = 32;
+const int EVENT_PACKET_RECORDS = EVENT_PACKET_SIZE / EVENT_RECORD_SIZE;
+const uint8_t EVENT_PINS = 0x01;            // RB4-RB7 changed
+const uint8_t EVENT_BUTTON = 0x02;          // sw2 or sw3 changed, debounced
+const uint8_t EVENT_THRESHOLD = 0x03;       // A/D sample crossed the threshold
+const uint8_t EVENT_LOST = 0x04;            // Records dropped on the device
+const uint8_t EVENT_PIN_MASK = 0xF0;
+const uint8_t EVENT_THRESHOLD_OFF = 0xFF;
+const uint8_t EVENT_THRESHOLD_RISING = 0x80;
+
+// Tasks of the scheduler of the firmware main loop, see SchedulerInit().
+// The CMD_TASK_STATS reply has a TASK_STATS_HEADER (command, task count,
+// first task, records, cycles since the reset) and a TASK_STATS_RECORD
+// per task (id, priority, runs, cycles, longest run), LSB first. Sending
+// TASK_STATS_RESET in [2] starts the statistics over after the reply.
+const int TASK_STATS_HEADER = 8;
+const int TASK_STATS_RECORD = 10;
+const int TASK_STATS_RECORDS = (PACKET_SIZE - TASK_STATS_HEADER) / TASK_STATS_RECORD;
+const uint8_t TASK_STATS_RESET = 0x01;
+const uint8_t TASK_PRIORITY_HIGH = 0;
+const uint8_t TASK_PRIORITY_NORMAL = 1;
+const uint8_t TASK_PRIORITY_LOW = 2;
+const uint8_t TASK_ID_USB = 0;              // USB_POLLING builds only
+const uint8_t TASK_ID_STREAM_ALT = 1;
+const uint8_t TASK_ID_VENDOR = 2;
+const uint8_t TASK_ID_COMMANDS = 3;
+const uint8_t TASK_ID_ADC_ONE_SHOT = 4;
+const uint8_t TASK_ID_STREAM = 5;
+const uint8_t TASK_ID_LA = 6;
+const uint8_t TASK_ID_EVENT = 7;
+const uint8_t TASK_ID_BUTTON = 8;
+const uint8_t TASK_ID_BLINK = 9;
+
+// Vendor requests to the device, see USBCBCheckOtherReq().
+const uint8_t VENDOR_GET_STATUS = 0x01;
+const uint8_t VENDOR_GET_TIME = 0x02;
+const uint8_t VENDOR_STREAM_START = 0x03;
+const uint8_t VENDOR_STREAM_STOP = 0x04;
+const uint8_t VENDOR_SCAN_MASK = 0x05;
+const uint8_t VENDOR_PORT_WRITE = 0x06;
+const uint8_t VENDOR_EVENT_CONFIG = 0x07;
+const int VENDOR_STATUS_SIZE = 16;
+const int VENDOR_TIME_SIZE = 10;
+const int VENDOR_DATA_SIZE = 6;
+const uint8_t VENDOR_STATUS_STREAMING = 0x01;
+const uint8_t VENDOR_STATUS_ISO = 0x02;
+const uint8_t VENDOR_STATUS_ONE_SHOT = 0x04;
+
+struct Event
+{
+    uint8_t type;       // EVENT_xxx
+    uint8_t data[3];    // By type, see EventTask()
+    uint32_t stamp;     // Device time
+};
+
+// Splits an event packet of length bytes into its records. Returns their
+// number.
+int decodeEvents(const uint8_t *packet, int length, Event *events);
+
+// Reply of VENDOR_GET_STATUS.
+struct DeviceStatus
+{
+    uint8_t flags;          // VENDOR_STATUS_xxx
+    uint8_t format;         // STREAM_FORMAT_xxx
+    uint16_t scanMask;
+    uint16_t period;        // Stream period in Timer1 ticks
+    uint16_t overruns;      // Stream samples dropped on the device
+    uint8_t laState;
+    uint8_t eventPins;
+    uint8_t eventChannel;   // Or EVENT_THRESHOLD_OFF
+    uint8_t altSetting;
+    uint32_t time;          // Device time
+};
+
+// Reply of VENDOR_GET_TIME, the same as the CMD_TIME reply.
+struct DeviceTime
+{
+    uint16_t frame;         // Frame number of the last SOF
+    uint32_t sofTime;       // Device time of the last SOF
+    uint32_t time;          // Device time now
+};
+
+// Error codes. They have the values of libusb's LIBUSB_ERROR_xxx, so
+// Device passes on what libusb returns, but a transport that does not
+// use libusb needs no libusb header.
+const int ERROR_IO = -1;
+const int ERROR_INVALID_PARAM = -2;
+const int ERROR_ACCESS = -3;
+const int ERROR_NO_DEVICE = -4;
+const int ERROR_NOT_FOUND = -5;
+const int ERROR_BUSY = -6;
+const int ERROR_TIMEOUT = -7;
+const int ERROR_OVERFLOW = -8;
+const int ERROR_PIPE = -9;
+const int ERROR_INTERRUPTED = -10;
+const int ERROR_NO_MEM = -11;
+const int ERROR_NOT_SUPPORTED = -12;
+const int ERROR_OTHER = -99;
+
+// Name of an ERROR_xxx code, the same as libusb_error_name() gives.
+const char *errorName(int code);
+
+// A transfer failed. code() is one of the ERROR_xxx values.
+class Error : public std::runtime_error
+{
+public:
+    Error(const std::string &what, int code);
+    int code() const { return code_; }
+
+private:
+    int code_;
+};
+
+// Reply to a request(), without the tag header.
+typedef std::vector<uint8_t> Reply;
+
+// Counters of a Transport, updated as packets arrive.
+struct Stats
+{
+    uint64_t packets;       // IN packets delivered
+    uint64_t bytes;         // Bytes in them
+    uint64_t errors;        // IN transfers that failed and were resubmitted
+    uint64_t isoEmpty;      // ALT_ISO frames in which the device sent nothing
+    uint64_t isoErrors;     // ALT_ISO packets that failed, eg CRC errors
+};
+
+// The futures of the requests waiting for their reply, by tag.
+class RequestTable
+{
+public:
+    RequestTable();
+
+    // Takes the next free tag and returns the future for its reply.
+    // Throws Error if all tags are in use.
+    std::future<Reply> add(uint8_t &tag);
+
+    // Hands a tagged reply to its request. Returns false if the packet
+    // is not a tagged reply.
+    bool complete(const uint8_t *packet, int length);
+
+    // Makes the future of tag throw Error and keeps the tag out of use
+    // until its reply comes, which is dropped, or TAG_RETIRE_MS passes.
+    void fail(uint8_t tag, int code);
+
+    // Makes the future of every waiting request throw Error and frees
+    // every tag. Only when no reply to them can come any more.
+    void failAll(int code);
+
+private:
+    enum TagState { TAG_FREE, TAG_PENDING, TAG_RETIRED };
+
+    RequestTable(const RequestTable &);
+    RequestTable &operator=(const RequestTable &);
+
+    std::mutex mutex_;
+    std::promise<Reply> promises_[TAG_COUNT];
+    TagState state_[TAG_COUNT];
+    std::chrono::steady_clock::time_point retired_[TAG_COUNT];
+    uint8_t next_;
+};
+
+class Transport
+{
+public:
+    // Called for every packet of either IN endpoint while streaming,
+    // except the replies of request(). The data is only valid during the
+    // call.
+    typedef std::function<void(const uint8_t *packet, int length)> PacketCallback;
+
+    virtual ~Transport() {}
+
+    // Sends one command packet, padded to PACKET_SIZE. Throws Error.
+    virtual void write(const uint8_t *data, int length, unsigned timeoutMs = 1000) = 0;
+
+    // Reads one packet from the reply endpoint. Only while not
+    // streaming. Returns the length, 0 on timeout. Throws Error.
+    virtual int read(uint8_t *packet, unsigned timeoutMs = 1000) = 0;
+
+    // Same for the stream endpoint, not in ALT_ISO.
+    virtual int readStream(uint8_t *packet, unsigned timeoutMs = 1000) = 0;
+
+    // Waits for the next packet of the event endpoint and decodes it into
+    // events, which has room for EVENT_PACKET_RECORDS. Returns the number
+    // of events, 0 on timeout. Works while streaming too, from any one
+    // thread. Not in ALT_BULK, which has no event endpoint. Throws Error.
+    virtual int waitEvents(Event *events, unsigned timeoutMs = 1000) = 0;
+
+    // Vendor request with an IN data stage of up to length bytes to the
+    // device. Returns the length received. Works while streaming too.
+    // Throws Error, ERROR_PIPE if the device stalls the request.
+    virtual int controlIn(uint8_t request, uint16_t value, uint16_t index,
+                          uint8_t *data, int length, unsigned timeoutMs = 1000) = 0;
+
+    // Same with an OUT data stage, which may be empty.
+    virtual void controlOut(uint8_t request, uint16_t value, uint16_t index,
+                            const uint8_t *data = NULL, int length = 0,
+                            unsigned timeoutMs = 1000) = 0;
+
+    // Selects ALT_BULK, ALT_ISO or ALT_BULK_EVENTS. Not while streaming. The device stops
+    // a running stream when the setting changes. Throws Error.
+    virtual void setAltSetting(int alt) = 0;
+    virtual int altSetting() const = 0;
+
+    // Keeps up to queueDepth stream packets and REPLY_TRANSFERS replies
+    // requested and passes every packet to callback until
+    // stopStreaming(). The device has to be told to send with a
+    // command, eg CMD_STREAM_START.
+    virtual void startStreaming(PacketCallback callback, int queueDepth = 8) = 0;
+
+    // Same, but the stream packets go into ring, which the caller drains
+    // from any one thread. Packets that arrive while the ring is full
+    // are counted in ring.dropped(). Packets on the reply endpoint other
+    // than the replies of request() are dropped.
+    virtual void startStreaming(PacketRing &ring, int queueDepth = 8) = 0;
+
+    // Stops receiving. Requests still waiting for their reply fail.
+    virtual void stopStreaming() = 0;
+
+    // Sends a command of up to PACKET_SIZE - TAG_HEADER_SIZE bytes with
+    // the next free tag and returns at once. The future gets the reply
+    // or throws Error if the device is gone or streaming is stopped
+    // before the reply came. Replies come in while streaming, which is
+    // started without a callback if it is not; read() cannot be used
+    // then. Throws Error if all tags are in use.
+    virtual std::future<Reply> request(const uint8_t *data, int length) = 0;
+
+    virtual bool streaming() const = 0;
+    virtual bool disconnected() const = 0;
+    virtual Stats stats() const = 0;
+};
+
+// The vendor requests of any Transport. All throw Error.
+DeviceStatus vendorStatus(Transport &transport);
+DeviceTime vendorTime(Transport &transport);
+void vendorStreamStart(Transport &transport, uint8_t channel, uint16_t period,
+                       uint8_t format = STREAM_FORMAT_RAW16);
+void vendorStreamStop(Transport &transport);
+void vendorScanMask(Transport &transport, uint16_t mask);
+// port 0-2 for PORTA-PORTC, only the bits set in mask are written.
+void vendorPortWrite(Transport &transport, int port, uint8_t mask, uint8_t value);
+// As CMD_EVENT_CONFIG.
+void vendorEventConfig(Transport &transport, uint8_t pins, uint8_t channel,
+                       uint16_t low, uint16_t high);
+
+} // namespace picusb
+
+#endif // PICUSB_TRANSPORT_H
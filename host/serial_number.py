@@ -0,0 +1,106 @@
+#!/bin/python
+
+"""
+Serial numbers of the PIC18F2550 libUSB device.
+
+The serial number string descriptor of the firmware is linked at a fixed
+flash address (SERIAL_NUMBER_ADDRESS in Firmware/usb_config.h) and holds
+SERIAL_LENGTH UTF-16 characters. patch_hex() writes a new number into a
+copy of the firmware hex file, so every board can be programmed with its
+own number. find() and find_all() pick boards by that number.
+
+Usage: serial_number.py <firmware.hex> <serial> <output.hex>
+       serial_number.py --list
+"""
+
+import sys
+import usb.core
+import usb.util
+
+VENDOR_ID = 0x04d8
+PRODUCT_ID = 0x0204
+
+SERIAL_ADDRESS = 0x7FC0
+SERIAL_LENGTH = 8
+
+def descriptor(serial):
+    """ String descriptor bytes of serial, right aligned and padded with
+    '0' to SERIAL_LENGTH characters."""
+    if len(serial) > SERIAL_LENGTH:
+        raise ValueError("serial number longer than %d" % SERIAL_LENGTH)
+    serial = serial.rjust(SERIAL_LENGTH, '0')
+    data = [2 + 2*SERIAL_LENGTH, 0x03]
+    for c in serial:
+        if ord(c) < 0x20 or ord(c) > 0x7E:
+            raise ValueError("serial number must be printable ASCII")
+        data += [ord(c), 0]
+    return data
+
+def _record(line):
+    data = [int(line[i:i+2], 16) for i in range(1, len(line), 2)]
+    if sum(data) & 0xFF:
+        raise ValueError("bad checksum: " + line)
+    return data
+
+def _line(data):
+    data = data[:-1] + [-sum(data[:-1]) & 0xFF]
+    return ':' + ''.join('%02X' % b for b in data)
+
+def patch_hex(lines, serial):
+    """ Returns the Intel hex lines with the serial number descriptor
+    replaced. The descriptor must already be in the file."""
+    new = dict((SERIAL_ADDRESS + i, b) for i, b in enumerate(descriptor(serial)))
+    found = set()
+    base = 0
+    out = []
+    for line in lines:
+        line = line.strip()
+        if not line.startswith(':'):
+            out.append(line)
+            continue
+        data = _record(line)
+        count, kind = data[0], data[3]
+        if kind == 0x04:
+            base = (data[4] << 24) | (data[5] << 16)
+        elif kind == 0x00:
+            address = base | (data[1] << 8) | data[2]
+            for i in range(count):
+                if address + i in new:
+                    data[4 + i] = new[address + i]
+                    found.add(address + i)
+            line = _line(data)
+        out.append(line)
+    if len(found) != len(new):
+        raise ValueError("no serial number descriptor at 0x%04X" %
+                         SERIAL_ADDRESS)
+    return out
+
+def serial_of(dev):
+    """ Serial number string of a device found with pyusb."""
+    return usb.util.get_string(dev, 256, dev.iSerialNumber)
+
+def find_all():
+    """ Every board attached, as a dictionary by serial number."""
+    devs = usb.core.find(find_all=True, idVendor=VENDOR_ID,
+                         idProduct=PRODUCT_ID)
+    return dict((serial_of(dev), dev) for dev in devs)
+
+def find(serial=None):
+    """ The board with the serial number, or the first one if serial is
+    None. Returns None if there is no such board."""
+    if serial is None:
+        return usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    return find_all().get(serial.rjust(SERIAL_LENGTH, '0'))
+
+if __name__ == '__main__':
+    if sys.argv[1:] == ['--list']:
+        for serial, dev in sorted(find_all().items()):
+            print "%s  bus %d address %d" % (serial, dev.bus, dev.address)
+        sys.exit(0)
+    if len(sys.argv) != 4:
+        print __doc__
+        sys.exit(1)
+    lines = patch_hex(open(sys.argv[1]).readlines(), sys.argv[2])
+    out = open(sys.argv[3], 'w')
+    out.write('\r\n'.join(lines) + '\r\n')
+    out.close()
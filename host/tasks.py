@@ -0,0 +1,77 @@
+#!/bin/python
+
+"""
+Where the 12 MIPS of the PIC18F2550 libUSB device go.
+
+The firmware main loop is a cooperative scheduler: every pass runs the
+tasks that are due, highest priority first, and times each run with
+Timer3. TASK_STATS (0x8D) reads the runs, the cycles and the longest run
+of every task since the statistics were last reset, with the cycles
+that went by in that time. Cycles of interrupts that hit a task count as
+the task's; what no task accounts for is the scheduler's own. A reply
+holds 5 tasks, so stats() reads as many as there are and resets the
+statistics with the last one.
+
+Usage: python tasks.py [interval]
+Prints the load of every task each interval seconds (1 by default)
+until Ctrl-C.
+"""
+
+import struct
+import sys
+import time
+import usb.core
+
+TASK_STATS = 0x8D
+STATS_RESET = 0x01
+HEADER_SIZE = 8
+RECORD_SIZE = 10
+
+NAMES = ['usb', 'stream alt', 'vendor', 'commands', 'adc one shot',
+         'stream', 'la', 'event', 'button', 'blink']
+PRIORITIES = ['high', 'normal', 'low']
+
+def stats(dev, reset=True):
+    """ Return the cycles since the last reset and a list of
+    (id, priority, runs, cycles, longest run) per task in priority order"""
+    tasks = []
+    first = 0
+    while True:
+        dev.write(1, [TASK_STATS, first, 0])
+        reply = bytearray(dev.read(0x81, 64, timeout=1000))
+        count, first, n = reply[1], reply[2], reply[3]
+        elapsed = struct.unpack_from('<I', str(reply), 4)[0]
+        for i in range(n):
+            tasks.append(struct.unpack_from('<BBHIH', str(reply),
+                                            HEADER_SIZE + i*RECORD_SIZE))
+        first += n
+        if n == 0 or first >= count:
+            break
+    if reset:
+        dev.write(1, [TASK_STATS, count, STATS_RESET])
+        dev.read(0x81, 64, timeout=1000)
+    return elapsed, tasks
+
+def name(task_id):
+    if task_id < len(NAMES):
+        return NAMES[task_id]
+    return 'task %d' % task_id
+
+if __name__ == '__main__':
+    interval = float(sys.argv[1]) if len(sys.argv) > 1 else 1.0
+    dev = usb.core.find(idVendor=0x04d8, idProduct=0x0204)
+    dev.set_configuration()
+
+    stats(dev)
+    while True:
+        time.sleep(interval)
+        elapsed, tasks = stats(dev)
+        busy = 0
+        for task_id, priority, runs, cycles, longest in tasks:
+            busy += cycles
+            print "%-13s %-6s %6d runs %5.1f %%, longest %5d cycles" % (
+                name(task_id), PRIORITIES[priority] if priority < 3 else '?',
+                runs, 100.0*cycles/max(elapsed, 1), longest)
+        print "%-13s %-6s %11s %5.1f %%" % ('scheduler', '', '',
+                                            100.0*(elapsed - busy)/max(elapsed, 1))
+        print
@@ -0,0 +1,88 @@
+#!/bin/python
+
+"""
+Vendor requests of the PIC18F2550 libUSB device on the control endpoint.
+
+They carry status and configuration next to the commands of EP1, and
+get through while EP1 is busy, since control transfers have bandwidth
+of their own in every frame. A request that changes the configuration
+returns once the firmware has applied it; one the firmware does not
+know is stalled.
+
+    GET_STATUS    0x01  16 bytes, see status()
+    GET_TIME      0x02  frame, SOF time and device time, as CMD_TIME
+    STREAM_START  0x03  wValue period, wIndex channel | format << 8
+    STREAM_STOP   0x04
+    SCAN_MASK     0x05  wValue, bit n scans ANn
+    PORT_WRITE    0x06  wIndex port 0-2, wValue mask | value << 8
+    EVENT_CONFIG  0x07  6 bytes: pins, channel, low, high as events.py
+
+Usage: python vendor.py
+Prints the status and the time of the device.
+"""
+
+import struct
+import usb.core
+
+GET_STATUS = 0x01
+GET_TIME = 0x02
+STREAM_START = 0x03
+STREAM_STOP = 0x04
+SCAN_MASK = 0x05
+PORT_WRITE = 0x06
+EVENT_CONFIG = 0x07
+
+VENDOR_IN = 0xC0    # Device to host, vendor, device
+VENDOR_OUT = 0x40
+
+STATUS_STREAMING = 0x01
+STATUS_ISO = 0x02
+STATUS_ONE_SHOT = 0x04
+
+CYCLE_TIME = 1.0/12e6
+
+def status(dev):
+    """ Return the status as a dict"""
+    data = dev.ctrl_transfer(VENDOR_IN, GET_STATUS, 0, 0, 16)
+    (flags, fmt, mask, period, overruns, la_state, pins, channel, alt,
+     stamp) = struct.unpack('<BBHHHBBBBI', str(bytearray(data)))
+    return {'streaming': bool(flags & STATUS_STREAMING),
+            'iso': bool(flags & STATUS_ISO),
+            'one_shot': bool(flags & STATUS_ONE_SHOT),
+            'format': fmt, 'scan_mask': mask, 'period': period,
+            'overruns': overruns, 'la_state': la_state, 'event_pins': pins,
+            'event_channel': channel, 'alt_setting': alt, 'time': stamp}
+
+def device_time(dev):
+    """ Return the frame number of the last SOF, the device time of that
+    SOF and the device time now"""
+    data = dev.ctrl_transfer(VENDOR_IN, GET_TIME, 0, 0, 10)
+    return struct.unpack('<HII', str(bytearray(data)))
+
+def stream_start(dev, channel, period=0, fmt=0):
+    dev.ctrl_transfer(VENDOR_OUT, STREAM_START, period, channel | fmt << 8)
+
+def stream_stop(dev):
+    dev.ctrl_transfer(VENDOR_OUT, STREAM_STOP, 0, 0)
+
+def scan_mask(dev, mask):
+    dev.ctrl_transfer(VENDOR_OUT, SCAN_MASK, mask, 0)
+
+def port_write(dev, port, mask, value):
+    """ Write the bits of mask of LATA, LATB or LATC (port 0-2)"""
+    dev.ctrl_transfer(VENDOR_OUT, PORT_WRITE, mask | (value & mask) << 8, port)
+
+def event_config(dev, pins, channel, low=0, high=0):
+    dev.ctrl_transfer(VENDOR_OUT, EVENT_CONFIG, 0, 0,
+                      [pins, channel, low & 0xFF, low >> 8,
+                       high & 0xFF, high >> 8])
+
+if __name__ == '__main__':
+    dev = usb.core.find(idVendor=0x04d8, idProduct=0x0204)
+    dev.set_configuration()
+
+    for key, value in sorted(status(dev).items()):
+        print "%-14s %s" % (key, value)
+    frame, sof, now = device_time(dev)
+    print "frame %d, SOF at %.6f s, now %.6f s" % (frame, sof*CYCLE_TIME,
+                                                   now*CYCLE_TIME)